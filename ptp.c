@@ -6,6 +6,7 @@
  * it under the terms of the GNU General Public License version 3 as
  * published by the Free Software Foundation.
  */
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -16,9 +17,9 @@
 #include <stdlib.h>
 #include <time.h>
 #include <semaphore.h>
-#include <iconv.h>
 #include <dirent.h>
 #include <stdint.h>
+#include <limits.h>
 #include <glib.h>
 
 #include <sys/types.h>
@@ -30,6 +31,7 @@
 #include <sys/wait.h>
 #include <sys/utsname.h>
 #include <sys/inotify.h>
+#include <sys/fanotify.h>
 
 #include <asm/byteorder.h>
 
@@ -37,6 +39,12 @@
 #include <linux/usb/functionfs.h>
 #include <linux/usb/ch9.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 /*
 + * cpu_to_le16/32 are used when initializing structures, a context where a
 + * function call is not allowed. To solve this, we code cpu_to_le16/32 in a way
@@ -80,6 +88,7 @@ static int verbose;
 #define PTP_MANUFACTURER	"Linux Foundation"
 #define PTP_MODEL		"PTP Gadget"
 #define PTP_STORAGE_DESC	"SD/MMC"
+#define PTP_FIXED_STORAGE_DESC	"Internal Storage"
 #define PTP_MODEL_DIR		"100LINUX"
 
 #define THUMB_SUPPORT
@@ -88,6 +97,11 @@ static int verbose;
 #define FORMAT_SUPPORT
 #undef  FORMAT_SUPPORT
 
+#if defined(THUMB_SUPPORT) && defined(HAVE_LIBJPEG)
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
 /*-------------------------------------------------------------------------*/
 
 /* USB subclass value = the protocol encapsulation */
@@ -310,7 +324,13 @@ static const struct
 	}							\
 } while (0)
 
-#define STORE_ID		0x00010001
+/* StorageIDs: physical storage in the upper, logical in the lower 16 bits */
+#define STORE_ID(index)		((((index) + 1) << 16) | 0x0001)
+#define MAX_STORAGES		16
+
+/* Object handles carry the storage index + 1 in their upper bits */
+#define HANDLE_STORE_SHIFT	24
+#define HANDLE_NUMBER_MASK	((1 << HANDLE_STORE_SHIFT) - 1)
 
 #define PTP_PARAM_UNUSED	0
 #define PTP_PARAM_ANY		0xffffffff
@@ -431,6 +451,11 @@ enum pima15740_data_format {
 	PIMA15740_FMT_I_TIFF_IT			= 0x380e,
 };
 
+enum pima15740_association_type {
+	PIMA15740_AT_UNDEFINED			= 0,
+	PIMA15740_AT_GENERIC_FOLDER		= 0x0001,
+};
+
 enum pima15740_storage_type {
 	PIMA15740_STORAGE_UNDEFINED		= 0,
 	PIMA15740_STORAGE_FIXED_ROM		= 0x0001,
@@ -455,6 +480,7 @@ enum pima15740_access_capability {
 static const char manuf[] = PTP_MANUFACTURER;
 static const char model[] = PTP_MODEL;
 static const char storage_desc[] = PTP_STORAGE_DESC;
+static const char fixed_storage_desc[] = PTP_FIXED_STORAGE_DESC;
 
 #define SUPPORTED_OPERATIONS					\
 	__constant_cpu_to_le16(PIMA15740_OP_GET_DEVICE_INFO),	\
@@ -478,6 +504,7 @@ static uint16_t dummy_supported_operations[] = {
 #ifdef FORMAT_SUPPORT
 #define SUPPORTED_FORMATS					\
 	__constant_cpu_to_le16(PIMA15740_FMT_A_UNDEFINED),	\
+	__constant_cpu_to_le16(PIMA15740_FMT_A_ASSOCIATION),	\
 	__constant_cpu_to_le16(PIMA15740_FMT_A_TEXT),		\
 	__constant_cpu_to_le16(PIMA15740_FMT_I_EXIF_JPEG),	\
 	__constant_cpu_to_le16(PIMA15740_FMT_I_TIFF_EP),	\
@@ -487,7 +514,8 @@ static uint16_t dummy_supported_operations[] = {
 	__constant_cpu_to_le16(PIMA15740_FMT_I_JFIF),
 #else
 #define SUPPORTED_FORMATS					\
-	__constant_cpu_to_le16(PIMA15740_FMT_A_UNDEFINED),
+	__constant_cpu_to_le16(PIMA15740_FMT_A_UNDEFINED),	\
+	__constant_cpu_to_le16(PIMA15740_FMT_A_ASSOCIATION),
 #endif
 
 static uint16_t dummy_supported_formats[] = {
@@ -497,6 +525,8 @@ static uint16_t dummy_supported_formats[] = {
 #define SUPPORTED_EVENTS						\
 	__constant_cpu_to_le16(PIMA15740_EVENT_OBJECT_ADDED),		\
 	__constant_cpu_to_le16(PIMA15740_EVENT_OBJECT_REMOVED),		\
+	__constant_cpu_to_le16(PIMA15740_EVENT_STORE_ADDED),		\
+	__constant_cpu_to_le16(PIMA15740_EVENT_STORE_REMOVED),		\
 	__constant_cpu_to_le16(PIMA15740_EVENT_OBJECT_INFO_CHANGED),
 
 static uint16_t dummy_supported_events[] = {
@@ -559,18 +589,10 @@ struct my_storage_info {
 	uint64_t	free_space_in_bytes;
 	uint32_t	free_space_in_images;
 	uint8_t		desc_len;
-	uint8_t		desc[sizeof(storage_desc) * 2];
-	uint8_t		volume_label_len;
+	uint8_t		desc[sizeof(fixed_storage_desc) * 2];
+	/* followed by the volume label */
 } __attribute__ ((packed));
 
-static struct my_storage_info storage_info = {
-	.storage_type		= __constant_cpu_to_le16(PIMA15740_STORAGE_REMOVABLE_RAM),
-	.filesystem_type	= __constant_cpu_to_le16(PIMA15740_FILESYSTEM_DCF),
-	.access_capability	= __constant_cpu_to_le16(PIMA15740_ACCESS_CAP_RW),
-	.desc_len		= sizeof(storage_desc),
-	.volume_label_len	= 0,
-};
-
 /* full duplex data, with at least three threads: ep0, sink, and source */
 
 static int bulk_in = -ENXIO;
@@ -578,13 +600,25 @@ static int bulk_out = -ENXIO;
 static int control = -ENXIO;
 static int interrupt = -ENXIO;
 static int session = -EINVAL;
-static int notify_fd = -ENXIO;
+static int use_fanotify;		/* -f, asked for, see store->use_fanotify */
 static sem_t reset;
-static sem_t dbaccess;
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *mapdir = "/var/cache/ptp/handles";
+
+/* When the data of an upload has to be on the storage, see "-d" */
+enum durability {
+	DURABLE_NONE,		/* left to the kernel */
+	DURABLE_SYNC,		/* synced before the response */
+	DURABLE_GROUP,		/* synced together, once the host moves on */
+};
+static enum durability durability = DURABLE_NONE;
 
-static iconv_t ic, uc;
-static char *root;
-static char *lockdir = "/tmp";
+/* Uploads up to this size take the fast path, see "-s" */
+#define SMALL_OBJECT_SIZE	(64 * 1024)
+#define SMALL_OBJECT_MAX	(1024 * 1024)
+static uint32_t small_object_size = SMALL_OBJECT_SIZE;
+static void *small_buf;			/* receives them, owned by the bulk thread */
 
 #define	NEVENT		5
 
@@ -599,17 +633,32 @@ enum ptp_status {
 static enum ptp_status status = PTP_WAITCONFIG;
 
 static pthread_t bulk_pthread;
-static pthread_t inotify_pthread;
+static pthread_t mount_pthread;
 
 #define __stringify_1(x)	#x
 #define __stringify(x)		__stringify_1(x)
 
 #define BUF_SIZE	4096
+/* PTP strings have a one byte length, which includes the trailing '\0' */
+#define PTP_STRING_MAX	255
 #ifdef THUMB_SUPPORT
 #define THUMB_WIDTH	160
 #define THUMB_HEIGHT	120
 #define THUMB_SIZE	__stringify(THUMB_WIDTH) "x" __stringify(THUMB_HEIGHT)
 #define THUMB_LOCATION    "/var/cache/ptp/thumb/"
+#define THUMB_QUALITY	75
+#define THUMB_MAX_WORKERS	4
+/* Thumbnails made ahead of GetThumb for the handles following the last one */
+#define THUMB_PREFETCH		8
+#define THUMB_QUEUE_MAX		64	/* prefetches beyond are dropped */
+/* All thumbnails are appended to one pack file, found through its index */
+#define THUMB_PACK	THUMB_LOCATION "thumbs.pack"
+#define THUMB_INDEX	THUMB_LOCATION "thumbs.idx"
+#define THUMB_PACK_SLOTS	1024		/* at least, a power of 2 */
+#define THUMB_PACK_SLACK	(8 * 1024 * 1024)	/* unused bytes before compaction */
+/* Memory for thumbnails kept to serve GetThumb again, and the largest one */
+#define THUMB_CACHE_SIZE	(2 * 1024 * 1024)
+#define THUMB_CACHE_MAX_ENTRY	(64 * 1024)
 #endif
 
 struct ptp_event_container {
@@ -641,2322 +690,7021 @@ struct ptp_object_info {
 	uint8_t		strings[];
 } __attribute__ ((packed));
 
+/*
+ * Identity of a file, which survives restarts and remounts. The birth time
+ * tells reused inode numbers apart, where the filesystem reports one.
+ */
+struct file_key {
+	uint64_t	ino;
+	uint64_t	btime;		/* nanoseconds since the epoch, or 0 */
+};
+
 struct obj_list {
-	struct obj_list		*next;
 	uint32_t		handle;
+	struct file_key		key;
+	time_t			mtime;		/* to spot changes when rescanning */
+	struct storage		*store;
+	GList			*link;		/* in store->objects */
+	struct obj_list		*parent;	/* NULL for the storage root */
+	int			wd;		/* inotify watch, associations only */
+	struct dir_handle	*fh;		/* fanotify handle, associations only */
+	uint32_t		thumb_offset;	/* of the EXIF thumbnail, 0 if none */
 	size_t			info_size;
 	char			name[256];
 	struct ptp_object_info	info;
 };
 
-#define GFOREACH(item, list) for(iterator = list; (item = NULL, 1) && iterator && (item = iterator->data, 1); iterator = g_slist_next(iterator))
+/*
+ * Every storage has its own catalog, watcher thread and lock, so that a
+ * slow medium busy with ingesting changes never stalls requests to the
+ * others. The bulk thread only takes the lock of the storage a request
+ * is about, and drops it before long data transfers.
+ */
+struct storage {
+	uint32_t		id;
+	char			*root;
+	int			root_fd;	/* O_PATH, -1 for removable ones */
+	int			removable;	/* comes and goes with its mount */
+	int			available;
+
+	/* watcher progress for notify_barrier(), protected by notify_lock */
+	pthread_mutex_t		notify_lock;
+	pthread_cond_t		notify_cond;
+	int			notify_busy;	/* events read, not applied yet */
+	unsigned int		notify_applied;	/* batches applied */
+	int			watching;	/* watcher thread is running */
+
+	sem_t			dbaccess;	/* protects everything below */
+	struct my_storage_info	info;
+	uint8_t			label_len;
+	uint8_t			label[2 * 256];
+
+	/* all objects in enumeration order */
+	GQueue			objects;
+	/*
+	 * handed out handles, only the last one is given back, by a discarded
+	 * ObjectInfo, that never made it into the catalog
+	 */
+	int			last_object_number;
+	/* handle -> struct obj_list */
+	GHashTable		*object_index;
+	/* parent handle (0 for the storage root) -> GQueue of child objects */
+	GHashTable		*child_index;
+
+	/* handles of directories to rescan after lost events, 0 is the root */
+	GQueue			rescan;
+
+	/* relative paths of uploads in progress, the watcher keeps away */
+	GHashTable		*uploads;
+
+	/* statfs() result, adjusted for the changes we know about since */
+	uint64_t		space_free;
+	uint64_t		space_reserved;	/* for the pending upload */
+	unsigned long		block_size;
+	int			space_stale;	/* statfs() is due */
+	struct timespec		space_first;	/* first change since statfs() */
+	struct timespec		space_last;	/* latest change */
+
+	/* struct file_key -> handle number, persisted in the map file */
+	GHashTable		*handle_map;
+	int			map_fd;
+	unsigned int		map_records;
+
+	int			notify_fd;
+	int			use_fanotify;	/* notify_fd is fanotify, not inotify */
+	pthread_t		watcher;
+	int			root_wd;
+	struct dir_handle	*root_fh;
+	/* inotify watch descriptor -> association */
+	GHashTable		*watch_index;
+	/* fanotify directory handle -> association */
+	GHashTable		*fh_index;
+};
 
-static GSList *images;
-/* number of objects, including associations - decrement when deleting */
-static int last_object_number;
+static struct storage storages[MAX_STORAGES];
+static int num_storages;
 
+/*
+ * Pending SendObjectInfo, waiting for its SendObject. Only the bulk thread
+ * touches it, its parent is looked up again by handle before linking, the
+ * watcher might have removed the association in the meantime.
+ */
 static struct obj_list *object_info_p;
+/* Path of object_info_p relative to the root of its storage */
+static char object_info_path[PATH_MAX];
+static int object_info_fd = -1;		/* its unnamed file, see open_tmpfile() */
+static int object_info_alloc;		/* its blocks are allocated already */
+
+static int put_string(char *buf, size_t size, const char *s);
+static int get_string(char *buf, size_t size, const char *s, size_t len);
+
+static void notify_barrier(struct storage *store);
+static int storage_mounted(const struct storage *store);
+
+/* What the headers of an image tell, zero what they don't */
+struct image_probe {
+	enum pima15740_data_format format;	/* by content, not name */
+	uint32_t	width;
+	uint32_t	height;
+	uint32_t	depth;		/* bits per pixel */
+	char		date[16];	/* DateTimeOriginal as YYYYMMDDThhmmss */
+	/* a JPEG thumbnail in the EXIF data */
+	struct exif_thumb {
+		uint32_t	offset;	/* in the image file */
+		uint32_t	length;
+		uint32_t	width;
+		uint32_t	height;
+	} thumb;
+};
+
+/*
+ * A file as found on disk, for add_object(). It is stat()ed and probed
+ * without holding the storage lock, reading the headers of large images
+ * from slow media would hold up the bulk thread otherwise.
+ */
+struct scan_entry {
+	char			*name;
+	struct stat		st;
+	struct file_key		key;
+	struct image_probe	ip;
+};
+
+static void probe_fd(int fd, struct image_probe *ip);
+static void probe_image(int dirfd, const char *name, struct image_probe *ip);
+static int probe_entry(int dirfd, const char *name, struct scan_entry *e);
+static int add_object(struct storage *store, struct obj_list *parent,
+		      const char *name, const struct scan_entry *e, int notify);
+#ifdef THUMB_SUPPORT
+static int thumb_ready(struct storage *store, const char *path);
+static void thumb_request(struct storage *store, uint32_t handle, const char *path,
+			  int urgent);
+static void thumb_wait(uint32_t handle);
+static void thumb_prefetch(struct storage *store, uint32_t handle);
+static void start_thumb_workers(void);
+
+/* An encoded thumbnail in memory, valid for one version of its object */
+struct thumb_cached {
+	uint32_t	handle;
+	time_t		mtime;
+	size_t		size;
+	GList		*link;		/* in the LRU, NULL once evicted */
+	int		refs;
+	unsigned char	data[];
+};
 
-static size_t put_string(iconv_t ic, char *buf, const char *s, size_t len);
-static size_t get_string(iconv_t ic, char *buf, const char *s, size_t len);
+static struct thumb_cached *thumb_cache_get(uint32_t handle, time_t mtime, size_t size);
+static struct thumb_cached *thumb_cache_fill(uint32_t handle, time_t mtime, int fd,
+					     off_t offset, size_t size);
+static void thumb_cache_release(struct thumb_cached *tc);
+static void thumb_cache_drop(uint32_t handle);
 
-static void inotify_sync();
+static int thumb_pack_open(const char *name, off_t *offset, size_t length);
+static void thumb_pack_remove(const char *name);
+static int thumb_pack_rename(const char *old, const char *new);
+#endif
 
-static int object_handle_valid(unsigned int h)
+/* Look up an available storage by StorageID */
+static struct storage *find_storage(uint32_t id)
 {
-	struct obj_list *obj;
-	GSList *iterator;
+	int i;
 
-	GFOREACH(obj, images) {
-		if (obj->handle == h)
-			return 1;
-	}
+	for (i = 0; i < num_storages; i++)
+		if (storages[i].id == id && storages[i].available)
+			return &storages[i];
 
-	return 0;
+	return NULL;
 }
 
-/*-------------------------------------------------------------------------*/
-
-static void make_response(struct ptp_container *s_cntn, struct ptp_container *r_cntn,
-			  enum pima15740_response_code code, size_t len)
+static struct storage *handle_storage(uint32_t handle)
 {
-	s_cntn->id = r_cntn->id;
-	s_cntn->type = __cpu_to_le16(PTP_CONTAINER_TYPE_RESPONSE_BLOCK);
-	s_cntn->code = __cpu_to_le16(code);
-	s_cntn->length = __cpu_to_le32(len);
+	unsigned int index = handle >> HANDLE_STORE_SHIFT;
+
+	if (!index || index > (unsigned int)num_storages)
+		return NULL;
+
+	return &storages[index - 1];
 }
 
-static int bulk_write(void *buf, size_t length)
+static void lock_storage(struct storage *store)
 {
-	size_t count = 0;
-	int ret;
+	sem_wait(&store->dbaccess);
+}
 
-	do {
-		ret = write(bulk_in, buf + count, length - count);
-		if (ret < 0) {
-			if (errno != EINTR)
-				return ret;
+static void unlock_storage(struct storage *store)
+{
+	sem_post(&store->dbaccess);
+}
 
-			/* Need to wait for control thread to finish reset */
-			sem_wait(&reset);
-		} else
-			count += ret;
-	} while (count < length);
+/* Must be called with the storage of the handle locked */
+static struct obj_list *find_object(uint32_t handle)
+{
+	struct storage *store = handle_storage(handle);
 
-	if (verbose)
-		fprintf(stderr, "BULK-IN Sent %u bytes\n", (unsigned int)count);
+	if (!store || !store->available)
+		return NULL;
 
-	return count;
+	return g_hash_table_lookup(store->object_index, GUINT_TO_POINTER(handle));
 }
 
-static int bulk_read(void *buf, size_t length)
+/* Returns the storage of a handle locked, or NULL for invalid handles */
+static struct storage *lock_object_storage(uint32_t handle)
 {
-	size_t count = 0;
-	int ret;
+	struct storage *store = handle_storage(handle);
 
-	do {
-		ret = read(bulk_out, buf + count, length - count);
-		if (ret < 0) {
-			if (errno != EINTR)
-				return ret;
+	if (store)
+		lock_storage(store);
 
-			/* Need to wait for control thread to finish reset */
-			sem_wait(&reset);
-		} else
-			count += ret;
-	} while (count < length);
+	return store;
+}
 
-	if (verbose)
-		fprintf(stderr, "BULK-OUT Read %u bytes\n", (unsigned int)count);
+static int object_is_association(const struct obj_list *obj)
+{
+	return __le16_to_cpu(obj->info.object_format) == PIMA15740_FMT_A_ASSOCIATION;
+}
 
-	return count;
+static uint32_t parent_handle(const struct obj_list *obj)
+{
+	return obj->parent ? obj->parent->handle : 0;
 }
 
-static int interrupt_write(void *buf, size_t length) {
-	size_t count = 0;
-	int ret;
+/* Children of an association, or of the storage root for handle 0 */
+static GQueue *child_list(struct storage *store, uint32_t parent)
+{
+	return g_hash_table_lookup(store->child_index, GUINT_TO_POINTER(parent));
+}
 
-	do {
-		ret = write(interrupt, buf + count, length - count);
-		if (ret < 0) {
-			if (errno != EINTR)
-				return ret;
+static struct obj_list *find_child(struct storage *store, struct obj_list *parent,
+				   const char *name)
+{
+	GQueue *children = child_list(store, parent ? parent->handle : 0);
+	GList *l;
 
-			/* Need to wait for control thread to finish reset */
-			sem_wait(&reset);
-		} else
-			count += ret;
-	} while (count < length);
+	for (l = children ? children->head : NULL; l; l = l->next) {
+		struct obj_list *obj = l->data;
 
-	if (verbose)
-		fprintf(stderr, "INTERRUPT sent %u bytes\n", (unsigned int) count);
+		if (!strcmp(obj->name, name))
+			return obj;
+	}
 
-	return count;
+	return NULL;
 }
 
-static int send_event(enum pima15740_event_code code, unsigned int param1) {
-	struct ptp_event_container event;
-	int len = 12 + 3 * 4; /* 12 + parameters*4 */
+/* The association holding the file at path, NULL for the root or if unknown */
+static struct obj_list *find_folder(struct storage *store, const char *path)
+{
+	struct obj_list *dir = NULL;
+	char name[PATH_MAX], *p, *slash;
+
+	snprintf(name, sizeof(name), "%s", path);
+	for (p = name; (slash = strchr(p, '/')); p = slash + 1) {
+		*slash = '\0';
+		dir = find_child(store, dir, p);
+		if (!dir || !object_is_association(dir))
+			return NULL;
+	}
 
-	event.length = __cpu_to_le32(len);
-	event.type = __cpu_to_le16(PTP_CONTAINER_TYPE_EVENT_BLOCK);
-	event.event_code = __cpu_to_le16(code);
-	event.transaction_id = __cpu_to_le32(0);
-	event.parameter1 = __cpu_to_le32(param1);
-	event.parameter2 = __cpu_to_le32(0);
-	event.parameter3 = __cpu_to_le32(0);
+	return dir;
+}
 
-	if (verbose)
-		fprintf(stderr, "sending event, code: 0x%04X, parameter1: 0x%08X\n", code, param1);
+static uint32_t storage_handle(const struct storage *store, uint32_t number)
+{
+	return ((store - storages + 1) << HANDLE_STORE_SHIFT) | (number & HANDLE_NUMBER_MASK);
+}
 
-	return interrupt_write(&event, len);
+static uint32_t new_handle(struct storage *store)
+{
+	return storage_handle(store, ++store->last_object_number);
 }
 
-static int send_object_handles(void *recv_buf, void *send_buf, size_t send_len)
+static void catalog_add_child(struct obj_list *obj)
 {
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
-	unsigned long length;
-	uint32_t *param;
-	uint32_t store_id;
-	struct obj_list *obj;
-	GSList *iterator = NULL;
-	int ret;
-	uint32_t *handle;
-	uint32_t format;
-	int obj_to_send = g_slist_length(images);
+	struct storage *store = obj->store;
+	uint32_t parent = parent_handle(obj);
+	GQueue *children = child_list(store, parent);
 
-	length	= __le32_to_cpu(r_container->length);
+	if (!children) {
+		children = g_queue_new();
+		g_hash_table_insert(store->child_index, GUINT_TO_POINTER(parent), children);
+	}
+	g_queue_push_tail(children, obj);
+}
 
-	param = (uint32_t *)r_container->payload;
-	store_id = __le32_to_cpu(*param);
+static void catalog_insert(struct obj_list *obj)
+{
+	struct storage *store = obj->store;
 
-	/* supported storage IDs: 0x00010001 - our single storage, 0xffffffff - all stores */
-	if (store_id != STORE_ID && store_id != PTP_PARAM_ANY) {
-		make_response(s_container, r_container,
-			      PIMA15740_RESP_INVALID_STORAGE_ID, sizeof(*s_container));
-		return 0;
-	}
+	catalog_add_child(obj);
 
-	format = __le32_to_cpu(*(param + 1));
-	if (length > 16 && format != PTP_PARAM_UNUSED && format != PTP_PARAM_ANY) {
-		make_response(s_container, r_container,
-			      PIMA15740_RESP_SPECIFICATION_BY_FORMAT_NOT_SUPPORTED,
-			      sizeof(*s_container));
-		return 0;
-	}
+	g_hash_table_insert(store->object_index, GUINT_TO_POINTER(obj->handle), obj);
+	g_queue_push_tail(&store->objects, obj);
+	obj->link = store->objects.tail;
+}
 
-	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-	*(uint32_t *)s_container->payload = __cpu_to_le32(obj_to_send);
-	s_container->length = __cpu_to_le32((obj_to_send + 1) * sizeof(uint32_t) +
-					    sizeof(*s_container));
+static void catalog_remove(struct obj_list *obj)
+{
+	struct storage *store = obj->store;
+	GQueue *children = child_list(store, parent_handle(obj));
 
-	handle = (uint32_t *)s_container->payload + 1;
+	if (children)
+		g_queue_remove(children, obj);
 
-	GFOREACH(obj, images) {
-		if ((void *)handle == send_buf + send_len) {
-			ret = bulk_write(send_buf, send_len);
-			if (ret < 0) {
-				errno = EPIPE;
-				return ret;
-			}
-			handle = send_buf;
+	if (object_is_association(obj)) {
+		children = child_list(store, obj->handle);
+		if (children) {
+			g_hash_table_remove(store->child_index, GUINT_TO_POINTER(obj->handle));
+			g_queue_free(children);
 		}
-
-		*handle++ = __cpu_to_le32(obj->handle);
 	}
-	if ((void *)handle > send_buf) {
-		ret = bulk_write(send_buf, (void *)handle - send_buf);
-		if (ret < 0) {
-			errno = EPIPE;
-			return ret;
-		}
+
+	g_hash_table_remove(store->object_index, GUINT_TO_POINTER(obj->handle));
+	g_queue_delete_link(&store->objects, obj->link);
+}
+
+/*
+ * Path of an object relative to the storage root. Returns the path length or
+ * -1 with errno set, if it doesn't fit.
+ */
+static int get_child_path(const struct obj_list *parent, const char *name,
+			  char *buf, size_t size)
+{
+	int len = 0, ret;
+
+	if (parent) {
+		len = get_child_path(parent->parent, parent->name, buf, size);
+		if (len < 0)
+			return len;
+		if ((size_t)len + 1 >= size)
+			goto toolong;
+		buf[len++] = '/';
 	}
 
-	/* Prepare response */
-	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+	ret = snprintf(buf + len, size - len, "%s", name);
+	if (ret < 0 || (size_t)ret >= size - len)
+		goto toolong;
 
-	return 0;
+	return len + ret;
+
+toolong:
+	errno = ENAMETOOLONG;
+	return -1;
 }
 
-static int send_object_info(void *recv_buf, void *send_buf, size_t send_len)
+static int get_object_path(const struct obj_list *obj, char *buf, size_t size)
 {
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
-	uint32_t *param;
-	struct obj_list *obj = NULL;
-	GSList *iterator;
-	int ret;
-	uint32_t handle;
-	size_t count, total, offset;
-	void *info;
-	enum pima15740_response_code code = PIMA15740_RESP_OK;
+	return get_child_path(obj->parent, obj->name, buf, size);
+}
 
-	param = (uint32_t *)r_container->payload;
-	handle = __le32_to_cpu(*param);
+/*
+ * Turn a path relative to the storage root into an absolute one. All storages
+ * are served in parallel, so nobody can rely on the working directory.
+ */
+static int get_storage_path(const struct storage *store, const char *path,
+			    char *buf, size_t size)
+{
+	int ret;
 
-	GFOREACH(obj, images) {
-		if (obj->handle == handle)
-			break;
+	ret = snprintf(buf, size, "%s/%s", store->root, path);
+	if (ret < 0 || (size_t)ret >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
 	}
 
-	if (!obj) {
-		code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
-		goto send_resp;
+	return ret;
+}
+
+/*
+ * A directory descriptor and a name for the *at() calls to find path,
+ * which is relative to the storage root. Fixed storages are opened
+ * relative to their root, that saves resolving its path every time.
+ * Removable ones get an absolute path, nothing is held open there, so
+ * that they can be unmounted. Returns -1 if the path is too long.
+ */
+static int storage_at(const struct storage *store, const char *path,
+		      char *buf, size_t size, const char **name)
+{
+	if (store->root_fd >= 0) {
+		*name = path;
+		return store->root_fd;
 	}
 
-	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-	total = obj->info_size + sizeof(*s_container);
-	s_container->length = __cpu_to_le32(total);
-	offset = sizeof(*s_container);
-	info = &obj->info;
+	if (get_storage_path(store, path, buf, size) < 0)
+		return -1;
+	*name = buf;
 
-	/* Object Info cannot get > 4096 bytes - four strings make a maximum of 2048
-	 * bytes plus a fixed-size block, but we play safe for the case someone
-	 * makes the buffers smaller */
+	return AT_FDCWD;
+}
 
-	while (total) {
-		count = min(total, send_len);
-		memcpy(send_buf + offset, info, count - offset);
-		info += count - offset;
-		ret = bulk_write(send_buf, count);
-		if (ret < 0) {
-			errno = EPIPE;
-			return ret;
-		}
-		offset = 0;
-		total -= count;
+/*
+ * stat() which also fills in the file identity for the handle map. statx()
+ * is only needed for the birth time, older kernels get along without.
+ */
+static int stat_file(int dirfd, const char *path, int flags, struct stat *st,
+		     struct file_key *key)
+{
+	struct statx stx;
+
+	if (statx(dirfd, path, flags, STATX_BASIC_STATS | STATX_BTIME, &stx) < 0) {
+		if (errno != ENOSYS)
+			return -1;
+		if (fstatat(dirfd, path, st, flags) < 0)
+			return -1;
+		key->ino = st->st_ino;
+		key->btime = 0;
+		return 0;
 	}
 
-send_resp:
-	/* Prepare response */
-	make_response(s_container, r_container, code, sizeof(*s_container));
+	memset(st, 0, sizeof(*st));
+	st->st_mode = stx.stx_mode;
+	st->st_ino = stx.stx_ino;
+	st->st_size = stx.stx_size;
+	st->st_mtime = stx.stx_mtime.tv_sec;
+
+	key->ino = stx.stx_ino;
+	key->btime = stx.stx_mask & STATX_BTIME ?
+		(uint64_t)stx.stx_btime.tv_sec * 1000000000 + stx.stx_btime.tv_nsec : 0;
 
 	return 0;
 }
 
-static int send_object_or_thumb(void *recv_buf, void *send_buf, size_t send_len, int thumb)
+/* Lock and thumbnail files live in flat directories, fold the path into one name */
+static void flatten_path(char *dst, size_t size, const char *path)
 {
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
-	uint32_t *param;
-	struct obj_list *obj = NULL;
-	GSList *iterator;
-	int ret;
-	uint32_t handle;
-	size_t count, total, offset, file_size;
-	int fd = -1;
-	char name[256];
-	unsigned char xferbuf[8*1024];
-	size_t unused __attribute__((unused));
+	size_t i;
 
-	param = (uint32_t *)r_container->payload;
-	handle = __le32_to_cpu(*param);
+	for (i = 0; i + 1 < size && path[i]; i++)
+		dst[i] = path[i] == '/' ? '%' : path[i];
+	dst[i] = '\0';
+}
 
-	GFOREACH(obj, images) {
-		if (obj->handle == handle)
-			break;
-	}
+/*
+ * Handle map file: a header followed by an append-only log of records, later
+ * records win. Numbers are stored without the storage bits, so that the
+ * order of the storages on the command line doesn't matter. Once most of the
+ * records are stale, the file is rewritten from the catalog.
+ */
+#define HANDLE_MAP_MAGIC	0x48505450	/* "PTPH" */
+#define HANDLE_MAP_VERSION	1
+#define HANDLE_MAP_SLACK	1024
+
+struct handle_map_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	last_number;
+	uint32_t	reserved;
+} __attribute__ ((packed));
 
-	if (!obj) {
-		make_response(s_container, r_container, PIMA15740_RESP_INVALID_OBJECT_HANDLE,
-			      sizeof(*s_container));
-		return 0;
-	}
+struct handle_map_record {
+	uint64_t	ino;
+	uint64_t	btime;
+	uint32_t	number;
+	uint32_t	reserved;
+} __attribute__ ((packed));
 
-	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-	offset = sizeof(*s_container);
+static guint file_key_hash(gconstpointer key)
+{
+	const struct file_key *k = key;
 
-#ifdef THUMB_SUPPORT
-	if (!thumb) {
-		strncpy(name, obj->name, sizeof(name) - 1);
-		name[sizeof(name) - 1] = '\0';
-		ret = chdir(root);
-		file_size = __le32_to_cpu(obj->info.object_compressed_size);
-	} else {
-		char *dot = strrchr(obj->name, '.');
-		*dot = '\0';			/* We know there is a dot in the name */
-		snprintf(name, sizeof(name) - 1, "%s.thumb.jpeg", obj->name);
-		*dot = '.';
-		name[sizeof(name) - 1] = '\0';
-		ret = chdir(THUMB_LOCATION);
-		file_size = __le32_to_cpu(obj->info.thumb_compressed_size);
-	}
-#else
-	(void)thumb;
-	strncpy(name, obj->name, sizeof(name) - 1);
-	name[sizeof(name) - 1] = '\0';
-	ret = chdir(root);
-	file_size = __le32_to_cpu(obj->info.object_compressed_size);
-#endif
+	return (guint)(k->ino ^ (k->ino >> 32) ^ k->btime ^ (k->btime >> 32));
+}
 
-	total = file_size + sizeof(*s_container);
-	if (verbose)
-		fprintf(stderr, "%s(): total %lu\n", __func__, total);
-	s_container->length = __cpu_to_le32(total);
+static gboolean file_key_equal(gconstpointer a, gconstpointer b)
+{
+	const struct file_key *ka = a, *kb = b;
 
-	if (!ret)
-		fd = open(name, O_RDONLY);
-	if (ret < 0 || fd < 0) {
-		make_response(s_container, r_container, PIMA15740_RESP_INCOMPLETE_TRANSFER,
-			      sizeof(*s_container));
-		return 0;
-	}
+	return ka->ino == kb->ino && ka->btime == kb->btime;
+}
 
-	count = min(total, send_len);
-	unused = read(fd, send_buf + offset, count - offset);
-	ret = bulk_write(send_buf, count);
-	if (ret < 0) {
-		errno = EPIPE;
-		goto out;
+static void get_map_filename(char *fname, size_t fname_size, const struct storage *store,
+			     const char *suffix)
+{
+	char name[256];
+
+	flatten_path(name, sizeof(name), store->root);
+	snprintf(fname, fname_size, "%s/%.240s.handles%s", mapdir, name, suffix);
+}
+
+static void handle_map_insert(struct storage *store, const struct file_key *key,
+			      uint32_t number)
+{
+	struct file_key *k = malloc(sizeof(*k));
+
+	if (!k)
+		return;
+
+	*k = *key;
+	g_hash_table_replace(store->handle_map, k, GUINT_TO_POINTER(number));
+}
+
+static void handle_map_load(struct storage *store)
+{
+	struct handle_map_record rec[256];
+	struct handle_map_header hdr;
+	struct file_key key;
+	char fname[PATH_MAX];
+	ssize_t len;
+	int fd, i;
+
+	get_map_filename(fname, sizeof(fname), store, "");
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    __le32_to_cpu(hdr.magic) != HANDLE_MAP_MAGIC ||
+	    __le32_to_cpu(hdr.version) != HANDLE_MAP_VERSION) {
+		fprintf(stderr, "Ignoring invalid handle map %s\n", fname);
+		close(fd);
+		return;
 	}
-	total -= count;
-	send_len = min((size_t)(8 * 1024), sizeof(xferbuf));
+	store->last_object_number = __le32_to_cpu(hdr.last_number);
 
-	while (total) {
-		count = min(total, send_len);
-		unused = read(fd, xferbuf, count);
-		ret = bulk_write(xferbuf, count);
-		if (ret < 0) {
-			errno = EPIPE;
-			goto out;
+	/* a torn record at the end is simply dropped */
+	while ((len = read(fd, rec, sizeof(rec))) >= (ssize_t)sizeof(rec[0])) {
+		for (i = 0; i < len / (ssize_t)sizeof(rec[0]); i++) {
+			uint32_t number = __le32_to_cpu(rec[i].number) & HANDLE_NUMBER_MASK;
+
+			if (!number)
+				continue;
+
+			key.ino = __le64_to_cpu(rec[i].ino);
+			key.btime = __le64_to_cpu(rec[i].btime);
+			handle_map_insert(store, &key, number);
+			store->map_records++;
+
+			if (number > (uint32_t)store->last_object_number)
+				store->last_object_number = number;
 		}
-		total -= count;
 	}
-	ret = 0;
-
-out:
 	close(fd);
 
-	if (!ret)
-		/* Prepare response */
-		make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+	/* Running out of numbers, start over rather than wrap around */
+	if (store->last_object_number > HANDLE_NUMBER_MASK / 2) {
+		fprintf(stderr, "Handle map %s exhausted, renumbering\n", fname);
+		g_hash_table_remove_all(store->handle_map);
+		store->last_object_number = 0;
+		store->map_records = 0;
+	}
 
-	return ret;
+	if (verbose)
+		fprintf(stderr, "%u handles of %s remembered\n",
+			g_hash_table_size(store->handle_map), store->root);
 }
 
-static int send_storage_ids(void *recv_buf, void *send_buf, size_t send_len)
+static int handle_map_write(int fd, const void *buf, size_t len)
 {
-	struct ptp_container *s_container = send_buf;
-	uint32_t *param;
-	int ret;
-	(void) send_len;
-
-	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-	s_container->length = __cpu_to_le32(20);
-	param = (uint32_t *)s_container->payload;
+	ssize_t ret;
 
-	*param = __cpu_to_le32(1);
-	*(param + 1) = __cpu_to_le32(STORE_ID);
-	ret = bulk_write(send_buf, 20);
-	if (ret < 0) {
-		errno = EPIPE;
-		return ret;
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
 	}
 
-	/* Prepare response */
-	memcpy(send_buf, recv_buf, sizeof(*s_container));
-	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_RESPONSE_BLOCK);
-	s_container->code = __cpu_to_le16(PIMA15740_RESP_OK);
-	s_container->length = __cpu_to_le32(sizeof(*s_container));
-
 	return 0;
 }
 
-static int send_storage_info(void *recv_buf, void *send_buf, size_t send_len)
+/*
+ * Rewrite the map file with the objects of the catalog only and forget about
+ * the rest. Called with the storage locked.
+ */
+static void handle_map_compact(struct storage *store)
 {
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
-	uint32_t *param;
-	uint32_t store_id;
-	unsigned long long bytes;
-	int ret;
-	size_t count;
-	struct statfs fs;
-	(void) send_len;
+	struct handle_map_record rec[256];
+	struct handle_map_header hdr;
+	char fname[PATH_MAX], tmp[PATH_MAX];
+	struct obj_list *obj;
+	GList *l;
+	int fd, n = 0, ret;
 
-	param = (uint32_t *)r_container->payload;
-	store_id = __le32_to_cpu(*param);
+	get_map_filename(fname, sizeof(fname), store, "");
+	get_map_filename(tmp, sizeof(tmp), store, ".new");
 
-	if (verbose)
-		fprintf(stderr, "%lu bytes storage info\n", sizeof(storage_info));
+	fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		if (verbose)
+			fprintf(stderr, "Cannot write handle map %s: %s\n",
+				tmp, strerror(errno));
+		return;
+	}
 
-	if (store_id != STORE_ID) {
-		make_response(s_container, r_container,
-			      PIMA15740_RESP_INVALID_STORAGE_ID, sizeof(*s_container));
-		return 0;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = __cpu_to_le32(HANDLE_MAP_MAGIC);
+	hdr.version = __cpu_to_le32(HANDLE_MAP_VERSION);
+	hdr.last_number = __cpu_to_le32(store->last_object_number);
+	ret = handle_map_write(fd, &hdr, sizeof(hdr));
+
+	g_hash_table_remove_all(store->handle_map);
+	store->map_records = 0;
+
+	for (l = store->objects.head; l && !ret; l = l->next) {
+		obj = l->data;
+
+		rec[n].ino = __cpu_to_le64(obj->key.ino);
+		rec[n].btime = __cpu_to_le64(obj->key.btime);
+		rec[n].number = __cpu_to_le32(obj->handle & HANDLE_NUMBER_MASK);
+		rec[n].reserved = 0;
+		handle_map_insert(store, &obj->key, obj->handle & HANDLE_NUMBER_MASK);
+		store->map_records++;
+
+		if (++n == ARRAY_SIZE(rec) || !l->next) {
+			ret = handle_map_write(fd, rec, n * sizeof(rec[0]));
+			n = 0;
+		}
 	}
 
-	ret = statfs(root, &fs);
-	if (ret < 0) {
-		make_response(s_container, r_container,
-			      PIMA15740_RESP_ACCESS_DENIED, sizeof(*s_container));
-		return 0;
+	if (!ret)
+		ret = fsync(fd);
+	close(fd);
+
+	if (ret < 0 || rename(tmp, fname) < 0) {
+		fprintf(stderr, "Cannot write handle map %s: %s\n", fname, strerror(errno));
+		unlink(tmp);
+		return;
 	}
 
-	if (verbose > 1)
-		fprintf(stderr, "Block-size %ld, total 0x%lx, free 0x%lx\n",
-			fs.f_bsize, fs.f_blocks, fs.f_bfree);
+	if (store->map_fd >= 0)
+		close(store->map_fd);
+	store->map_fd = open(fname, O_WRONLY | O_APPEND);
+}
 
-	count = sizeof(storage_info) + sizeof(*s_container);
+/* Remember the handle of a new object, called with the storage locked */
+static void handle_map_append(struct storage *store, const struct file_key *key,
+			      uint32_t handle)
+{
+	struct handle_map_record rec;
+	uint32_t number = handle & HANDLE_NUMBER_MASK;
 
-	s_container->type	= __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-	s_container->length	= __cpu_to_le32(count);
+	handle_map_insert(store, key, number);
 
-	bytes					= (unsigned long long)fs.f_bsize * fs.f_blocks;
-	storage_info.max_capacity		= __cpu_to_le64(bytes);
-	bytes					= (unsigned long long)fs.f_bsize * fs.f_bfree;
-	storage_info.free_space_in_bytes	= __cpu_to_le64(bytes);
-	storage_info.free_space_in_images	= __cpu_to_le32(PTP_PARAM_ANY);
+	if (store->map_fd < 0)
+		return;
 
-	memcpy(send_buf + sizeof(*s_container), &storage_info, sizeof(storage_info));
-	ret = bulk_write(s_container, count);
-	if (ret < 0) {
-		errno = EPIPE;
-		return ret;
+	rec.ino = __cpu_to_le64(key->ino);
+	rec.btime = __cpu_to_le64(key->btime);
+	rec.number = __cpu_to_le32(number);
+	rec.reserved = 0;
+	if (handle_map_write(store->map_fd, &rec, sizeof(rec)) < 0) {
+		fprintf(stderr, "Cannot append to handle map of %s: %s\n",
+			store->root, strerror(errno));
+		close(store->map_fd);
+		store->map_fd = -1;
+		return;
 	}
+	store->map_records++;
+}
 
-	/* Prepare response */
-	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+/* Compact, when most records are stale. Called with the storage locked. */
+static void handle_map_check(struct storage *store)
+{
+	if (store->map_records > 2 * g_queue_get_length(&store->objects) + HANDLE_MAP_SLACK)
+		handle_map_compact(store);
+}
 
-	return 0;
+/*
+ * Hand out the remembered handle of a file or a new one. Hard links share a
+ * key, so a remembered handle can already be in use.
+ */
+static uint32_t assign_handle(struct storage *store, const struct file_key *key)
+{
+	gpointer number;
+	uint32_t handle;
+
+	number = g_hash_table_lookup(store->handle_map, key);
+	if (number) {
+		handle = storage_handle(store, GPOINTER_TO_UINT(number));
+		if (!g_hash_table_lookup(store->object_index, GUINT_TO_POINTER(handle)))
+			return handle;
+	}
+
+	handle = new_handle(store);
+	handle_map_append(store, key, handle);
+
+	return handle;
 }
 
-#ifdef DEBUG
-const char *oid[] =
-{	"StorageID             ",
-	"ObjectFormat          ",
-	"ProtectionStatus      ",
-	"ObjectCommpressedSize ",
-	"ThumbFormat           ",
-	"ThumbCommpressedSize  ",
-	"ThumbPixWidth         ",
-	"ThumbPixHeight        ",
-	"ImagePixWidth         ",
-	"ImagePixHeight        ",
-	"ImageBitDepth         ",
-	"ParentObject          ",
-	"AssotiationType       ",
-	"AssotiationDesc       ",
-	"SequenceNumber        ",
-	"Filename              ",
-	"CaptureDate           ",
-	"ModificationDate      ",
-	"Keywords              ",
+/*
+ * fanotify identifies directories by their file handle, whose bytes serve
+ * as the key into fh_index.
+ */
+struct dir_handle {
+	unsigned int	len;
+	unsigned char	data[sizeof(struct file_handle) + MAX_HANDLE_SZ];
 };
 
-static void dump_object_info(const struct ptp_object_info *i)
+static guint dir_handle_hash(gconstpointer key)
 {
-	char buf[256];
-	int idx;
+	const struct dir_handle *dh = key;
+	guint hash = 2166136261u;
+	unsigned int i;
 
-	fprintf(stdout, "%s\n", __func__);
-	fprintf(stdout, "-------------------------------\n");
-	fprintf(stdout, "%s: 0x%.8x\n", oid[0], i->storage_id);
-	fprintf(stdout, "%s: 0x%.4x\n", oid[1], i->object_format);
-	fprintf(stdout, "%s: 0x%.4x\n", oid[2], i->protection_status);
-	fprintf(stdout, "%s: %d\n",     oid[3], i->object_compressed_size);
-	fprintf(stdout, "%s: 0x%.4x\n", oid[4], i->thumb_format);
-	fprintf(stdout, "%s: %d\n",     oid[5], i->thumb_compressed_size);
-	fprintf(stdout, "%s: %d\n",     oid[6], i->thumb_pix_width);
-	fprintf(stdout, "%s: %d\n",     oid[7], i->thumb_pix_height);
-	fprintf(stdout, "%s: %d\n",	oid[8], i->image_pix_width);
-	fprintf(stdout, "%s: %d\n",	oid[9], i->image_pix_height);
-	fprintf(stdout, "%s: %d\n",	oid[10], i->image_bit_depth);
-	fprintf(stdout, "%s: 0x%.8x\n", oid[11], i->parent_object);
-	fprintf(stdout, "%s: 0x%.4x\n", oid[12], i->association_type);
-	fprintf(stdout, "%s: 0x%.8x\n", oid[13], i->association_desc);
-	fprintf(stdout, "%s: %d\n",	oid[14], i->sequence_number);
-	get_string(uc, (char *)buf, (const char *)&i->strings[1],
-		   i->strings[0]);
-	fprintf(stdout, "%s: %s, len: %d\n", oid[15], buf, i->strings[0]);
-	idx = i->strings[0] * 2 + 1;
-	if (i->strings[idx]) {
-		get_string(uc, (char *)buf, (const char *)&i->strings[idx + 1],
-			   i->strings[idx]);
-		fprintf(stdout, "%s: %s, len: %d\n",
-			oid[16], buf, i->strings[idx]);
-	}
-	fprintf(stdout, "-------------------------------\n");
+	/* FNV-1a */
+	for (i = 0; i < dh->len; i++)
+		hash = (hash ^ dh->data[i]) * 16777619u;
+
+	return hash;
 }
 
-static void dump_obj(const char *s)
+static gboolean dir_handle_equal(gconstpointer a, gconstpointer b)
 {
-	struct obj_list *obj;
-	GSList *iterator;
+	const struct dir_handle *da = a, *db = b;
 
-	printf("%s\n", s);
+	return da->len == db->len && !memcmp(da->data, db->data, da->len);
+}
 
-	GFOREACH(obj, images) {
-		printf("obj: 0x%p, next 0x%p, handle %u, name %s\n",
-			obj, obj->next, obj->handle, obj->name);
+static struct dir_handle *get_dir_handle(const char *path)
+{
+	struct dir_handle *dh;
+	struct file_handle *fh;
+	int mount_id;
+
+	dh = malloc(sizeof(*dh));
+	if (!dh)
+		return NULL;
+
+	fh = (struct file_handle *)dh->data;
+	fh->handle_bytes = MAX_HANDLE_SZ;
+	if (name_to_handle_at(AT_FDCWD, path, fh, &mount_id, 0) < 0) {
+		fprintf(stderr, "name_to_handle_at %s: %s\n", path, strerror(errno));
+		free(dh);
+		return NULL;
 	}
-	printf("\n");
+	dh->len = sizeof(*fh) + fh->handle_bytes;
+
+	return dh;
 }
-#endif
 
-static void delete_thumb(struct obj_list *obj)
+/*
+ * Start watching a directory, NULL is the storage root. With inotify every
+ * directory needs a watch of its own, with fanotify the whole filesystem is
+ * marked once and we only have to remember the directory handle.
+ */
+static void watch_directory(struct storage *store, struct obj_list *dir, const char *path)
 {
-#ifdef THUMB_SUPPORT
-	char thumb[256];
-	char *dot;
+	char abspath[PATH_MAX];
+	struct dir_handle *dh;
+	int wd;
 
-	if (__le16_to_cpu(obj->info.thumb_format) != PIMA15740_FMT_I_JFIF)
+	if (store->notify_fd < 0)
 		return;
 
-	dot = strrchr(obj->name, '.');
-	if (!dot || dot == obj->name)
+	if (path)
+		snprintf(abspath, sizeof(abspath), "%s/%s", store->root, path);
+	else
+		snprintf(abspath, sizeof(abspath), "%s", store->root);
+
+	if (store->use_fanotify) {
+		/* One mark for the whole filesystem, events outside of root are dropped */
+		if (!dir && fanotify_mark(store->notify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+					  FAN_CLOSE_WRITE | FAN_CREATE | FAN_DELETE |
+					  FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR,
+					  AT_FDCWD, abspath) < 0) {
+			fprintf(stderr, "fanotify mark %s: %s\n", abspath, strerror(errno));
+			return;
+		}
+
+		dh = get_dir_handle(abspath);
+		if (!dir)
+			store->root_fh = dh;
+		else if ((dir->fh = dh))
+			g_hash_table_insert(store->fh_index, dh, dir);
 		return;
+	}
 
-	*dot = 0;
-	snprintf(thumb, sizeof(thumb), THUMB_LOCATION "%s.thumb.jpeg",
-		 obj->name);
-	*dot = '.';
+	wd = inotify_add_watch(store->notify_fd, abspath,
+			       IN_CLOSE_WRITE | IN_DELETE | IN_CREATE |
+			       IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+	if (wd < 0)
+		fprintf(stderr, "inotify add watch %s: %s\n", abspath, strerror(errno));
 
-	if (unlink(thumb))
-		fprintf(stderr, "Cannot delete %s: %s\n",
-			thumb, strerror(errno));
-#else
-	(void)obj;
-#endif
+	if (!dir)
+		store->root_wd = wd;
+	else if ((dir->wd = wd) >= 0)
+		g_hash_table_insert(store->watch_index, GINT_TO_POINTER(wd), dir);
 }
 
-static enum pima15740_response_code delete_file(const char *name)
+static void unwatch_directory(struct storage *store, struct obj_list *dir)
 {
-	struct stat st;
-	int ret;
-	uid_t euid;
-	gid_t egid;
+	int *wd = dir ? &dir->wd : &store->root_wd;
+	struct dir_handle **dh = dir ? &dir->fh : &store->root_fh;
 
-	/* access() is unreliable on NFS, we use stat() instead */
-	ret = stat(name, &st);
-	if (ret < 0) {
-		fprintf(stderr, "Cannot stat %s: %s\n", name, strerror(errno));
-		return PIMA15740_RESP_GENERAL_ERROR;
+	if (*wd >= 0) {
+		g_hash_table_remove(store->watch_index, GINT_TO_POINTER(*wd));
+		inotify_rm_watch(store->notify_fd, *wd);
+		*wd = -1;
 	}
 
-	euid = geteuid();
-	if (euid == st.st_uid) {
-		if (!(st.st_mode & S_IWUSR))
-			return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
-		goto del;
+	if (*dh) {
+		g_hash_table_remove(store->fh_index, *dh);
+		free(*dh);
+		*dh = NULL;
 	}
+}
 
-	egid = getegid();
-	if (egid == st.st_gid) {
-		if (!(st.st_mode & S_IWGRP))
-			return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
-		goto del;
-	}
+#ifdef THUMB_SUPPORT
+/*
+ * Thumbnails are filed under <storage id>-<path>.thumb.jpeg with the
+ * extension of the image stripped and directory separators folded, see
+ * flatten_path(). That name is their key in the thumbnail pack.
+ */
+static int thumb_filename(const struct storage *store, const char *path, char *buf, size_t size)
+{
+	size_t len;
+	char *dot;
+	int ret;
 
-	if (!(st.st_mode & S_IWOTH))
-		return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
+	ret = snprintf(buf, size, "%08x-", store->id);
+	if (ret < 0 || (size_t)ret >= size)
+		return -1;
+	flatten_path(buf + ret, size - ret, path);
 
-del:
-	ret = unlink(name);
-	if (ret) {
-		fprintf(stderr, "Cannot delete %s: %s\n",
-			name, strerror(errno));
-		return PIMA15740_RESP_GENERAL_ERROR;
-	}
+	dot = strrchr(buf + ret, '.');
+	if (!dot || dot == buf + ret || dot[-1] == '%')
+		return -1;
+	len = dot - buf;
 
-	return PIMA15740_RESP_OK;
+	ret = snprintf(dot, size - len, ".thumb.jpeg");
+	if (ret < 0 || (size_t)ret >= size - len)
+		return -1;
+
+	return 0;
 }
 
-static int update_free_space(void)
+static int get_thumb_filename(const struct obj_list *obj, char *buf, size_t size)
 {
-	unsigned long long bytes;
-	struct statfs fs;
-	int ret;
-
-	ret = statfs(root, &fs);
-	if (ret < 0) {
-		fprintf(stderr, "statfs %s: %s\n", root, strerror(errno));
-		return ret;
-	}
+	char path[PATH_MAX];
 
-	if (verbose > 1)
-		fprintf(stdout, "Block-size %ld, total %d, free %d\n",
-			fs.f_bsize, (int)fs.f_blocks, (int)fs.f_bfree);
+	if (get_object_path(obj, path, sizeof(path)) < 0)
+		return -1;
 
-	bytes = (unsigned long long)fs.f_bsize * fs.f_bfree;
-	storage_info.free_space_in_bytes = __cpu_to_le64(bytes);
-	return 0;
+	return thumb_filename(obj->store, path, buf, size);
 }
+#endif
 
-static void delete_object(void *recv_buf, void *send_buf)
-{
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
-	enum pima15740_response_code code = PIMA15740_RESP_OK;
-	uint32_t format, handle;
-	struct obj_list *obj = NULL;
-	GSList *iterator;
-	uint32_t *param;
-	unsigned long length;
-	int ret = 0;
+/*-------------------------------------------------------------------------*/
 
-	length = __le32_to_cpu(r_container->length);
+static void make_response(struct ptp_container *s_cntn, struct ptp_container *r_cntn,
+			  enum pima15740_response_code code, size_t len)
+{
+	s_cntn->id = r_cntn->id;
+	s_cntn->type = __cpu_to_le16(PTP_CONTAINER_TYPE_RESPONSE_BLOCK);
+	s_cntn->code = __cpu_to_le16(code);
+	s_cntn->length = __cpu_to_le32(len);
+}
 
-	param = (uint32_t *)r_container->payload;
-	handle = __le32_to_cpu(*param);
-	format = __le32_to_cpu(*(param + 1));
+static int bulk_write(void *buf, size_t length)
+{
+	size_t count = 0;
+	int ret;
 
-	if (length > 16 && format != PTP_PARAM_UNUSED) {
-		/* ObjectFormatCode not supported */
-		code = PIMA15740_RESP_SPECIFICATION_BY_FORMAT_NOT_SUPPORTED;
-		goto resp;
-	}
+	do {
+		ret = write(bulk_in, buf + count, length - count);
+		if (ret < 0) {
+			if (errno != EINTR)
+				return ret;
 
-	ret = chdir(root);
-	if (ret) {
-		fprintf(stderr, "chdir %s: %s\n", root, strerror(errno));
-		code = PIMA15740_RESP_GENERAL_ERROR;
-		goto resp;
-	}
+			/* Need to wait for control thread to finish reset */
+			sem_wait(&reset);
+		} else
+			count += ret;
+	} while (count < length);
 
-	if (handle == PTP_PARAM_ANY) {
-		int partial = 0;
+	if (verbose)
+		fprintf(stderr, "BULK-IN Sent %u bytes\n", (unsigned int)count);
 
-		if (!g_slist_length(images)) {
-			code = PIMA15740_RESP_OK;
-			goto resp;
-		}
+	return count;
+}
 
-		GFOREACH(obj, images) {
-			code = delete_file(obj->name);
-			if (code == PIMA15740_RESP_OK) {
-				delete_thumb(obj);
-				images = g_slist_remove(images, obj);
-				free(obj);
-			} else {
-				partial++;
-			}
-		}
+static int bulk_read(void *buf, size_t length)
+{
+	size_t count = 0;
+	int ret;
 
-		if (partial)
-			code = PIMA15740_RESP_PARTIAL_DELETION;
-	} else {
-		GFOREACH(obj, images) {
-			if (obj->handle == handle)
-				break;
-		}
+	do {
+		ret = read(bulk_out, buf + count, length - count);
+		if (ret < 0) {
+			if (errno != EINTR)
+				return ret;
 
-		if (obj) {
-			code = delete_file(obj->name);
-			if (code == PIMA15740_RESP_OK) {
-				delete_thumb(obj);
-				images = g_slist_remove(images, obj);
-				free(obj);
-			}
-		} else {
-			code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
-		}
-	}
+			/* Need to wait for control thread to finish reset */
+			sem_wait(&reset);
+		} else
+			count += ret;
+	} while (count < length);
 
-	ret = update_free_space();
-	if (ret < 0)
-		code = PIMA15740_RESP_STORE_NOT_AVAILABLE;
+	if (verbose)
+		fprintf(stderr, "BULK-OUT Read %u bytes\n", (unsigned int)count);
 
-resp:
-	make_response(s_container, r_container, code, sizeof(*s_container));
+	return count;
 }
 
-static int read_container(void *recv_buf, size_t recv_size)
-{
+static int interrupt_write(void *buf, size_t length) {
 	size_t count = 0;
 	int ret;
 
 	do {
-		ret = read(bulk_out, recv_buf + count, recv_size - count);
+		ret = write(interrupt, buf + count, length - count);
 		if (ret < 0) {
 			if (errno != EINTR)
 				return ret;
 
 			/* Need to wait for control thread to finish reset */
 			sem_wait(&reset);
-		} else {
+		} else
 			count += ret;
-		}
-	} while (count < sizeof(struct ptp_container));
+	} while (count < length);
 
-	if (verbose > 1)
-		fprintf(stderr, "%s: read %u bytes, count %d length %u\n",
-			__func__, ret, (unsigned int)count, (unsigned int)recv_size);
+	if (verbose)
+		fprintf(stderr, "INTERRUPT sent %u bytes\n", (unsigned int) count);
 
 	return count;
 }
 
-static void get_lock_filename(char *fname, size_t fname_size, char *objname)
+static int send_event(enum pima15740_event_code code, unsigned int param1) {
+	struct ptp_event_container event;
+	int len = 12 + 3 * 4; /* 12 + parameters*4 */
+
+	event.length = __cpu_to_le32(len);
+	event.type = __cpu_to_le16(PTP_CONTAINER_TYPE_EVENT_BLOCK);
+	event.event_code = __cpu_to_le16(code);
+	event.transaction_id = __cpu_to_le32(0);
+	event.parameter1 = __cpu_to_le32(param1);
+	event.parameter2 = __cpu_to_le32(0);
+	event.parameter3 = __cpu_to_le32(0);
+
+	if (verbose)
+		fprintf(stderr, "sending event, code: 0x%04X, parameter1: 0x%08X\n", code, param1);
+
+	/* every storage watcher sends events of its own */
+	pthread_mutex_lock(&event_lock);
+	len = interrupt_write(&event, len);
+	pthread_mutex_unlock(&event_lock);
+
+	return len;
+}
+
+struct handle_list {
+	uint32_t	*handles;	/* NULL when only counting */
+	int		num;
+	int		size;
+	int		count_only;
+};
+
+static int handle_list_add(struct handle_list *hl, uint32_t handle)
 {
-	snprintf(fname, fname_size, "%s/%.250s.lock", lockdir, objname);
+	uint32_t *handles;
+
+	if (!hl->count_only) {
+		if (hl->num == hl->size) {
+			hl->size = hl->size ? hl->size * 2 : 256;
+			handles = realloc(hl->handles, hl->size * sizeof(*handles));
+			if (!handles)
+				return -1;
+			hl->handles = handles;
+		}
+		hl->handles[hl->num] = __cpu_to_le32(handle);
+	}
+	hl->num++;
+
+	return 0;
 }
 
-static int process_send_object_info(void *recv_buf, void *send_buf)
+/*
+ * Collect the handles selected by the StorageID and ParentObject parameters
+ * of GetObjectHandles and GetNumObjects. A parent of 0 selects all objects,
+ * 0xffffffff the objects in the storage root and anything else the contents
+ * of that association. The handles are copied, so the data phase can run
+ * without holding any storage lock.
+ */
+static enum pima15740_response_code collect_handles(uint32_t store_id, uint32_t parent,
+						    struct handle_list *hl)
 {
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
 	enum pima15740_response_code code = PIMA15740_RESP_OK;
-	struct ptp_object_info *info;
-	uint32_t *param, p1, p2;
-	size_t new_info_size, alloc_size;
-	char lock_file[1024];
-	char new_file[256];
-	mode_t mode;
-	int fd, fd_new;
-	int ret = 0, len;
-	char fs_buf[32];
+	struct storage *store;
+	struct obj_list *obj;
+	GQueue *children;
+	GList *l;
+	int i;
 
-	param = (uint32_t *)r_container->payload;
-	p1 = __le32_to_cpu(*param);
-	p2 = __le32_to_cpu(*(param + 1));
+	if (store_id != PTP_PARAM_ANY && !find_storage(store_id))
+		return PIMA15740_RESP_INVALID_STORAGE_ID;
 
-	if (verbose) {
-		fprintf(stderr, "store_id 0x%lx, parent handle 0x%lx\n",
-			(unsigned long)p1, (unsigned long)p2);
-	}
+	if (parent != PTP_PARAM_UNUSED && parent != PTP_PARAM_ANY) {
+		store = lock_object_storage(parent);
+		if (!store)
+			return PIMA15740_RESP_INVALID_OBJECT_HANDLE;
 
-	/* Read ObjectInfo coming in the data phase */
-	ret = read_container(recv_buf, BUF_SIZE);
-	if (ret < 0) {
-		code = PIMA15740_RESP_INCOMPLETE_TRANSFER;
-		goto resp;
-	}
+		obj = find_object(parent);
+		if (!obj)
+			code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
+		else if (!object_is_association(obj) ||
+			 (store_id != PTP_PARAM_ANY && store_id != store->id))
+			code = PIMA15740_RESP_INVALID_PARENT_OBJECT;
+		else {
+			children = child_list(store, parent);
+			for (l = children ? children->head : NULL; l; l = l->next)
+				if (handle_list_add(hl, ((struct obj_list *)l->data)->handle) < 0) {
+					code = PIMA15740_RESP_GENERAL_ERROR;
+					break;
+				}
+		}
 
-	if (p1 != STORE_ID) {
-		code = PIMA15740_RESP_INVALID_STORAGE_ID;
-		goto resp;
-	}
-	if (p2 != PTP_PARAM_ANY) {
-		code = PIMA15740_RESP_SPECIFICATION_OF_DESTINATION_UNSUPPORTED;
-		goto resp;
+		unlock_storage(store);
+		return code;
 	}
 
-	new_info_size = ret - sizeof(*r_container);
-	alloc_size = (new_info_size - sizeof(struct ptp_object_info)) +
-		     sizeof(struct obj_list);
-	if (verbose) {
-		fprintf(stdout, "new object_info size %d\n",
-			(unsigned int)new_info_size);
-	}
+	for (i = 0; i < num_storages && code == PIMA15740_RESP_OK; i++) {
+		store = &storages[i];
+		if (store_id != PTP_PARAM_ANY && store_id != store->id)
+			continue;
 
-	info = (struct ptp_object_info *)r_container->payload;
-#ifdef DEBUG
-	dump_object_info(info);
-#endif
+		lock_storage(store);
+		if (!store->available) {
+			unlock_storage(store);
+			continue;
+		}
 
-	switch (info->object_format) {
-	case PIMA15740_FMT_A_UNDEFINED:
-	case PIMA15740_FMT_A_TEXT:
-	case PIMA15740_FMT_I_EXIF_JPEG:
-	case PIMA15740_FMT_I_TIFF:
-		code = PIMA15740_RESP_OK;
-		break;
-	default:
-		code = PIMA15740_RESP_INVALID_OBJECT_FORMAT_CODE;
-		goto resp;
-		break;
-	}
+		if (parent == PTP_PARAM_UNUSED)
+			children = &store->objects;
+		else
+			children = child_list(store, 0);
 
-	if (((uint64_t)__le32_to_cpu(info->object_compressed_size)) >
-	    __le64_to_cpu(storage_info.free_space_in_bytes)) {
-		code = PIMA15740_RESP_STORE_FULL;
-		if (verbose) {
-			fprintf(stdout, "no space: free %ld, req. %d\n",
-				storage_info.free_space_in_bytes,
-				info->object_compressed_size);
-		}
-		goto resp;
-	}
+		if (children && hl->count_only)
+			hl->num += g_queue_get_length(children);
+		else
+			for (l = children ? children->head : NULL; l; l = l->next)
+				if (handle_list_add(hl, ((struct obj_list *)l->data)->handle) < 0) {
+					code = PIMA15740_RESP_GENERAL_ERROR;
+					break;
+				}
 
-	ret = chdir(root);
-	if (ret) {
-		fprintf(stderr, "chdir: %s: %s\n", root, strerror(errno));
-		code = PIMA15740_RESP_STORE_NOT_AVAILABLE;
-		goto resp;
+		unlock_storage(store);
 	}
 
-	if (object_info_p) {
-		/* replace previously allocated info, free resources */
+	return code;
+}
 
-		inotify_sync();
+static int send_object_handles(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	enum pima15740_response_code code;
+	struct handle_list hl = { .handles = NULL };
+	unsigned long length;
+	uint32_t *param;
+	uint32_t store_id;
+	int ret;
+	size_t count, total, offset;
+	void *data;
+	uint32_t format, parent;
 
-		get_lock_filename(lock_file, sizeof(lock_file), object_info_p->name);
-		ret = unlink(lock_file);
-		if (ret < 0)
-			fprintf(stderr, "can't remove %s: %s",
-				lock_file, strerror(errno));
+	length	= __le32_to_cpu(r_container->length);
 
-		ret = unlink(object_info_p->name);
-		if (ret < 0)
-			fprintf(stderr, "can't remove %s: %s",
-				lock_file, strerror(errno));
+	param = (uint32_t *)r_container->payload;
+	store_id = __le32_to_cpu(*param);
 
-		free(object_info_p);
-		last_object_number--;
+	format = __le32_to_cpu(*(param + 1));
+	if (length > 16 && format != PTP_PARAM_UNUSED && format != PTP_PARAM_ANY) {
+		make_response(s_container, r_container,
+			      PIMA15740_RESP_SPECIFICATION_BY_FORMAT_NOT_SUPPORTED,
+			      sizeof(*s_container));
+		return 0;
 	}
 
-	object_info_p = malloc(alloc_size);
-	if (!object_info_p) {
-		perror("object info allocation failed");
-		code = PIMA15740_RESP_GENERAL_ERROR;
-		goto resp;
+	parent = length > 20 ? __le32_to_cpu(*(param + 2)) : PTP_PARAM_UNUSED;
+	code = collect_handles(store_id, parent, &hl);
+	if (code != PIMA15740_RESP_OK) {
+		free(hl.handles);
+		make_response(s_container, r_container, code, sizeof(*s_container));
+		return 0;
 	}
 
-	ret = get_string(uc, (char *)new_file, (const char *)&info->strings[1],
-			 info->strings[0]);
-	if (ret < 0) {
-		fprintf(stderr, "Filename conversion failed: %d\n", ret);
-		code = PIMA15740_RESP_GENERAL_ERROR;
-		goto err;
-	}
+	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	*(uint32_t *)s_container->payload = __cpu_to_le32(hl.num);
+	total = (hl.num + 1) * sizeof(uint32_t) + sizeof(*s_container);
+	s_container->length = __cpu_to_le32(total);
 
-	get_lock_filename(lock_file, sizeof(lock_file), new_file);
+	/* header and count go first, then the handles straight from the list */
+	offset = sizeof(*s_container) + sizeof(uint32_t);
+	data = hl.handles;
 
-	mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-	if (info->protection_status & 0x0001)
-		mode &= ~S_IWUSR;
-
-	if (verbose > 1) {
-		fprintf(stdout, "Lock Filename: %s\n", lock_file);
-		fprintf(stdout, "New Filename: %s, size %d\n",
-			new_file, info->object_compressed_size);
+	while (total) {
+		count = min(total, send_len);
+		memcpy(send_buf + offset, data, count - offset);
+		data += count - offset;
+		ret = bulk_write(send_buf, count);
+		if (ret < 0) {
+			free(hl.handles);
+			errno = EPIPE;
+			return ret;
+		}
+		offset = 0;
+		total -= count;
 	}
 
-	fd = open(lock_file, O_CREAT | O_EXCL | O_WRONLY, mode);
-	if (fd < 0) {
-		fprintf(stderr, "open %s: %s\n", lock_file, strerror(errno));
-		if (errno == EEXIST)
-			code = PIMA15740_RESP_STORE_NOT_AVAILABLE;
-		else
-			code = PIMA15740_RESP_GENERAL_ERROR;
-
-		goto err;
-	}
+	free(hl.handles);
 
-	fd_new = open(new_file, O_CREAT | O_EXCL | O_WRONLY, mode);
-	if (fd_new < 0) {
-		fprintf(stderr, "open: lock file %s, new file %s: %s\n",
-			lock_file, new_file, strerror(errno));
-		if (errno == EEXIST)
-			code = PIMA15740_RESP_STORE_NOT_AVAILABLE;
-		else
-			code = PIMA15740_RESP_GENERAL_ERROR;
+	/* Prepare response */
+	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
 
-		close(fd);
+	return 0;
+}
 
-		inotify_sync();
+static int send_object_info(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	uint32_t *param;
+	struct storage *store;
+	struct obj_list *obj = NULL;
+	int ret;
+	uint32_t handle;
+	size_t count, total, offset;
+	void *info;
+	unsigned char info_buf[sizeof(struct ptp_object_info) + 4 * 256 * 2];
+	enum pima15740_response_code code = PIMA15740_RESP_OK;
 
-		ret = unlink(lock_file);
-		if (ret < 0)
-			perror ("can't remove lock file");
+	param = (uint32_t *)r_container->payload;
+	handle = __le32_to_cpu(*param);
 
-		goto err;
+	store = lock_object_storage(handle);
+	obj = store ? find_object(handle) : NULL;
+	if (!obj || obj->info_size > sizeof(info_buf)) {
+		if (store)
+			unlock_storage(store);
+		code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
+		goto send_resp;
 	}
 
-	len = snprintf(fs_buf, sizeof(fs_buf), "%d",
-		       info->object_compressed_size);
-	ret = ftruncate(fd, len);
-	if (ret < 0) {
-		fprintf(stderr, "ftruncate for lock file: %s: %s\n",
-			lock_file, strerror(errno));
-		goto err_del;
-	}
+	/* the watcher may drop the object while we are sending */
+	total = obj->info_size;
+	memcpy(info_buf, &obj->info, total);
+	unlock_storage(store);
 
-	ret = write(fd, fs_buf, len);
-	if (ret < 0) {
-		fprintf(stderr, "write new file size to %s: %s\n",
-			lock_file, strerror(errno));
-		goto err_del;
-	}
+	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	total += sizeof(*s_container);
+	s_container->length = __cpu_to_le32(total);
+	offset = sizeof(*s_container);
+	info = info_buf;
 
-	ret = ftruncate(fd_new, info->object_compressed_size);
-	if (ret < 0) {
-		fprintf(stderr, "ftruncate: %s: %s\n",
-			new_file, strerror(errno));
-		goto err_del;
-	}
+	/* Object Info cannot get > 4096 bytes - four strings make a maximum of 2048
+	 * bytes plus a fixed-size block, but we play safe for the case someone
+	 * makes the buffers smaller */
 
-	memcpy(&object_info_p->info, info, new_info_size);
-	snprintf(object_info_p->name, 256, "%s", new_file);
-	object_info_p->handle			= ++last_object_number;
-	object_info_p->info_size		= new_info_size;
-	object_info_p->info.storage_id		= __cpu_to_le32(STORE_ID);
-	object_info_p->info.parent_object	= __cpu_to_le32(0);	/* Fixed / */
-	object_info_p->info.association_type	= __cpu_to_le16(0);
-	object_info_p->info.association_desc	= __cpu_to_le32(0);
-	object_info_p->info.sequence_number	= __cpu_to_le32(0);
+	while (total) {
+		count = min(total, send_len);
+		memcpy(send_buf + offset, info, count - offset);
+		info += count - offset;
+		ret = bulk_write(send_buf, count);
+		if (ret < 0) {
+			errno = EPIPE;
+			return ret;
+		}
+		offset = 0;
+		total -= count;
+	}
 
-	param = (uint32_t *)&s_container->payload[0];
-	param[0] = __cpu_to_le32(STORE_ID);
-	param[1] = __cpu_to_le32(0);
-	param[2] = __cpu_to_le32(last_object_number);
+send_resp:
+	/* Prepare response */
+	make_response(s_container, r_container, code, sizeof(*s_container));
 
-	close(fd);
-	close(fd_new);
-resp:
-	make_response(s_container, r_container, code, sizeof(*s_container) + 12);
 	return 0;
+}
 
-err_del:
-	code = PIMA15740_RESP_STORE_FULL;
-	close(fd);
-	close(fd_new);
-
-	ret = unlink(new_file);
-	if (ret < 0)
-		fprintf(stderr, "can't remove %s: %s\n",
-			new_file, strerror(errno));
+/*
+ * Hosts fetch an object right after its info or thumbnail, so the last
+ * few object files stay open. An entry is only used while the file still
+ * has the inode, size and mtime of its object, removed objects are
+ * dropped right away, so that their space is freed. Only fixed storages
+ * are cached, open files would keep removable ones from being unmounted.
+ */
+#define FD_CACHE_SIZE	8
+
+static struct fd_cached {
+	uint32_t	handle;
+	int		fd;		/* -1 if the entry is free */
+	int		busy;		/* being read by the bulk thread */
+	int		stale;		/* close once it isn't busy */
+	unsigned long	used;		/* for LRU */
+} fd_cache[FD_CACHE_SIZE] = {
+	[0 ... FD_CACHE_SIZE - 1] = { .fd = -1 },
+};
+static pthread_mutex_t fd_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long fd_cache_clock;
 
-	inotify_sync();
+static int object_fd_valid(const struct obj_list *obj, int fd)
+{
+	struct stat st;
 
-	ret = unlink(lock_file);
-	if (ret < 0)
-		fprintf(stderr, "can't remove %s: %s\n",
-			lock_file, strerror(errno));
-err:
-	free(object_info_p);
-	object_info_p = 0;
-	make_response(s_container, r_container, code, sizeof(*s_container));
-	return -1;
+	return !fstat(fd, &st) && st.st_nlink &&
+		(uint64_t)st.st_ino == obj->key.ino && st.st_mtime == obj->mtime &&
+		(uint32_t)st.st_size == __le32_to_cpu(obj->info.object_compressed_size);
 }
 
-#ifdef THUMB_SUPPORT
-static int generate_thumb(const char *);
-#endif
-static int process_send_object(void *recv_buf, void *send_buf)
+/* Open the file of an object for reading, called with its storage locked */
+static int object_open(struct storage *store, struct obj_list *obj)
 {
-	struct ptp_container *r_container = (struct ptp_container *)recv_buf;
-	struct ptp_container *s_container = send_buf;
-	enum pima15740_response_code code = PIMA15740_RESP_OK;
-	struct obj_list *oi;
-	int length;
-	void *map;
-	int offset = sizeof(*r_container);
-	int fd, cnt = 0, obj_size, ret;
-	char lock_file[1024];
+	struct fd_cached *fc, *lru = NULL;
+	char name[PATH_MAX], abspath[PATH_MAX];
+	const char *at;
+	int i, fd, dirfd;
+
+	pthread_mutex_lock(&fd_cache_lock);
+	for (i = 0; i < FD_CACHE_SIZE; i++) {
+		fc = &fd_cache[i];
+		if (fc->fd >= 0 && fc->handle == obj->handle && !fc->busy && !fc->stale) {
+			if (object_fd_valid(obj, fc->fd)) {
+				fc->busy = 1;
+				fc->used = ++fd_cache_clock;
+				pthread_mutex_unlock(&fd_cache_lock);
+				return fc->fd;
+			}
+			close(fc->fd);
+			fc->fd = -1;
+		}
+	}
+	pthread_mutex_unlock(&fd_cache_lock);
 
-	/* start reading data phase */
-	ret = read_container(recv_buf, BUF_SIZE);
-	if (ret < 0) {
-		code = PIMA15740_RESP_INCOMPLETE_TRANSFER;
-		goto resp;
+	if (get_object_path(obj, name, sizeof(name)) < 0)
+		return -1;
+	dirfd = storage_at(store, name, abspath, sizeof(abspath), &at);
+	if (dirfd == -1)
+		return -1;
+	fd = openat(dirfd, at, O_RDONLY);
+	if (fd < 0 || store->root_fd < 0)
+		return fd;
+
+	pthread_mutex_lock(&fd_cache_lock);
+	for (i = 0; i < FD_CACHE_SIZE; i++) {
+		fc = &fd_cache[i];
+		if (fc->busy)
+			continue;
+		if (fc->fd < 0) {
+			lru = fc;
+			break;
+		}
+		if (!lru || fc->used < lru->used)
+			lru = fc;
 	}
+	if (lru) {
+		if (lru->fd >= 0)
+			close(lru->fd);
+		lru->fd = fd;
+		lru->handle = obj->handle;
+		lru->busy = 1;
+		lru->stale = 0;
+		lru->used = ++fd_cache_clock;
+	}
+	pthread_mutex_unlock(&fd_cache_lock);
 
-	cnt = ret - offset;
-	length = __le32_to_cpu(r_container->length) - offset;
+	return fd;
+}
 
-	if (!object_info_p) {
-		/* get remaining data, end data phase */
-		while (cnt < length) {
-			ret = read(bulk_out, recv_buf, BUF_SIZE);
-			if (ret < 0) {
-				errno = EPIPE;
-				return -1;
-			}
-			cnt += ret;
+/* Done reading, the descriptor stays open if it is cached */
+static void object_close(int fd)
+{
+	int i;
+
+	pthread_mutex_lock(&fd_cache_lock);
+	for (i = 0; i < FD_CACHE_SIZE; i++)
+		if (fd_cache[i].fd == fd && fd_cache[i].busy)
+			break;
+	if (i < FD_CACHE_SIZE) {
+		fd_cache[i].busy = 0;
+		if (fd_cache[i].stale) {
+			close(fd);
+			fd_cache[i].fd = -1;
 		}
-		code = PIMA15740_RESP_NO_VALID_OBJECT_INFO;
-		goto resp;
+	} else {
+		close(fd);
 	}
+	pthread_mutex_unlock(&fd_cache_lock);
+}
 
-	oi = object_info_p;
-	obj_size = oi->info.object_compressed_size;
+static void object_fd_drop(uint32_t handle)
+{
+	int i;
 
-	if (length != obj_size) {
-		/* less or more data as at SendObjectInfo */
-		while (cnt < length) {
-			ret = read(bulk_out, recv_buf, BUF_SIZE);
-			if (ret < 0) {
-				errno = EPIPE;
-				return -1;
-			}
-			cnt += ret;
+	pthread_mutex_lock(&fd_cache_lock);
+	for (i = 0; i < FD_CACHE_SIZE; i++) {
+		if (fd_cache[i].fd < 0 || fd_cache[i].handle != handle)
+			continue;
+		if (fd_cache[i].busy) {
+			fd_cache[i].stale = 1;
+		} else {
+			close(fd_cache[i].fd);
+			fd_cache[i].fd = -1;
 		}
+	}
+	pthread_mutex_unlock(&fd_cache_lock);
+}
 
-		if (length < obj_size)
-			code = PIMA15740_RESP_INCOMPLETE_TRANSFER;
-		else
-			code = PIMA15740_RESP_STORE_FULL;
+/*
+ * Hosts import in handle order, GetObjectInfo and GetObject for one object
+ * after the other, and every read would start cold from the card. Once the
+ * host went up in handle order a few times, the next objects are read ahead
+ * with POSIX_FADV_WILLNEED, not more than PREFETCH_BUDGET bytes past the
+ * object asked for last. Their descriptors land in the fd cache on the way.
+ */
+#define PREFETCH_OBJECTS	4
+#define PREFETCH_BUDGET		(16 * 1024 * 1024)
+#define PREFETCH_STREAK		3
 
-		goto resp;
-	}
+static uint32_t prefetch_last;		/* last handle the host asked for */
+static uint32_t prefetch_ahead;		/* last handle read ahead */
+static unsigned int prefetch_streak;
 
-	/* empty file was send, don't need to write something */
-	if (!obj_size) {
-		code = PIMA15740_RESP_OK;
-		goto link;
-	}
+/* Called by the bulk thread, after it answered a request for handle */
+static void object_prefetch(uint32_t handle)
+{
+	struct {
+		int	fd;
+		off_t	len;
+	} next[PREFETCH_OBJECTS];
+	struct storage *store;
+	struct obj_list *obj;
+	off_t size, bytes = 0;
+	int i, n, ahead;
 
-	fd = open(oi->name, O_RDWR);
-	if (fd < 0) {
-		fprintf(stderr, "%s: open %s: %s\n", __func__,
-			oi->name, strerror(errno));
-		code = PIMA15740_RESP_STORE_FULL;
-		goto resp;
-	}
+	if (handle == prefetch_last)
+		return;
 
-	map = mmap(NULL, obj_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (map == MAP_FAILED) {
-		fprintf(stderr, "%s: mmap %s: %s\n", __func__,
-			oi->name, strerror(errno));
-		code = PIMA15740_RESP_STORE_FULL;
-		close(fd);
-		goto resp;
+	if (handle > prefetch_last && handle - prefetch_last <= 4 * PREFETCH_OBJECTS &&
+	    handle >> HANDLE_STORE_SHIFT == prefetch_last >> HANDLE_STORE_SHIFT) {
+		prefetch_streak++;
+	} else {
+		prefetch_streak = 0;
+		prefetch_ahead = handle;
 	}
+	prefetch_last = handle;
 
-	/* store first data block */
-	memcpy(map, recv_buf + offset, cnt);
+	if (prefetch_streak < PREFETCH_STREAK)
+		return;
 
-	/* more data? */
-	if (obj_size > cnt) {
-		unsigned int rest, recv_len;
-		void *data = map + cnt;
+	store = lock_object_storage(handle);
+	if (!store)
+		return;
 
-		if (verbose) {
-			fprintf(stderr, "Reading rest %d of %d\n",
-				obj_size - cnt, obj_size);
-		}
-		rest = obj_size - cnt;
-		recv_len = 8192;
-		while (rest) {
-			cnt = min(rest, recv_len);
-			ret = bulk_read(data, cnt);
-			if (ret < 0) {
-				fprintf(stderr, "%s: reading data for %s failed: %s\n",
-					__func__, object_info_p->name, strerror(errno));
-				code = PIMA15740_RESP_INCOMPLETE_TRANSFER;
-				munmap(map, obj_size);
-				close(fd);
-				errno = EPIPE;
-				return ret;
-			}
-			rest -= ret;
-			data += ret;
-		}
-	}
+	/* handles of removed objects leave gaps, don't look too far */
+	for (i = 1, n = 0, ahead = 0;
+	     i <= 4 * PREFETCH_OBJECTS && ahead < PREFETCH_OBJECTS && bytes < PREFETCH_BUDGET;
+	     i++) {
+		obj = find_object(handle + i);
+		if (!obj || object_is_association(obj))
+			continue;
+		ahead++;
 
-	munmap(map, obj_size);
-	close(fd);
+		/* a large object is only read ahead as far as the budget goes */
+		size = __le32_to_cpu(obj->info.object_compressed_size);
+		if (size > PREFETCH_BUDGET - bytes)
+			size = PREFETCH_BUDGET - bytes;
+		bytes += size;
 
-#ifdef THUMB_SUPPORT
-	if (oi->info.object_format != PIMA15740_FMT_A_UNDEFINED &&
-	    oi->info.object_format != PIMA15740_FMT_A_TEXT) {
-		ret = generate_thumb(object_info_p->name);
-		if (ret > 0) {
-			oi->info.thumb_format = __cpu_to_le16(PIMA15740_FMT_I_JFIF);
-			oi->info.thumb_compressed_size = __cpu_to_le32(ret);
-			oi->info.thumb_pix_width = __cpu_to_le32(THUMB_WIDTH);
-			oi->info.thumb_pix_height = __cpu_to_le32(THUMB_HEIGHT);
-		}
+		if (handle + i <= prefetch_ahead || !size)
+			continue;
+		prefetch_ahead = handle + i;
+
+		next[n].fd = object_open(store, obj);
+		if (next[n].fd < 0)
+			continue;
+		next[n++].len = size;
 	}
-#endif
 
-link:
-	object_info_p->next = 0;
-	images = g_slist_append(images, object_info_p);
+	unlock_storage(store);
 
-	inotify_sync();
+	for (i = 0; i < n; i++) {
+		posix_fadvise(next[i].fd, 0, next[i].len, POSIX_FADV_WILLNEED);
+		object_close(next[i].fd);
+	}
 
-	get_lock_filename(lock_file, sizeof(lock_file), object_info_p->name);
-	ret = unlink(lock_file);
-	if (ret < 0)
-		fprintf(stderr, "can't remove %s: %s",
-			lock_file, strerror(errno));
+	if (verbose > 1 && n)
+		fprintf(stderr, "Read ahead %d objects after 0x%x\n", n, handle);
+}
 
-	object_info_p = 0;
-#ifdef DEBUG
-	dump_obj("after link");
-#endif
+#ifdef THUMB_SUPPORT
+/* Send a thumbnail from memory, the container header is already in send_buf */
+static int send_cached_thumb(struct thumb_cached *tc, void *send_buf, size_t send_len)
+{
+	struct ptp_container *s_container = send_buf;
+	size_t count, total, offset = sizeof(*s_container), done;
+	int ret;
 
-	ret = update_free_space();
+	total = tc->size + offset;
+	count = min(total, send_len);
+	memcpy(send_buf + offset, tc->data, count - offset);
+	ret = bulk_write(send_buf, count);
 	if (ret < 0)
-		code = PIMA15740_RESP_STORE_NOT_AVAILABLE;
+		return ret;
+	done = count - offset;
 
-resp:
-	make_response(s_container, r_container, code, sizeof(*s_container));
+	while (done < tc->size) {
+		count = min(tc->size - done, (size_t)(8 * 1024));
+		ret = bulk_write(tc->data + done, count);
+		if (ret < 0)
+			return ret;
+		done += count;
+	}
 
 	return 0;
 }
+#endif
 
-static int process_one_request(void *recv_buf, size_t *recv_size, void *send_buf, size_t *send_size)
-{
-	struct ptp_container *r_container = recv_buf;
-	struct ptp_container *s_container = send_buf;
-	uint32_t *param, p1, p2, p3;
+/*
+ * An import reads large objects exactly once, they are streamed past the
+ * page cache: read ahead sequentially and dropped behind the cursor every
+ * STREAM_CHUNK, so that a long transfer doesn't evict everything else.
+ */
+#define STREAM_THRESHOLD	(8 * 1024 * 1024)
+#define STREAM_CHUNK		(1024 * 1024)
+
+static int send_object_or_thumb(void *recv_buf, void *send_buf, size_t send_len, int thumb)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	uint32_t *param;
+	struct storage *store;
+	struct obj_list *obj = NULL;
+	int ret;
+	uint32_t handle;
+	size_t count, total, offset, file_size;
+	off_t file_offset = 0, pos, dropped;
+	int fd = -1, stream;
+	unsigned char xferbuf[8*1024];
+#ifdef THUMB_SUPPORT
+	char name[PATH_MAX];
+	struct thumb_cached *tc = NULL;
+	time_t mtime;
+#endif
+	size_t unused __attribute__((unused));
+
+	param = (uint32_t *)r_container->payload;
+	handle = __le32_to_cpu(*param);
+
+	store = lock_object_storage(handle);
+	obj = store ? find_object(handle) : NULL;
+
+#ifdef THUMB_SUPPORT
+	/* A thumbnail not made yet goes first in the queue, only it is waited for */
+	if (obj && thumb && !obj->info.thumb_compressed_size &&
+	    __le16_to_cpu(obj->info.thumb_format) == PIMA15740_FMT_I_JFIF &&
+	    get_object_path(obj, name, sizeof(name)) >= 0) {
+		thumb_request(store, handle, name, 1);
+		unlock_storage(store);
+		thumb_wait(handle);
+		store = lock_object_storage(handle);
+		obj = store ? find_object(handle) : NULL;
+	}
+	/* hosts browse in handle order */
+	if (obj && thumb)
+		thumb_prefetch(store, handle);
+#endif
+
+	if (!obj) {
+		if (store)
+			unlock_storage(store);
+		make_response(s_container, r_container, PIMA15740_RESP_INVALID_OBJECT_HANDLE,
+			      sizeof(*s_container));
+		return 0;
+	}
+
+#ifdef THUMB_SUPPORT
+	if (thumb && (!obj->info.thumb_compressed_size ||
+		      __le16_to_cpu(obj->info.thumb_format) != PIMA15740_FMT_I_JFIF)) {
+		unlock_storage(store);
+		make_response(s_container, r_container, PIMA15740_RESP_NO_THUMBNAIL_PRESENT,
+			      sizeof(*s_container));
+		return 0;
+	}
+#endif
+
+	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	offset = sizeof(*s_container);
+
+#ifdef THUMB_SUPPORT
+	/* Hosts browsing a gallery ask for the same thumbnails again and again */
+	mtime = obj->mtime;
+	if (thumb)
+		tc = thumb_cache_get(handle, mtime,
+				     __le32_to_cpu(obj->info.thumb_compressed_size));
+
+	if (!thumb) {
+		fd = object_open(store, obj);
+		file_size = __le32_to_cpu(obj->info.object_compressed_size);
+	} else if (tc) {
+		file_size = tc->size;
+	} else if (obj->thumb_offset) {
+		/* embedded in the image, a byte range of it is sent */
+		fd = object_open(store, obj);
+		file_size = __le32_to_cpu(obj->info.thumb_compressed_size);
+		file_offset = obj->thumb_offset;
+	} else {
+		/* from the thumbnail pack */
+		file_size = __le32_to_cpu(obj->info.thumb_compressed_size);
+		if (get_thumb_filename(obj, name, sizeof(name)) >= 0)
+			fd = thumb_pack_open(name, &file_offset, file_size);
+	}
+#else
+	(void)thumb;
+	fd = object_open(store, obj);
+	file_size = __le32_to_cpu(obj->info.object_compressed_size);
+#endif
+
+	/* Once open, the file can be sent without holding the storage lock */
+	if (fd >= 0 && lseek(fd, file_offset, SEEK_SET) < 0) {
+		object_close(fd);
+		fd = -1;
+	}
+	unlock_storage(store);
+
+	total = file_size + sizeof(*s_container);
+	if (verbose)
+		fprintf(stderr, "%s(): total %lu\n", __func__, total);
+	s_container->length = __cpu_to_le32(total);
+
+#ifdef THUMB_SUPPORT
+	if (thumb && fd >= 0) {
+		tc = thumb_cache_fill(handle, mtime, fd, file_offset, file_size);
+		if (tc) {
+			object_close(fd);
+			fd = -1;
+		}
+	}
+
+	if (tc) {
+		ret = send_cached_thumb(tc, send_buf, send_len);
+		thumb_cache_release(tc);
+		if (ret < 0) {
+			errno = EPIPE;
+			return ret;
+		}
+		make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+		return 0;
+	}
+#endif
+
+	if (fd < 0) {
+		make_response(s_container, r_container, PIMA15740_RESP_INCOMPLETE_TRANSFER,
+			      sizeof(*s_container));
+		return 0;
+	}
+
+	stream = !thumb && file_size >= STREAM_THRESHOLD;
+	if (stream)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	pos = dropped = file_offset;
+
+	count = min(total, send_len);
+	unused = read(fd, send_buf + offset, count - offset);
+	ret = bulk_write(send_buf, count);
+	if (ret < 0) {
+		errno = EPIPE;
+		goto out;
+	}
+	total -= count;
+	pos += count - offset;
+	send_len = min((size_t)(8 * 1024), sizeof(xferbuf));
+
+	while (total) {
+		count = min(total, send_len);
+		unused = read(fd, xferbuf, count);
+		ret = bulk_write(xferbuf, count);
+		if (ret < 0) {
+			errno = EPIPE;
+			goto out;
+		}
+		total -= count;
+		pos += count;
+
+		if (stream && pos - dropped >= STREAM_CHUNK) {
+			posix_fadvise(fd, dropped, pos - dropped, POSIX_FADV_DONTNEED);
+			dropped = pos;
+		}
+	}
+	ret = 0;
+
+out:
+	if (stream) {
+		/* the descriptor may stay cached, leave it as it was */
+		posix_fadvise(fd, dropped, 0, POSIX_FADV_DONTNEED);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+	}
+	object_close(fd);
+
+	if (!ret)
+		/* Prepare response */
+		make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+
+	return ret;
+}
+
+static int send_storage_ids(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *s_container = send_buf;
+	uint32_t *param;
+	int ret, i, n = 0;
+	(void) send_len;
+
+	param = (uint32_t *)s_container->payload;
+	for (i = 0; i < num_storages; i++)
+		if (storages[i].available)
+			param[++n] = __cpu_to_le32(storages[i].id);
+	*param = __cpu_to_le32(n);
+
+	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	s_container->length = __cpu_to_le32(sizeof(*s_container) + (n + 1) * sizeof(*param));
+	ret = bulk_write(send_buf, sizeof(*s_container) + (n + 1) * sizeof(*param));
+	if (ret < 0) {
+		errno = EPIPE;
+		return ret;
+	}
+
+	/* Prepare response */
+	memcpy(send_buf, recv_buf, sizeof(*s_container));
+	s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_RESPONSE_BLOCK);
+	s_container->code = __cpu_to_le16(PIMA15740_RESP_OK);
+	s_container->length = __cpu_to_le32(sizeof(*s_container));
+
+	return 0;
+}
+
+static int send_storage_info(void *recv_buf, void *send_buf, size_t send_len)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	uint32_t *param;
+	uint32_t store_id;
+	struct storage *store;
+	struct my_storage_info *info;
+	int ret;
+	size_t count;
+	void *label;
+	(void) send_len;
+
+	param = (uint32_t *)r_container->payload;
+	store_id = __le32_to_cpu(*param);
+
+	store = find_storage(store_id);
+	if (!store) {
+		make_response(s_container, r_container,
+			      PIMA15740_RESP_INVALID_STORAGE_ID, sizeof(*s_container));
+		return 0;
+	}
+
+	count = sizeof(*info) + 1 + store->label_len * 2 + sizeof(*s_container);
+	if (verbose)
+		fprintf(stderr, "%lu bytes storage info\n", count - sizeof(*s_container));
+
+	s_container->type	= __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+	s_container->length	= __cpu_to_le32(count);
+
+	/* capacity and free space are cached, see update_free_space() */
+	info = send_buf + sizeof(*s_container);
+	lock_storage(store);
+	memcpy(info, &store->info, sizeof(*info));
+	unlock_storage(store);
+	info->free_space_in_images	= __cpu_to_le32(PTP_PARAM_ANY);
+
+	label = info + 1;
+	*(uint8_t *)label = store->label_len;
+	memcpy(label + 1, store->label, store->label_len * 2);
+
+	ret = bulk_write(s_container, count);
+	if (ret < 0) {
+		errno = EPIPE;
+		return ret;
+	}
+
+	/* Prepare response */
+	make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+
+	return 0;
+}
+
+#ifdef DEBUG
+const char *oid[] =
+{	"StorageID             ",
+	"ObjectFormat          ",
+	"ProtectionStatus      ",
+	"ObjectCommpressedSize ",
+	"ThumbFormat           ",
+	"ThumbCommpressedSize  ",
+	"ThumbPixWidth         ",
+	"ThumbPixHeight        ",
+	"ImagePixWidth         ",
+	"ImagePixHeight        ",
+	"ImageBitDepth         ",
+	"ParentObject          ",
+	"AssotiationType       ",
+	"AssotiationDesc       ",
+	"SequenceNumber        ",
+	"Filename              ",
+	"CaptureDate           ",
+	"ModificationDate      ",
+	"Keywords              ",
+};
+
+static void dump_object_info(const struct ptp_object_info *i)
+{
+	char buf[256];
+	int idx;
+
+	fprintf(stdout, "%s\n", __func__);
+	fprintf(stdout, "-------------------------------\n");
+	fprintf(stdout, "%s: 0x%.8x\n", oid[0], i->storage_id);
+	fprintf(stdout, "%s: 0x%.4x\n", oid[1], i->object_format);
+	fprintf(stdout, "%s: 0x%.4x\n", oid[2], i->protection_status);
+	fprintf(stdout, "%s: %d\n",     oid[3], i->object_compressed_size);
+	fprintf(stdout, "%s: 0x%.4x\n", oid[4], i->thumb_format);
+	fprintf(stdout, "%s: %d\n",     oid[5], i->thumb_compressed_size);
+	fprintf(stdout, "%s: %d\n",     oid[6], i->thumb_pix_width);
+	fprintf(stdout, "%s: %d\n",     oid[7], i->thumb_pix_height);
+	fprintf(stdout, "%s: %d\n",	oid[8], i->image_pix_width);
+	fprintf(stdout, "%s: %d\n",	oid[9], i->image_pix_height);
+	fprintf(stdout, "%s: %d\n",	oid[10], i->image_bit_depth);
+	fprintf(stdout, "%s: 0x%.8x\n", oid[11], i->parent_object);
+	fprintf(stdout, "%s: 0x%.4x\n", oid[12], i->association_type);
+	fprintf(stdout, "%s: 0x%.8x\n", oid[13], i->association_desc);
+	fprintf(stdout, "%s: %d\n",	oid[14], i->sequence_number);
+	get_string((char *)buf, sizeof(buf), (const char *)&i->strings[1],
+		   i->strings[0]);
+	fprintf(stdout, "%s: %s, len: %d\n", oid[15], buf, i->strings[0]);
+	idx = i->strings[0] * 2 + 1;
+	if (i->strings[idx]) {
+		get_string((char *)buf, sizeof(buf), (const char *)&i->strings[idx + 1],
+			   i->strings[idx]);
+		fprintf(stdout, "%s: %s, len: %d\n",
+			oid[16], buf, i->strings[idx]);
+	}
+	fprintf(stdout, "-------------------------------\n");
+}
+
+static void dump_obj(struct storage *store, const char *s)
+{
+	struct obj_list *obj;
+	GList *l;
+
+	printf("%s\n", s);
+
+	for (l = store->objects.head; l; l = l->next) {
+		obj = l->data;
+		printf("obj: 0x%p, handle %u, parent %u, name %s\n",
+			obj, obj->handle, parent_handle(obj), obj->name);
+	}
+	printf("\n");
+}
+#endif
+
+
+static void delete_thumb(struct obj_list *obj)
+{
+#ifdef THUMB_SUPPORT
+	char name[PATH_MAX];
+
+	thumb_cache_drop(obj->handle);
+
+	if (__le16_to_cpu(obj->info.thumb_format) != PIMA15740_FMT_I_JFIF ||
+	    !obj->info.thumb_compressed_size || obj->thumb_offset)
+		return;
+
+	if (get_thumb_filename(obj, name, sizeof(name)) < 0)
+		return;
+
+	thumb_pack_remove(name);
+#else
+	(void)obj;
+#endif
+}
+
+static enum pima15740_response_code delete_file(int dirfd, const char *name)
+{
+	struct stat st;
+	int ret;
+	uid_t euid;
+	gid_t egid;
+
+	/* access() is unreliable on NFS, we use stat() instead */
+	ret = fstatat(dirfd, name, &st, 0);
+	if (ret < 0) {
+		fprintf(stderr, "Cannot stat %s: %s\n", name, strerror(errno));
+		return PIMA15740_RESP_GENERAL_ERROR;
+	}
+
+	euid = geteuid();
+	if (euid == st.st_uid) {
+		if (!(st.st_mode & S_IWUSR))
+			return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
+		goto del;
+	}
+
+	egid = getegid();
+	if (egid == st.st_gid) {
+		if (!(st.st_mode & S_IWGRP))
+			return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
+		goto del;
+	}
+
+	if (!(st.st_mode & S_IWOTH))
+		return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
+
+del:
+	ret = unlinkat(dirfd, name, 0);
+	if (ret) {
+		fprintf(stderr, "Cannot delete %s: %s\n",
+			name, strerror(errno));
+		return PIMA15740_RESP_GENERAL_ERROR;
+	}
+
+	return PIMA15740_RESP_OK;
+}
+
+/*
+ * Free space is cached, statfs() takes milliseconds on network and FUSE
+ * filesystems and was called for every event. Changes made on behalf of
+ * the host are accounted for right away, everything else marks the value
+ * stale and the watcher calls statfs() once things have quietened down.
+ */
+#define FREE_SPACE_DELAY	250	/* ms without changes before statfs() */
+#define FREE_SPACE_MAX_DELAY	2000	/* at the latest, while changes go on */
+
+static long elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 +
+		(now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void publish_free_space(struct storage *store)
+{
+	uint64_t bytes = store->space_free > store->space_reserved ?
+		store->space_free - store->space_reserved : 0;
+
+	store->info.free_space_in_bytes = __cpu_to_le64(bytes);
+}
+
+/* Called with the storage locked */
+static int update_free_space(struct storage *store)
+{
+	unsigned long long bytes;
+	struct statfs fs;
+	int ret;
+
+	ret = statfs(store->root, &fs);
+	if (ret < 0) {
+		fprintf(stderr, "statfs %s: %s\n", store->root, strerror(errno));
+		return ret;
+	}
+
+	if (verbose > 1)
+		fprintf(stdout, "Block-size %ld, total %d, free %d\n",
+			fs.f_bsize, (int)fs.f_blocks, (int)fs.f_bfree);
+
+	bytes = (unsigned long long)fs.f_bsize * fs.f_blocks;
+	store->info.max_capacity = __cpu_to_le64(bytes);
+	store->space_free = (unsigned long long)fs.f_bsize * fs.f_bfree;
+	store->block_size = fs.f_bsize;
+	store->space_stale = 0;
+	publish_free_space(store);
+	return 0;
+}
+
+/* Space a file of size bytes occupies on the storage */
+static uint64_t space_used(const struct storage *store, uint64_t size)
+{
+	unsigned long bs = store->block_size ? store->block_size : 1;
+
+	return (size + bs - 1) / bs * bs;
+}
+
+/* A file of size bytes was written (delta < 0) or removed (delta > 0) */
+static void free_space_adjust(struct storage *store, int64_t delta)
+{
+	if (delta < 0 && store->space_free < (uint64_t)-delta)
+		store->space_free = 0;
+	else
+		store->space_free += delta;
+	publish_free_space(store);
+}
+
+static void free_space_reserve(struct storage *store, int64_t size)
+{
+	store->space_reserved += size;
+	publish_free_space(store);
+}
+
+/* Something changed behind our back */
+static void free_space_stale(struct storage *store)
+{
+	clock_gettime(CLOCK_MONOTONIC, &store->space_last);
+	if (!store->space_stale)
+		store->space_first = store->space_last;
+	store->space_stale = 1;
+}
+
+/*
+ * How long the watcher may wait for events, before free space has to be
+ * refreshed, -1 for no limit. Refreshes the value, when it is due.
+ */
+static int free_space_timeout(struct storage *store)
+{
+	long wait = -1;
+
+	lock_storage(store);
+	if (store->space_stale && store->available) {
+		wait = min(FREE_SPACE_DELAY - elapsed_ms(&store->space_last),
+			   FREE_SPACE_MAX_DELAY - elapsed_ms(&store->space_first));
+		if (wait <= 0) {
+			/* no retries on failure, the next change tries again */
+			store->space_stale = 0;
+			update_free_space(store);
+			wait = -1;
+		}
+	}
+	unlock_storage(store);
+
+	return wait;
+}
+
+/*
+ * Drop an object from the catalog, associations together with their
+ * contents. With notify set the host is told about every removed object.
+ */
+static void remove_object(struct obj_list *obj, int notify)
+{
+	struct storage *store = obj->store;
+	GQueue *children;
+
+	if (object_is_association(obj)) {
+		while ((children = child_list(store, obj->handle)) && children->head)
+			remove_object(children->head->data, notify);
+
+		unwatch_directory(store, obj);
+	}
+
+	delete_thumb(obj);
+	object_fd_drop(obj->handle);
+	catalog_remove(obj);
+
+	if (notify)
+		send_event(PIMA15740_EVENT_OBJECT_REMOVED, obj->handle);
+
+	free(obj);
+}
+
+static enum pima15740_response_code delete_tree(struct obj_list *obj)
+{
+	enum pima15740_response_code code;
+	char name[PATH_MAX], abspath[PATH_MAX];
+	GQueue *children;
+	GList *l, *next;
+	const char *at;
+	int partial = 0, dirfd;
+
+	if (get_object_path(obj, name, sizeof(name)) < 0 ||
+	    (dirfd = storage_at(obj->store, name, abspath, sizeof(abspath), &at)) == -1)
+		return PIMA15740_RESP_GENERAL_ERROR;
+
+	if (!object_is_association(obj)) {
+		code = delete_file(dirfd, at);
+		if (code == PIMA15740_RESP_OK) {
+			free_space_adjust(obj->store, space_used(obj->store,
+				__le32_to_cpu(obj->info.object_compressed_size)));
+			remove_object(obj, 0);
+		}
+		return code;
+	}
+
+	children = child_list(obj->store, obj->handle);
+	for (l = children ? children->head : NULL; l; l = next) {
+		next = l->next;
+		if (delete_tree(l->data) != PIMA15740_RESP_OK)
+			partial++;
+	}
+
+	if (partial)
+		return PIMA15740_RESP_PARTIAL_DELETION;
+
+	if (unlinkat(dirfd, at, AT_REMOVEDIR)) {
+		fprintf(stderr, "Cannot delete %s: %s\n",
+			name, strerror(errno));
+		if (errno == EACCES || errno == EPERM)
+			return PIMA15740_RESP_OBJECT_WRITE_PROTECTED;
+		return PIMA15740_RESP_GENERAL_ERROR;
+	}
+
+	remove_object(obj, 0);
+
+	return PIMA15740_RESP_OK;
+}
+
+/* Called with the storage locked */
+static enum pima15740_response_code delete_storage_objects(struct storage *store)
+{
+	GQueue *children = child_list(store, 0);
+	GList *l, *next;
+	int partial = 0;
+
+	for (l = children ? children->head : NULL; l; l = next) {
+		next = l->next;
+		if (delete_tree(l->data) != PIMA15740_RESP_OK)
+			partial++;
+	}
+
+	return partial ? PIMA15740_RESP_PARTIAL_DELETION : PIMA15740_RESP_OK;
+}
+
+static void delete_object(void *recv_buf, void *send_buf)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	enum pima15740_response_code code = PIMA15740_RESP_OK;
+	uint32_t format, handle;
+	struct storage *store;
+	struct obj_list *obj = NULL;
+	uint32_t *param;
+	unsigned long length;
+	int i;
+
+	length = __le32_to_cpu(r_container->length);
+
+	param = (uint32_t *)r_container->payload;
+	handle = __le32_to_cpu(*param);
+	format = __le32_to_cpu(*(param + 1));
+
+	if (length > 16 && format != PTP_PARAM_UNUSED) {
+		/* ObjectFormatCode not supported */
+		code = PIMA15740_RESP_SPECIFICATION_BY_FORMAT_NOT_SUPPORTED;
+		goto resp;
+	}
+
+	for (i = 0; i < num_storages; i++) {
+		enum pima15740_response_code ret = PIMA15740_RESP_OK;
+
+		if (handle == PTP_PARAM_ANY)
+			store = &storages[i];
+		else if (!(store = handle_storage(handle)))
+			break;
+
+		lock_storage(store);
+
+		if (handle != PTP_PARAM_ANY)
+			obj = find_object(handle);
+
+		if (!store->available) {
+			/* nothing to delete on an unmounted storage */
+		} else if (handle == PTP_PARAM_ANY) {
+			ret = delete_storage_objects(store);
+		} else if (obj) {
+			ret = delete_tree(obj);
+		}
+
+		unlock_storage(store);
+
+		if (ret != PIMA15740_RESP_OK && code == PIMA15740_RESP_OK)
+			code = ret;
+
+		if (handle != PTP_PARAM_ANY)
+			break;
+	}
+
+	if (handle != PTP_PARAM_ANY && !obj)
+		code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
+
+resp:
+	make_response(s_container, r_container, code, sizeof(*s_container));
+}
+
+static int read_container(void *recv_buf, size_t recv_size)
+{
+	size_t count = 0;
+	int ret;
+
+	do {
+		ret = read(bulk_out, recv_buf + count, recv_size - count);
+		if (ret < 0) {
+			if (errno != EINTR)
+				return ret;
+
+			/* Need to wait for control thread to finish reset */
+			sem_wait(&reset);
+		} else {
+			count += ret;
+		}
+	} while (count < sizeof(struct ptp_container));
+
+	if (verbose > 1)
+		fprintf(stderr, "%s: read %u bytes, count %d length %u\n",
+			__func__, ret, (unsigned int)count, (unsigned int)recv_size);
+
+	return count;
+}
+
+/* Host supplied names must not leave their parent directory */
+static int valid_filename(const char *name)
+{
+	return name[0] && name[0] != '.' && !strchr(name, '/');
+}
+
+/*
+ * Upload journal in mapdir: an append-only log of the uploads, which have
+ * their name before they are complete, i.e. on filesystems without
+ * O_TMPFILE. Every record carries a checksum, the replay stops at a torn
+ * one. At start uploads reserved, but neither committed nor aborted, were
+ * cut off and their files are removed, if they still are the ones that
+ * were made. Those on a removable storage, which isn't mounted at start,
+ * are kept in the journal until storage_attach() finds it. The journal
+ * starts over, once it grew past JOURNAL_MAX and no upload is pending.
+ * Like the handle maps it has to survive a power cut, which rules out /tmp.
+ */
+#define JOURNAL_NAME		"uploads.journal"
+#define JOURNAL_MAGIC		0x4a505450	/* "PTPJ" */
+#define JOURNAL_MAX		(64 * 1024)
+
+enum journal_type {
+	JOURNAL_RESERVE = 1,
+	JOURNAL_COMMIT,
+	JOURNAL_ABORT,
+};
+
+struct journal_record {
+	uint32_t	sum;		/* FNV-1a of the rest of the record */
+	uint32_t	magic;
+	uint16_t	type;
+	uint16_t	path_len;	/* of the path following, reservations only */
+	uint32_t	seq;		/* of the reservation */
+	uint32_t	size;
+	uint64_t	ino;
+	uint64_t	btime;
+	char		path[];
+} __attribute__ ((packed));
+
+static int journal_fd = -1;
+static uint32_t journal_seq;
+static uint32_t journal_pending;	/* reservation not ended yet, or 0 */
+/* cut off reservations on storages not mounted yet, protected by journal_lock */
+static GSList *journal_kept;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t journal_sum(const struct journal_record *rec)
+{
+	const uint8_t *p = (const uint8_t *)rec;
+	size_t i, len = sizeof(*rec) + __le16_to_cpu(rec->path_len);
+	uint32_t hash = 2166136261u;
+
+	for (i = sizeof(rec->sum); i < len; i++)
+		hash = (hash ^ p[i]) * 16777619u;
+
+	return hash;
+}
+
+static int journal_append(struct journal_record *rec, int sync)
+{
+	if (journal_fd < 0)
+		return -1;
+
+	rec->magic = __cpu_to_le32(JOURNAL_MAGIC);
+	rec->sum = __cpu_to_le32(journal_sum(rec));
+
+	if (handle_map_write(journal_fd, rec,
+			     sizeof(*rec) + __le16_to_cpu(rec->path_len)) < 0 ||
+	    (sync && fdatasync(journal_fd) < 0)) {
+		fprintf(stderr, "Cannot write upload journal: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* A file was made under its name for an upload of size bytes */
+static void journal_reserve(const char *path, const struct file_key *key, uint32_t size)
+{
+	char buf[sizeof(struct journal_record) + PATH_MAX];
+	struct journal_record *rec = (struct journal_record *)buf;
+	size_t len = strlen(path);
+
+	memset(rec, 0, sizeof(*rec));
+	rec->type = __cpu_to_le16(JOURNAL_RESERVE);
+	rec->path_len = __cpu_to_le16(len);
+	rec->seq = __cpu_to_le32(++journal_seq);
+	rec->size = __cpu_to_le32(size);
+	rec->ino = __cpu_to_le64(key->ino);
+	rec->btime = __cpu_to_le64(key->btime);
+	memcpy(rec->path, path, len);
+
+	/* it has to be on disk before the data is */
+	if (!journal_append(rec, durability != DURABLE_NONE))
+		journal_pending = journal_seq;
+}
+
+/* Write the kept reservations again, into a journal just started over */
+static void journal_write_kept(void)
+{
+	GSList *l;
+
+	for (l = journal_kept; l; l = l->next)
+		journal_append(l->data, 0);
+
+	if (journal_kept && journal_fd >= 0 && fdatasync(journal_fd) < 0)
+		fprintf(stderr, "sync upload journal: %s\n", strerror(errno));
+}
+
+static void journal_end_seq(enum journal_type type, uint32_t seq, int sync)
+{
+	struct journal_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = __cpu_to_le16(type);
+	rec.seq = __cpu_to_le32(seq);
+	journal_append(&rec, sync);
+}
+
+/* The pending upload is complete or was removed */
+static void journal_end(enum journal_type type)
+{
+	struct stat st;
+
+	if (!journal_pending)
+		return;
+
+	journal_end_seq(type, journal_pending,
+			type == JOURNAL_COMMIT && durability == DURABLE_SYNC);
+	journal_pending = 0;
+
+	pthread_mutex_lock(&journal_lock);
+	if (!fstat(journal_fd, &st) && st.st_size > JOURNAL_MAX) {
+		if (ftruncate(journal_fd, 0) < 0)
+			fprintf(stderr, "Cannot truncate upload journal: %s\n",
+				strerror(errno));
+		else
+			journal_write_kept();
+	}
+	pthread_mutex_unlock(&journal_lock);
+}
+
+static void journal_recover(const struct journal_record *rec)
+{
+	char path[PATH_MAX];
+	struct file_key key;
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%.*s", __le16_to_cpu(rec->path_len), rec->path);
+
+	if (stat_file(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, &st, &key) < 0 ||
+	    key.ino != __le64_to_cpu(rec->ino) || key.btime != __le64_to_cpu(rec->btime)) {
+		if (verbose)
+			fprintf(stderr, "Cut off upload %s is gone or was replaced\n", path);
+		return;
+	}
+
+	if (verbose)
+		fprintf(stderr, "Removing cut off upload %s\n", path);
+	if (unlink(path) < 0)
+		fprintf(stderr, "can't remove %s: %s\n", path, strerror(errno));
+}
+
+/* Storage, which the path of a reservation is on, or NULL */
+static struct storage *journal_storage(const struct journal_record *rec)
+{
+	size_t len, path_len = __le16_to_cpu(rec->path_len);
+	int i;
+
+	for (i = 0; i < num_storages; i++) {
+		len = strlen(storages[i].root);
+		if (path_len > len && !strncmp(rec->path, storages[i].root, len) &&
+		    rec->path[len] == '/')
+			return &storages[i];
+	}
+
+	return NULL;
+}
+
+/* Remove what the last run cut off on store, now that it is mounted */
+static void journal_resolve(struct storage *store)
+{
+	struct journal_record *rec;
+	GSList *l, *next;
+
+	pthread_mutex_lock(&journal_lock);
+
+	for (l = journal_kept; l; l = next) {
+		next = l->next;
+		rec = l->data;
+		if (journal_storage(rec) != store)
+			continue;
+
+		journal_recover(rec);
+		journal_end_seq(JOURNAL_ABORT, __le32_to_cpu(rec->seq), 0);
+		journal_kept = g_slist_delete_link(journal_kept, l);
+		free(rec);
+	}
+
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/* Replay the journal left by the last run and start a new one */
+static void journal_open(void)
+{
+	const struct journal_record *rec;
+	struct journal_record *kept;
+	struct storage *store;
+	char name[PATH_MAX];
+	GHashTable *pending;
+	struct stat st;
+	size_t off, end, size;
+	uint8_t *buf = NULL;
+	ssize_t len = 0;
+	int fd;
+
+	snprintf(name, sizeof(name), "%s/" JOURNAL_NAME, mapdir);
+
+	fd = open(name, O_RDONLY);
+	if (fd >= 0) {
+		if (!fstat(fd, &st) && (buf = malloc(st.st_size + 1)))
+			len = read(fd, buf, st.st_size);
+		close(fd);
+	}
+
+	pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	/* a torn record ends the journal */
+	for (end = 0; len > 0 && end + sizeof(*rec) <= (size_t)len; end += size) {
+		rec = (const struct journal_record *)(buf + end);
+		size = sizeof(*rec) + __le16_to_cpu(rec->path_len);
+		if (__le32_to_cpu(rec->magic) != JOURNAL_MAGIC || end + size > (size_t)len ||
+		    __le32_to_cpu(rec->sum) != journal_sum(rec))
+			break;
+
+		if (__le16_to_cpu(rec->type) == JOURNAL_RESERVE)
+			g_hash_table_insert(pending, GUINT_TO_POINTER(__le32_to_cpu(rec->seq)),
+					    (gpointer)rec);
+		else
+			g_hash_table_remove(pending, GUINT_TO_POINTER(__le32_to_cpu(rec->seq)));
+	}
+
+	for (off = 0; off < end; off += sizeof(*rec) + __le16_to_cpu(rec->path_len)) {
+		rec = (const struct journal_record *)(buf + off);
+		if (g_hash_table_lookup(pending, GUINT_TO_POINTER(__le32_to_cpu(rec->seq))) != rec)
+			continue;
+
+		store = journal_storage(rec);
+		if (!store || !store->removable || storage_mounted(store)) {
+			journal_recover(rec);
+			continue;
+		}
+
+		/* numbered anew, this run starts counting from 0 again */
+		size = sizeof(*rec) + __le16_to_cpu(rec->path_len);
+		kept = malloc(size);
+		if (!kept)
+			continue;
+		memcpy(kept, rec, size);
+		kept->seq = __cpu_to_le32(++journal_seq);
+		journal_kept = g_slist_prepend(journal_kept, kept);
+	}
+
+	g_hash_table_destroy(pending);
+	free(buf);
+
+	journal_fd = open(name, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, S_IRUSR | S_IWUSR);
+	if (journal_fd < 0)
+		fprintf(stderr, "Cannot open upload journal %s: %s\n", name, strerror(errno));
+	else
+		journal_write_kept();
+}
+
+/*
+ * Files being uploaded are registered from the moment they have a name in
+ * their folder, until they are in the catalog, so that the watcher leaves
+ * them alone.
+ */
+static int upload_pending(struct storage *store, const char *path)
+{
+	return g_hash_table_contains(store->uploads, path);
+}
+
+static void upload_begin(struct storage *store, const char *path)
+{
+	g_hash_table_add(store->uploads, strdup(path));
+}
+
+static void upload_end(struct storage *store, const char *path)
+{
+	g_hash_table_remove(store->uploads, path);
+}
+
+/*
+ * Forget the pending ObjectInfo together with its preallocated file, called
+ * with its storage locked
+ */
+static void discard_object_info(void)
+{
+	struct storage *store = object_info_p->store;
+	char path[PATH_MAX];
+	int64_t size;
+	int ret;
+
+	/* still unnamed, nothing to clean up but the descriptor */
+	if (object_info_fd >= 0) {
+		close(object_info_fd);
+		object_info_fd = -1;
+		goto out;
+	}
+
+	notify_barrier(store);
+
+	upload_end(store, object_info_path);
+
+	/* gone already, when its folder or the whole storage went away */
+	if (store->available &&
+	    get_storage_path(store, object_info_path, path, sizeof(path)) >= 0) {
+		ret = unlink(path);
+		if (ret < 0 && errno != ENOENT)
+			fprintf(stderr, "can't remove %s: %s\n",
+				path, strerror(errno));
+	}
+	journal_end(JOURNAL_ABORT);
+
+out:
+	/* the handle is given back, unless others were handed out since */
+	if (object_info_p->handle == storage_handle(store, store->last_object_number))
+		store->last_object_number--;
+
+	size = __le32_to_cpu(object_info_p->info.object_compressed_size);
+	if (object_info_alloc)
+		free_space_adjust(store, space_used(store, size));
+	else
+		free_space_reserve(store, -size);
+
+	free(object_info_p);
+	object_info_p = 0;
+}
+
+/* Open the folder holding name, which is relative to dirfd */
+static int open_parent(int dirfd, const char *name, int flags, mode_t mode)
+{
+	const char *slash = strrchr(name, '/');
+	char dir[PATH_MAX];
+
+	if (!slash)
+		return openat(dirfd, ".", flags, mode);
+
+	snprintf(dir, sizeof(dir), "%.*s", slash == name ? 1 : (int)(slash - name), name);
+	return openat(dirfd, dir, flags, mode);
+}
+
+/*
+ * An upload is written to an unnamed file in its folder, which is linked
+ * in place once it is complete, see upload_link(). Filesystems without
+ * O_TMPFILE, like FAT, get the file under its name and an entry in the
+ * upload journal instead. Fails with EEXIST, if the name is taken.
+ */
+static int open_tmpfile(struct storage *store, const char *path, mode_t mode)
+{
+	char abspath[PATH_MAX];
+	struct stat st;
+	const char *at;
+	int dirfd;
+
+	dirfd = storage_at(store, path, abspath, sizeof(abspath), &at);
+	if (dirfd == -1)
+		return -1;
+
+	if (!fstatat(dirfd, at, &st, AT_SYMLINK_NOFOLLOW)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	return open_parent(dirfd, at, O_TMPFILE | O_RDWR, mode);
+}
+
+/*
+ * Allocate the blocks of a new file, so that the storage can't run full
+ * during SendObject. FAT only knows FALLOC_FL_KEEP_SIZE, where nothing
+ * can be allocated, the file stays sparse. Returns 1 if the blocks are
+ * allocated, 0 for a sparse file.
+ */
+static int reserve_file(int fd, off_t size)
+{
+	int ret;
+
+	if (!size || !fallocate(fd, 0, 0, size))
+		return 1;
+	if (errno != EOPNOTSUPP)
+		return -1;
+
+	ret = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+	if (ret < 0 && errno != EOPNOTSUPP)
+		return -1;
+
+	if (ftruncate(fd, size) < 0)
+		return -1;
+
+	return !ret;
+}
+
+static int process_send_object_info(void *recv_buf, void *send_buf)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	enum pima15740_response_code code = PIMA15740_RESP_OK;
+	struct ptp_object_info *info;
+	uint32_t *param, p1, p2;
+	size_t new_info_size, alloc_size;
+	struct storage *store;
+	struct obj_list *parent = NULL;
+	char new_name[256];
+	char rel_path[PATH_MAX];
+	char new_file[PATH_MAX], abspath[PATH_MAX];
+	struct scan_entry entry;
+	struct stat st;
+	const char *at;
+	mode_t mode;
+	int fd_new, named = 0, alloc, dirfd;
+	int ret = 0;
+
+	param = (uint32_t *)r_container->payload;
+	p1 = __le32_to_cpu(*param);
+	p2 = __le32_to_cpu(*(param + 1));
+
+	if (verbose) {
+		fprintf(stderr, "store_id 0x%lx, parent handle 0x%lx\n",
+			(unsigned long)p1, (unsigned long)p2);
+	}
+
+	/* Read ObjectInfo coming in the data phase */
+	ret = read_container(recv_buf, BUF_SIZE);
+	if (ret < 0) {
+		code = PIMA15740_RESP_INCOMPLETE_TRANSFER;
+		goto resp;
+	}
+
+	/* A pending ObjectInfo is replaced, whatever storage it belongs to */
+	if (object_info_p) {
+		store = object_info_p->store;
+		lock_storage(store);
+		discard_object_info();
+		unlock_storage(store);
+	}
+
+	store = find_storage(p1);
+	if (!store) {
+		code = PIMA15740_RESP_INVALID_STORAGE_ID;
+		goto resp;
+	}
+
+	lock_storage(store);
+
+	if (!store->available) {
+		code = PIMA15740_RESP_STORE_NOT_AVAILABLE;
+		goto unlock;
+	}
+	if (p2 != PTP_PARAM_ANY && p2 != PTP_PARAM_UNUSED) {
+		parent = handle_storage(p2) == store ? find_object(p2) : NULL;
+		if (!parent || !object_is_association(parent)) {
+			code = PIMA15740_RESP_INVALID_PARENT_OBJECT;
+			goto unlock;
+		}
+	}
+
+	new_info_size = ret - sizeof(*r_container);
+	alloc_size = (new_info_size - sizeof(struct ptp_object_info)) +
+		     sizeof(struct obj_list);
+	if (verbose) {
+		fprintf(stdout, "new object_info size %d\n",
+			(unsigned int)new_info_size);
+	}
+
+	info = (struct ptp_object_info *)r_container->payload;
+#ifdef DEBUG
+	dump_object_info(info);
+#endif
+
+	switch (info->object_format) {
+	case PIMA15740_FMT_A_UNDEFINED:
+	case PIMA15740_FMT_A_ASSOCIATION:
+	case PIMA15740_FMT_A_TEXT:
+	case PIMA15740_FMT_I_EXIF_JPEG:
+	case PIMA15740_FMT_I_TIFF:
+		code = PIMA15740_RESP_OK;
+		break;
+	default:
+		code = PIMA15740_RESP_INVALID_OBJECT_FORMAT_CODE;
+		goto unlock;
+		break;
+	}
+
+	if (((uint64_t)__le32_to_cpu(info->object_compressed_size)) >
+	    __le64_to_cpu(store->info.free_space_in_bytes)) {
+		code = PIMA15740_RESP_STORE_FULL;
+		if (verbose) {
+			fprintf(stdout, "no space: free %ld, req. %d\n",
+				store->info.free_space_in_bytes,
+				info->object_compressed_size);
+		}
+		goto unlock;
+	}
+
+	ret = get_string((char *)new_name, sizeof(new_name),
+			 (const char *)&info->strings[1], info->strings[0]);
+	if (ret < 0) {
+		fprintf(stderr, "Filename conversion failed: %d\n", ret);
+		code = PIMA15740_RESP_GENERAL_ERROR;
+		goto unlock;
+	}
+
+	if (!valid_filename(new_name) ||
+	    get_child_path(parent, new_name, rel_path, sizeof(rel_path)) < 0 ||
+	    get_storage_path(store, rel_path, new_file, sizeof(new_file)) < 0 ||
+	    (dirfd = storage_at(store, rel_path, abspath, sizeof(abspath), &at)) == -1) {
+		fprintf(stderr, "Invalid filename %s\n", new_name);
+		code = PIMA15740_RESP_INVALID_PARAMETER;
+		goto unlock;
+	}
+
+	if (info->object_format == PIMA15740_FMT_A_ASSOCIATION) {
+		/* Folders need no data phase, create them right away */
+		ret = mkdirat(dirfd, at, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+		if (ret < 0) {
+			fprintf(stderr, "mkdir %s: %s\n", new_file, strerror(errno));
+			code = errno == EEXIST ? PIMA15740_RESP_STORE_NOT_AVAILABLE :
+				PIMA15740_RESP_GENERAL_ERROR;
+			goto unlock;
+		}
+
+		ret = probe_entry(dirfd, at, &entry);
+		if (!ret)
+			ret = add_object(store, parent, new_name, &entry, 0);
+		if (ret <= 0) {
+			unlinkat(dirfd, at, AT_REMOVEDIR);
+			code = PIMA15740_RESP_GENERAL_ERROR;
+			goto unlock;
+		}
+
+		param = (uint32_t *)&s_container->payload[0];
+		param[0] = __cpu_to_le32(store->id);
+		param[1] = __cpu_to_le32(parent ? parent->handle : 0);
+		param[2] = __cpu_to_le32(ret);
+		goto unlock;
+	}
+
+	object_info_p = malloc(alloc_size);
+	if (!object_info_p) {
+		perror("object info allocation failed");
+		code = PIMA15740_RESP_GENERAL_ERROR;
+		goto unlock;
+	}
+
+	mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+	if (info->protection_status & 0x0001)
+		mode &= ~S_IWUSR;
+
+	if (verbose > 1)
+		fprintf(stdout, "New Filename: %s, size %d\n",
+			new_file, info->object_compressed_size);
+
+	fd_new = open_tmpfile(store, rel_path, mode);
+	if (fd_new < 0 && errno == EEXIST) {
+		code = PIMA15740_RESP_STORE_NOT_AVAILABLE;
+		goto err;
+	}
+
+	if (fd_new < 0) {
+		upload_begin(store, rel_path);
+
+		fd_new = openat(dirfd, at, O_CREAT | O_EXCL | O_WRONLY, mode);
+		if (fd_new < 0) {
+			fprintf(stderr, "open %s: %s\n", new_file, strerror(errno));
+			if (errno == EEXIST)
+				code = PIMA15740_RESP_STORE_NOT_AVAILABLE;
+			else
+				code = PIMA15740_RESP_GENERAL_ERROR;
+
+			upload_end(store, rel_path);
+			goto err;
+		}
+		named = 1;
+	}
+
+	/* small unnamed ones are written at once, see process_send_object() */
+	alloc = 0;
+	if (named || info->object_compressed_size > small_object_size) {
+		alloc = reserve_file(fd_new, info->object_compressed_size);
+		if (alloc < 0) {
+			fprintf(stderr, "fallocate: %s: %s\n",
+				new_file, strerror(errno));
+			goto err_del;
+		}
+	}
+
+	ret = stat_file(fd_new, "", AT_EMPTY_PATH, &st, &object_info_p->key);
+	if (ret < 0) {
+		fprintf(stderr, "stat: %s: %s\n", new_file, strerror(errno));
+		goto err_del;
+	}
+
+	memcpy(&object_info_p->info, info, new_info_size);
+	snprintf(object_info_p->name, 256, "%s", new_name);
+	snprintf(object_info_path, sizeof(object_info_path), "%s", rel_path);
+	object_info_p->store			= store;
+	object_info_p->mtime			= st.st_mtime;
+	object_info_p->handle			= new_handle(store);
+	object_info_p->parent			= parent;
+	object_info_p->wd			= -1;
+	object_info_p->fh			= NULL;
+	object_info_p->thumb_offset		= 0;
+	object_info_p->info_size		= new_info_size;
+	object_info_p->info.storage_id		= __cpu_to_le32(store->id);
+	object_info_p->info.parent_object	= __cpu_to_le32(parent ? parent->handle : 0);
+	object_info_p->info.association_type	= __cpu_to_le16(0);
+	object_info_p->info.association_desc	= __cpu_to_le32(0);
+	object_info_p->info.sequence_number	= __cpu_to_le32(0);
+
+	if (named)
+		journal_reserve(new_file, &object_info_p->key,
+				__le32_to_cpu(info->object_compressed_size));
+
+	/*
+	 * Allocated blocks are gone from the filesystem already, otherwise the
+	 * space is held back until the object is written
+	 */
+	object_info_alloc = alloc;
+	if (alloc)
+		free_space_adjust(store,
+			-space_used(store, __le32_to_cpu(info->object_compressed_size)));
+	else
+		free_space_reserve(store, __le32_to_cpu(info->object_compressed_size));
+
+	param = (uint32_t *)&s_container->payload[0];
+	param[0] = __cpu_to_le32(store->id);
+	param[1] = __cpu_to_le32(parent ? parent->handle : 0);
+	param[2] = __cpu_to_le32(object_info_p->handle);
+
+	if (named)
+		close(fd_new);
+	else
+		object_info_fd = fd_new;
+unlock:
+	unlock_storage(store);
+resp:
+	make_response(s_container, r_container, code, sizeof(*s_container) + 12);
+	return 0;
+
+err_del:
+	code = PIMA15740_RESP_STORE_FULL;
+	close(fd_new);
+
+	/* an unnamed file is gone with its descriptor */
+	if (named) {
+		ret = unlinkat(dirfd, at, 0);
+		if (ret < 0)
+			fprintf(stderr, "can't remove %s: %s\n",
+				new_file, strerror(errno));
+
+		notify_barrier(store);
+		upload_end(store, rel_path);
+	}
+err:
+	unlock_storage(store);
+	free(object_info_p);
+	object_info_p = 0;
+	make_response(s_container, r_container, code, sizeof(*s_container));
+	return -1;
+}
+
+/*
+ * Writeback of each WRITE_BEHIND bytes of an upload is started as soon as
+ * they have been received, and the earlier ones are waited for, so that
+ * dirty pages don't pile up and a final sync finds little left to do.
+ */
+#define WRITE_BEHIND		(1024 * 1024)
+
+static void write_behind(int fd, off_t *flushed, off_t received)
+{
+	if (received - *flushed < WRITE_BEHIND)
+		return;
+
+	sync_file_range(fd, *flushed, received - *flushed, SYNC_FILE_RANGE_WRITE);
+	if (*flushed)
+		sync_file_range(fd, 0, *flushed, SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	*flushed = received;
+}
+
+/* Uploads waiting to be synced with DURABLE_GROUP */
+#define GROUP_COMMIT_MAX	16
+
+static struct {
+	int	fd;
+	int	dir;
+} group_pending[GROUP_COMMIT_MAX];
+static int group_count;
+
+/* Sync the data of an upload and the entry in its folder, closes both */
+static int upload_sync(int fd, int dir)
+{
+	int ret = 0;
+
+	if (fd >= 0) {
+		ret = fdatasync(fd);
+		close(fd);
+	}
+	if (dir >= 0) {
+		/* not every filesystem can sync a directory */
+		if (fsync(dir) < 0 && errno != EINVAL)
+			ret = -1;
+		close(dir);
+	}
+
+	return ret;
+}
+
+/* Sync the pending uploads of a group, most go out with one journal commit */
+static void upload_commit(void)
+{
+	int i;
+
+	for (i = 0; i < group_count; i++)
+		if (upload_sync(group_pending[i].fd, group_pending[i].dir) < 0)
+			fprintf(stderr, "sync upload: %s\n", strerror(errno));
+
+	/* the commits after the data */
+	if (group_count && journal_fd >= 0 && fdatasync(journal_fd) < 0)
+		fprintf(stderr, "sync upload journal: %s\n", strerror(errno));
+
+	if (verbose > 1 && group_count)
+		fprintf(stderr, "Synced %d uploads\n", group_count);
+	group_count = 0;
+}
+
+/*
+ * Make an upload as durable as asked for, takes over fd, which is -1 for
+ * an empty object. Fails, if it couldn't be synced before the response.
+ */
+static int upload_durable(int fd, int dirfd, const char *name)
+{
+	int dir;
+
+	if (durability == DURABLE_NONE) {
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+
+	dir = open_parent(dirfd, name, O_RDONLY | O_DIRECTORY, 0);
+
+	if (durability == DURABLE_SYNC)
+		return upload_sync(fd, dir);
+
+	group_pending[group_count].fd = fd;
+	group_pending[group_count].dir = dir;
+	if (++group_count == GROUP_COMMIT_MAX)
+		upload_commit();
+
+	return 0;
+}
+
+/*
+ * Give the unnamed file of the pending upload its name. The name is
+ * registered first, the events for it are swallowed at the catalog update.
+ * linkat() with AT_EMPTY_PATH would need CAP_DAC_READ_SEARCH.
+ */
+static int upload_link(struct storage *store, int dirfd, const char *name)
+{
+	char proc[32];
+	int ret, err;
+
+	lock_storage(store);
+	upload_begin(store, object_info_path);
+	unlock_storage(store);
+
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", object_info_fd);
+	ret = linkat(AT_FDCWD, proc, dirfd, name, AT_SYMLINK_FOLLOW);
+	if (ret < 0) {
+		err = errno;
+		lock_storage(store);
+		upload_end(store, object_info_path);
+		unlock_storage(store);
+		errno = err;
+		return ret;
+	}
+
+	close(object_info_fd);
+	object_info_fd = -1;
+	return 0;
+}
+
+/*
+ * Check, that the folder of the pending ObjectInfo still exists and point
+ * object_info_p at it again. Called with its storage locked.
+ */
+static int object_info_valid(struct obj_list *oi)
+{
+	struct storage *store = oi->store;
+	uint32_t parent = __le32_to_cpu(oi->info.parent_object);
+
+	if (!store->available)
+		return 0;
+
+	if (parent) {
+		oi->parent = find_object(parent);
+		if (!oi->parent)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Put a complete upload into the catalog, called with its storage locked
+ * and the events of the upload swallowed
+ */
+static void upload_insert(struct obj_list *oi, const char *path, int alloc)
+{
+	struct storage *store = oi->store;
+	int64_t size = __le32_to_cpu(oi->info.object_compressed_size);
+
+	catalog_insert(oi);
+	handle_map_append(store, &oi->key, oi->handle);
+	handle_map_check(store);
+
+	upload_end(store, path);
+
+	/* the reservation is written now */
+	if (!alloc) {
+		free_space_reserve(store, -size);
+		free_space_adjust(store, -space_used(store, size));
+	}
+}
+
+/*
+ * Hosts syncing sidecars send thousands of tiny objects in a row. These
+ * are put into the catalog together, once the host sends anything else or
+ * SMALL_BATCH_MAX are waiting, with the storage locked and the events of
+ * all of them swallowed just once.
+ */
+#define SMALL_BATCH_MAX		32
+
+static struct {
+	struct obj_list	*obj;
+	char		*path;
+} small_batch[SMALL_BATCH_MAX];
+static int small_count;
+
+static void upload_flush(void)
+{
+	struct storage *store;
+	struct obj_list *oi, *dir;
+	struct scan_entry entry;
+	char abspath[PATH_MAX];
+	const char *at;
+	int i, j, dirfd;
+
+	for (i = 0; i < small_count; i = j) {
+		store = small_batch[i].obj->store;
+		lock_storage(store);
+		notify_barrier(store);
+
+		for (j = i; j < small_count && small_batch[j].obj->store == store; j++) {
+			oi = small_batch[j].obj;
+			if (object_info_valid(oi)) {
+				upload_insert(oi, small_batch[j].path, 0);
+			} else {
+				/*
+				 * Its folder or the whole storage went away, after the
+				 * host was told the upload succeeded. The file is kept,
+				 * the host forgets the handle and gets a new one, if the
+				 * folder was replaced by another of the same name.
+				 */
+				upload_end(store, small_batch[j].path);
+				free_space_reserve(store,
+					-(int64_t)__le32_to_cpu(oi->info.object_compressed_size));
+				send_event(PIMA15740_EVENT_OBJECT_REMOVED, oi->handle);
+				if (store->available &&
+				    (dir = find_folder(store, small_batch[j].path)) &&
+				    (dirfd = storage_at(store, small_batch[j].path, abspath,
+							sizeof(abspath), &at)) != -1 &&
+				    !probe_entry(dirfd, at, &entry))
+					add_object(store, dir, oi->name, &entry, 1);
+				free(oi);
+			}
+			free(small_batch[j].path);
+		}
+
+		unlock_storage(store);
+	}
+
+	if (verbose > 1 && small_count)
+		fprintf(stderr, "Added %d small uploads\n", small_count);
+	small_count = 0;
+}
+
+/* The pending upload is complete, its catalog update waits for the batch */
+static int upload_batch(void)
+{
+	char *path = strdup(object_info_path);
+
+	if (!path)
+		return -1;
+
+	small_batch[small_count].obj = object_info_p;
+	small_batch[small_count].path = path;
+	object_info_p = 0;
+
+	if (++small_count == SMALL_BATCH_MAX)
+		upload_flush();
+
+	return 0;
+}
+
+static int process_send_object(void *recv_buf, void *send_buf)
+{
+	struct ptp_container *r_container = (struct ptp_container *)recv_buf;
+	struct ptp_container *s_container = send_buf;
+	enum pima15740_response_code code = PIMA15740_RESP_OK;
+	struct storage *store;
+	struct obj_list *oi;
+	struct stat st;
+	int length;
+	void *map;
+	int offset = sizeof(*r_container);
+	int fd = -1, dirfd, cnt = 0, obj_size, ret, small;
+	off_t flushed = 0;
+	char path[PATH_MAX];
+	const char *name;
+
+	/* start reading data phase */
+	ret = read_container(recv_buf, BUF_SIZE);
+	if (ret < 0) {
+		code = PIMA15740_RESP_INCOMPLETE_TRANSFER;
+		goto resp;
+	}
+
+	cnt = ret - offset;
+	length = __le32_to_cpu(r_container->length) - offset;
+
+	if (!object_info_p) {
+		/* get remaining data, end data phase */
+		while (cnt < length) {
+			ret = read(bulk_out, recv_buf, BUF_SIZE);
+			if (ret < 0) {
+				errno = EPIPE;
+				return -1;
+			}
+			cnt += ret;
+		}
+		code = PIMA15740_RESP_NO_VALID_OBJECT_INFO;
+		goto resp;
+	}
+
+	oi = object_info_p;
+	obj_size = oi->info.object_compressed_size;
+
+	if (length != obj_size) {
+		/* less or more data as at SendObjectInfo */
+		while (cnt < length) {
+			ret = read(bulk_out, recv_buf, BUF_SIZE);
+			if (ret < 0) {
+				errno = EPIPE;
+				return -1;
+			}
+			cnt += ret;
+		}
+
+		if (length < obj_size)
+			code = PIMA15740_RESP_INCOMPLETE_TRANSFER;
+		else
+			code = PIMA15740_RESP_STORE_FULL;
+
+		goto resp;
+	}
+
+	store = oi->store;
+	dirfd = storage_at(store, object_info_path, path, sizeof(path), &name);
+	if (dirfd == -1) {
+		code = PIMA15740_RESP_GENERAL_ERROR;
+		goto resp;
+	}
+
+	/*
+	 * The file was created at SendObjectInfo, unnamed or registered as an
+	 * upload, so the data is received without the storage lock.
+	 */
+	small = object_info_fd >= 0 && (uint32_t)obj_size <= small_object_size;
+
+	/* empty file was send, don't need to write something */
+	if (!obj_size) {
+		code = PIMA15740_RESP_OK;
+		goto link;
+	}
+
+	if (object_info_fd >= 0)
+		fd = dup(object_info_fd);
+	else
+		fd = openat(dirfd, name, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "%s: open %s: %s\n", __func__,
+			name, strerror(errno));
+		code = PIMA15740_RESP_STORE_FULL;
+		goto resp;
+	}
+
+	if (small) {
+		/* received whole into the pool and written with one call */
+		memcpy(small_buf, recv_buf + offset, cnt);
+		if (obj_size > cnt && bulk_read(small_buf + cnt, obj_size - cnt) < 0) {
+			fprintf(stderr, "%s: reading data for %s failed: %s\n",
+				__func__, name, strerror(errno));
+			close(fd);
+			errno = EPIPE;
+			return -1;
+		}
+
+		if (pwrite(fd, small_buf, obj_size, 0) != (ssize_t)obj_size) {
+			fprintf(stderr, "%s: write %s: %s\n", __func__,
+				name, strerror(errno));
+			code = PIMA15740_RESP_STORE_FULL;
+			close(fd);
+			goto resp;
+		}
+		goto received;
+	}
+
+	map = mmap(NULL, obj_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap %s: %s\n", __func__,
+			name, strerror(errno));
+		code = PIMA15740_RESP_STORE_FULL;
+		close(fd);
+		goto resp;
+	}
+
+	/* store first data block */
+	memcpy(map, recv_buf + offset, cnt);
+
+	/* more data? */
+	if (obj_size > cnt) {
+		unsigned int rest, recv_len;
+		void *data = map + cnt;
+
+		if (verbose) {
+			fprintf(stderr, "Reading rest %d of %d\n",
+				obj_size - cnt, obj_size);
+		}
+		rest = obj_size - cnt;
+		recv_len = 8192;
+		while (rest) {
+			cnt = min(rest, recv_len);
+			ret = bulk_read(data, cnt);
+			if (ret < 0) {
+				fprintf(stderr, "%s: reading data for %s failed: %s\n",
+					__func__, name, strerror(errno));
+				code = PIMA15740_RESP_INCOMPLETE_TRANSFER;
+				munmap(map, obj_size);
+				close(fd);
+				errno = EPIPE;
+				return ret;
+			}
+			rest -= ret;
+			data += ret;
+			write_behind(fd, &flushed, data - map);
+		}
+	}
+
+	munmap(map, obj_size);
+
+received:
+#ifdef THUMB_SUPPORT
+	/* one not embedded is made when asked for, see thumb_request() */
+	if (oi->info.object_format != PIMA15740_FMT_A_UNDEFINED &&
+	    oi->info.object_format != PIMA15740_FMT_A_TEXT) {
+		struct image_probe ip;
+
+		oi->info.thumb_format = __cpu_to_le16(PIMA15740_FMT_I_JFIF);
+		oi->info.thumb_compressed_size = __cpu_to_le32(0);
+		oi->info.thumb_pix_width = __cpu_to_le32(THUMB_WIDTH);
+		oi->info.thumb_pix_height = __cpu_to_le32(THUMB_HEIGHT);
+		probe_fd(fd, &ip);
+		if (ip.thumb.offset) {
+			oi->thumb_offset = ip.thumb.offset;
+			oi->info.thumb_compressed_size = __cpu_to_le32(ip.thumb.length);
+			oi->info.thumb_pix_width = __cpu_to_le32(ip.thumb.width);
+			oi->info.thumb_pix_height = __cpu_to_le32(ip.thumb.height);
+		}
+	}
+#endif
+
+link:
+	if (object_info_fd >= 0 && upload_link(store, dirfd, name) < 0) {
+		code = errno == EEXIST ? PIMA15740_RESP_STORE_NOT_AVAILABLE :
+			errno == ENOENT ? PIMA15740_RESP_INVALID_PARENT_OBJECT :
+			PIMA15740_RESP_GENERAL_ERROR;
+		fprintf(stderr, "%s: link %s: %s\n", __func__, name, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		lock_storage(store);
+		discard_object_info();
+		unlock_storage(store);
+		goto resp;
+	}
+
+	if (upload_durable(fd, dirfd, name) < 0) {
+		code = errno == ENOSPC ? PIMA15740_RESP_STORE_FULL :
+			PIMA15740_RESP_GENERAL_ERROR;
+		fprintf(stderr, "%s: sync %s: %s\n", __func__, name, strerror(errno));
+		/* not on the storage for sure, the host has to send it again */
+		lock_storage(store);
+		discard_object_info();
+		unlock_storage(store);
+		goto resp;
+	}
+
+	/* for rescans, which compare sizes and modification times */
+	if (!fstatat(dirfd, name, &st, 0))
+		oi->mtime = st.st_mtime;
+
+	if (small && !upload_batch())
+		goto resp;
+
+	lock_storage(store);
+
+	/* the events of the upload have to be swallowed while it is locked */
+	notify_barrier(store);
+
+	if (!object_info_valid(object_info_p)) {
+		/* the folder was removed while we were receiving */
+		discard_object_info();
+		unlock_storage(store);
+		code = PIMA15740_RESP_INVALID_PARENT_OBJECT;
+		goto resp;
+	}
+
+	upload_insert(object_info_p, object_info_path, object_info_alloc);
+	object_info_p = 0;
+#ifdef DEBUG
+	dump_obj(store, "after link");
+#endif
+
+	unlock_storage(store);
+
+	journal_end(JOURNAL_COMMIT);
+
+resp:
+	make_response(s_container, r_container, code, sizeof(*s_container));
+
+	return 0;
+}
+
+static int process_one_request(void *recv_buf, size_t *recv_size, void *send_buf, size_t *send_size)
+{
+	struct ptp_container *r_container = recv_buf;
+	struct ptp_container *s_container = send_buf;
+	uint32_t *param, p1, p2, p3, prefetch = 0;
 	unsigned long length = *recv_size, type = 0, code = 0, id = 0;
 	size_t count = 0;
 	int ret;
 
 	do {
-		ret = read(bulk_out, recv_buf + count, *recv_size - count);
+		ret = read(bulk_out, recv_buf + count, *recv_size - count);
+		if (ret < 0) {
+			if (errno != EINTR)
+				return ret;
+
+			/* Need to wait for control thread to finish reset */
+			sem_wait(&reset);
+		} else {
+			count += ret;
+			if (count >= sizeof(*s_container)) {
+				length	= __le32_to_cpu(r_container->length);
+				type	= __le16_to_cpu(r_container->type);
+				code	= __le16_to_cpu(r_container->code);
+				id	= __le32_to_cpu(r_container->id);
+			}
+		}
+	} while (count < length);
+
+	if (count > length) {
+		/* TODO: have to stall according to Figure 7.2-1? */
+		fprintf(stderr, "BULK-OUT ERROR: received %u byte, expected %lu\n",
+			(unsigned int)count, length);
+		errno = EPIPE;
+		return -1;
+	}
+
+	memcpy(send_buf, recv_buf, sizeof(*s_container));
+
+	if (verbose)
+		fprintf(stderr, "BULK-OUT Received %lu byte, type %lu, code 0x%lx, id %lu\n",
+			length, type, code, id);
+
+	ret = -1;
+
+	switch (type) {
+	case PTP_CONTAINER_TYPE_COMMAND_BLOCK:
+		/* a batch of uploads ends with anything else */
+		if (code != PIMA15740_OP_SEND_OBJECT_INFO && code != PIMA15740_OP_SEND_OBJECT) {
+			upload_flush();
+			upload_commit();
+		}
+
+		switch (code) {
+		case PIMA15740_OP_GET_DEVICE_INFO:
+			CHECK_COUNT(count, 12, 12, "GET_DEVICE_INFO");
+
+			if (verbose)
+				fprintf(stderr, "%lu bytes device info\n", sizeof(dev_info));
+			count = sizeof(dev_info) + sizeof(*s_container);
+
+			/* First part: data block */
+			s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
+			s_container->length = __cpu_to_le32(count);
+			memcpy(send_buf + sizeof(*s_container), &dev_info, sizeof(dev_info));
+			ret = bulk_write(s_container, count);
+			if (ret < 0)
+				return ret;
+
+			/* Second part: response block */
+			s_container = send_buf + count;
+			make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+
+			break;
+		case PIMA15740_OP_OPEN_SESSION:
+			CHECK_COUNT(count, 16, 16, "OPEN_SESSION");
+
+			ret = sizeof(*s_container);
+			param = (uint32_t *)r_container->payload;
+			p1 = __le32_to_cpu(*param);
+			if (verbose)
+				fprintf(stderr, "OpenSession %d\n", p1);
+			/* No multiple sessions. */
+			if (session > 0) {
+				/* already open */
+				code = PIMA15740_RESP_SESSION_ALREADY_OPEN;
+				*param = __cpu_to_le32(session);
+				ret += sizeof(*param);
+			} else if (!p1) {
+				code = PIMA15740_RESP_INVALID_PARAMETER;
+			} else {
+				code = PIMA15740_RESP_OK;
+				session = p1;
+			}
+			make_response(s_container, r_container, code, ret);
+			count = 0;
+			break;
+		case PIMA15740_OP_CLOSE_SESSION:
+			CHECK_COUNT(count, 12, 12, "CLOSE_SESSION");
+
+			if (session > 0) {
+				code = PIMA15740_RESP_OK;
+				session = -EINVAL;
+			} else {
+				code = PIMA15740_RESP_SESSION_NOT_OPEN;
+			}
+			make_response(s_container, r_container, code, sizeof(*s_container));
+			ret = 0;
+			count = 0;
+			break;
+		case PIMA15740_OP_GET_OBJECT_HANDLES:
+			CHECK_COUNT(count, 16, 24, "GET_OBJECT_HANDLES");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_object_handles(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case PIMA15740_OP_GET_OBJECT_INFO:
+			CHECK_COUNT(count, 16, 16, "GET_OBJECT_INFO");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_object_info(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			prefetch = __le32_to_cpu(*(uint32_t *)r_container->payload);
+			break;
+		case PIMA15740_OP_GET_STORAGE_IDS:
+			CHECK_COUNT(count, 12, 12, "GET_STORAGE_IDS");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_storage_ids(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case PIMA15740_OP_GET_STORAGE_INFO:
+			CHECK_COUNT(count, 16, 16, "GET_STORAGE_INFO");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_storage_info(recv_buf, send_buf, *send_size);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case PIMA15740_OP_GET_OBJECT:
+			CHECK_COUNT(count, 16, 16, "GET_OBJECT");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_object_or_thumb(recv_buf, send_buf, *send_size, 0);
+			count = ret; /* even if ret is negative, handled below */
+			prefetch = __le32_to_cpu(*(uint32_t *)r_container->payload);
+			break;
+		case PIMA15740_OP_GET_NUM_OBJECTS:
+			CHECK_COUNT(count, 16, 24, "GET_NUM_OBJECTS");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = 12;
+			param = (uint32_t *)r_container->payload;
+			p1 = __le32_to_cpu(*param);
+			p2 = __le32_to_cpu(*(param + 1));
+			p3 = __le32_to_cpu(*(param + 2));
+			if (count > 16 && p2 != PTP_PARAM_UNUSED && p2 != PTP_PARAM_ANY)
+				code = PIMA15740_RESP_SPECIFICATION_BY_FORMAT_NOT_SUPPORTED;
+			else {
+				struct handle_list hl = { .count_only = 1 };
+
+				/* No parent Association specified or 0: all objects */
+				code = collect_handles(p1, count > 20 ? p3 : PTP_PARAM_UNUSED, &hl);
+				if (code == PIMA15740_RESP_OK) {
+					ret += sizeof(*param);
+					*(uint32_t *)s_container->payload = __cpu_to_le32(hl.num);
+				}
+			}
+			make_response(s_container, r_container, code, ret);
+			count = 0;
+			break;
+		case PIMA15740_OP_GET_THUMB:
+			CHECK_COUNT(count, 16, 16, "GET_THUMB");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = send_object_or_thumb(recv_buf, send_buf, *send_size, 1);
+			count = ret; /* even if ret is negative, handled below */
+			break;
+		case PIMA15740_OP_DELETE_OBJECT:
+			CHECK_COUNT(count, 16, 20, "DELETE_OBJECT");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			delete_object(recv_buf, send_buf);
+			count = 0;
+			ret = 0;
+			break;
+		case PIMA15740_OP_SEND_OBJECT_INFO:
+			CHECK_COUNT(count, 12, 20, "SEND_OBJECT_INFO");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			process_send_object_info(recv_buf, send_buf);
+			count = 0;
+			ret = 0;
+			break;
+		case PIMA15740_OP_SEND_OBJECT:
+			CHECK_COUNT(count, 12, 12, "SEND_OBJECT");
+			CHECK_SESSION(s_container, r_container, &count, &ret);
+
+			ret = process_send_object(recv_buf, send_buf);
+			count = 0;
+			break;
+		}
+		break;
+	}
+
+	if (ret < 0) {
+		if (errno == EPIPE)
+			return -1;
+
+		if (verbose)
+			fprintf(stderr, "Unsupported type %lu code 0x%lx\n", type, code);
+		errno = EOPNOTSUPP;
+		make_response(s_container, r_container,
+			      PIMA15740_RESP_OPERATION_NOT_SUPPORTED, sizeof(*s_container));
+		count = 0;
+	}
+
+	/* send out response at send_buf + count */
+	s_container = send_buf + count;
+	length = __le32_to_cpu(s_container->length);
+	ret = bulk_write(s_container, length);
+
+	/* read ahead while the host looks at the answer */
+	if (ret >= 0 && prefetch)
+		object_prefetch(prefetch);
+
+	return ret;
+}
+
+static void cleanup_endpoint(int ep_fd, char *ep_name)
+{
+	int ret;
+
+	if(ep_fd < 0)
+		return;
+
+	ret = ioctl(ep_fd, FUNCTIONFS_FIFO_STATUS);
+	if(ret < 0)
+	{
+		//ENODEV reported after disconnect
+		if(errno != ENODEV)
+			fprintf(stderr, "%s, %s: get fifo status(%s): %s \n", __FILE__, __FUNCTION__, ep_name, strerror(errno));
+	}
+	else if(ret)
+	{
+		if (verbose)
+			fprintf(stderr, "%s, %s: %s: unclaimed = %d \n", __FILE__, __FUNCTION__, ep_name, ret);
+		if(ioctl(ep_fd, FUNCTIONFS_FIFO_FLUSH) < 0)
+			fprintf(stderr, "%s, %s: %s: fifo flush \n", __FILE__, __FUNCTION__, ep_name);
+	}
+
+	if(close(ep_fd) < 0)
+		fprintf(stderr, "%s, %s: %s: close \n", __FILE__, __FUNCTION__, ep_name);
+}
+
+/*
+ * communication thread cleanup actions
+ */
+static void cleanup_bulk_thread(void *arg)
+{
+	(void) arg;
+
+	upload_flush();
+	upload_commit();
+	cleanup_endpoint(bulk_out, "out");
+	cleanup_endpoint(bulk_in, "in");
+	cleanup_endpoint(interrupt, "interrupt");
+}
+
+static void *bulk_thread(void *param)
+{
+	void *recv_buf, *send_buf;
+	int ret;
+	size_t s_size = BUF_SIZE, r_size = BUF_SIZE;
+	(void) param;
+
+	pthread_cleanup_push(cleanup_bulk_thread, NULL);
+
+	recv_buf = malloc(BUF_SIZE);
+	send_buf = malloc(BUF_SIZE);
+	if (!recv_buf || !send_buf) {
+		if (verbose)
+			fprintf(stderr, "No memory!\n");
+		goto done;
+	}
+
+	small_buf = malloc(small_object_size ? small_object_size : 1);
+	if (!small_buf) {
+		/* they just take the same path as all others */
+		fprintf(stderr, "No memory for small uploads, fast path disabled\n");
+		small_object_size = 0;
+	}
+
+	do {
+		ret = process_one_request(recv_buf, &r_size, send_buf, &s_size);
+		if (ret < 0 && errno == EPIPE) {
+			/* TODO: Have to stall and wait to be unstalled / exit
+			 * thread to be restarted */
+			fprintf(stderr, "Protocol error!\n");
+			break;
+		}
+
+		pthread_testcancel();
+	} while (ret >= 0);
+
+	pthread_cleanup_pop(1);
+done:
+	free(recv_buf);
+	free(send_buf);
+	free(small_buf);
+	small_buf = NULL;
+	pthread_exit(NULL);
+}
+
+/*
+ * Since functionfs unfortunately neither support select/poll operations nor nonblocking i/o
+ * we need to split end point handling and inotify processing into separate threads.
+ * Nevertheless sometime it's important to ensure a specific processing order.
+ * Calling this helper will ensure that all inotify events, existing at this moment, will be
+ * applied before continuing. The watcher needs the storage lock for that, so it is released
+ * while waiting, callers must expect the catalog to have changed afterwards.
+ */
+static void notify_barrier(struct storage *store)
+{
+	unsigned int applied;
+	int queued, done;
+
+	for (;;) {
+		pthread_mutex_lock(&store->notify_lock);
+		/* events can only leave the queue with notify_busy set */
+		done = !store->watching || (!store->notify_busy &&
+			(ioctl(store->notify_fd, FIONREAD, &queued) < 0 || !queued));
+		applied = store->notify_applied;
+		pthread_mutex_unlock(&store->notify_lock);
+
+		if (done)
+			return;
+
+		unlock_storage(store);
+
+		pthread_mutex_lock(&store->notify_lock);
+		while (store->watching && store->notify_applied == applied)
+			pthread_cond_wait(&store->notify_cond, &store->notify_lock);
+		pthread_mutex_unlock(&store->notify_lock);
+
+		lock_storage(store);
+	}
+}
+
+/* Wait for events and claim them, before they are read, 0 on timeout */
+static int notify_begin(struct storage *store, int timeout)
+{
+	struct pollfd pfd = { .fd = store->notify_fd, .events = POLLIN };
+	int ret;
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret <= 0)
+		return ret;
+
+	pthread_mutex_lock(&store->notify_lock);
+	store->notify_busy = 1;
+	pthread_mutex_unlock(&store->notify_lock);
+
+	return ret;
+}
+
+static void notify_end(struct storage *store, int exiting)
+{
+	pthread_mutex_lock(&store->notify_lock);
+	store->notify_busy = 0;
+	store->notify_applied++;
+	if (exiting)
+		store->watching = 0;
+	pthread_cond_broadcast(&store->notify_cond);
+	pthread_mutex_unlock(&store->notify_lock);
+}
+
+#define INOTIFY_EVENT_SIZE  ( sizeof(struct inotify_event) )
+#define INOTIFY_EVENT_BUF   ( INOTIFY_EVENT_SIZE + NAME_MAX + 1 )
+/* Large enough for hundreds of events, fewer trips and less overflow */
+#define INOTIFY_BUF_SIZE    ( 64 * 1024 )
+
+/*
+ * When events got lost, the catalog is reconciled with the disk one directory
+ * at a time. The directory is read and sorted without holding the storage
+ * lock, then merged with the sorted children in the catalog, so that only
+ * the differences turn into events. New files are probed between taking
+ * out what is gone and adding them, again without the lock. The watcher
+ * goes on handling events in between, the bulk thread only waits for the
+ * merge of a single directory.
+ */
+static int scan_entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct scan_entry *)a)->name,
+		      ((const struct scan_entry *)b)->name);
+}
+
+static int obj_name_cmp(const void *a, const void *b)
+{
+	return strcmp((*(struct obj_list * const *)a)->name,
+		      (*(struct obj_list * const *)b)->name);
+}
+
+static void free_scan(struct scan_entry *entries, int n)
+{
+	while (n--)
+		free(entries[n].name);
+	free(entries);
+}
+
+/* Sorted snapshot of the regular files and directories in path */
+static int scan_directory(const char *path, struct scan_entry **entries)
+{
+	struct scan_entry *e = NULL, *tmp;
+	struct dirent *dentry;
+	int n = 0, size = 0;
+	DIR *d;
+
+	d = opendir(path);
+	if (!d)
+		return -1;
+
+	while ((dentry = readdir(d))) {
+		/* the same names add_object() would skip */
+		if (dentry->d_name[0] == '.')
+			continue;
+
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			tmp = realloc(e, size * sizeof(*e));
+			if (!tmp)
+				break;
+			e = tmp;
+		}
+
+		if (stat_file(dirfd(d), dentry->d_name, 0, &e[n].st, &e[n].key) < 0 ||
+		    (!S_ISDIR(e[n].st.st_mode) && !S_ISREG(e[n].st.st_mode)))
+			continue;
+
+		e[n].name = strdup(dentry->d_name);
+		if (!e[n].name)
+			break;
+		n++;
+	}
+	closedir(d);
+
+	if (n)
+		qsort(e, n, sizeof(*e), scan_entry_cmp);
+	*entries = e;
+
+	return n;
+}
+
+static int object_changed(const struct obj_list *obj, const struct scan_entry *e)
+{
+	if ((S_ISDIR(e->st.st_mode) ? 1 : 0) != object_is_association(obj) ||
+	    !file_key_equal(&obj->key, &e->key))
+		return 1;
+
+	return !S_ISDIR(e->st.st_mode) &&
+		(__le32_to_cpu(obj->info.object_compressed_size) != (uint32_t)e->st.st_size ||
+		 obj->mtime != e->st.st_mtime);
+}
+
+/*
+ * Merge a directory snapshot into the catalog, called with the storage
+ * locked. What is gone or changed is removed, the entries still to be
+ * added are moved to the front, their number is returned.
+ */
+static int reconcile_directory(struct storage *store, struct obj_list *dir,
+			       struct scan_entry *entries, int n)
+{
+	GQueue *children = child_list(store, dir ? dir->handle : 0);
+	struct obj_list **objs = NULL, *obj;
+	struct scan_entry tmp;
+	char path[PATH_MAX];
+	int i = 0, j = 0, m = 0, added = 0, cmp;
+	GList *l;
+
+	if (children && !g_queue_is_empty(children)) {
+		objs = malloc(g_queue_get_length(children) * sizeof(*objs));
+		if (!objs)
+			return 0;
+		for (l = children->head; l; l = l->next)
+			objs[m++] = l->data;
+		qsort(objs, m, sizeof(*objs), obj_name_cmp);
+	}
+
+	while (i < n || j < m) {
+		if (i == n)
+			cmp = 1;
+		else if (j == m)
+			cmp = -1;
+		else
+			cmp = strcmp(entries[i].name, objs[j]->name);
+
+		if (cmp > 0) {
+			/* gone from disk */
+			remove_object(objs[j++], 1);
+			continue;
+		}
+
+		obj = cmp ? NULL : objs[j++];
+
+		if (get_child_path(dir, entries[i].name, path, sizeof(path)) < 0 ||
+		    upload_pending(store, path)) {
+			i++;
+			continue;
+		}
+
+		if (obj && object_changed(obj, &entries[i])) {
+			remove_object(obj, 1);
+			obj = NULL;
+		}
+
+		if (!obj) {
+			/* only entries before i were looked at already */
+			tmp = entries[added];
+			entries[added++] = entries[i];
+			entries[i] = tmp;
+		} else if (object_is_association(obj)) {
+			g_queue_push_tail(&store->rescan, GUINT_TO_POINTER(obj->handle));
+		}
+		i++;
+	}
+
+	free(objs);
+	return added;
+}
+
+/* Start over with a full rescan, called with the storage locked */
+static void schedule_rescan(struct storage *store)
+{
+	if (verbose)
+		fprintf(stderr, "events of %s lost, rescanning\n", store->root);
+
+	g_queue_clear(&store->rescan);
+	g_queue_push_tail(&store->rescan, GUINT_TO_POINTER(0));
+}
+
+static void rescan_next(struct storage *store)
+{
+	struct scan_entry *entries;
+	struct obj_list *dir = NULL;
+	char name[PATH_MAX], path[PATH_MAX];
+	uint32_t handle;
+	int n, i, added = 0, dirfd, ret = 0;
+
+	lock_storage(store);
+	if (g_queue_is_empty(&store->rescan)) {
+		unlock_storage(store);
+		return;
+	}
+
+	handle = GPOINTER_TO_UINT(g_queue_pop_head(&store->rescan));
+	if (handle) {
+		dir = find_object(handle);
+		ret = dir ? get_object_path(dir, name, sizeof(name)) : -1;
+		if (ret >= 0)
+			ret = get_storage_path(store, name, path, sizeof(path));
+	} else {
+		snprintf(path, sizeof(path), "%s", store->root);
+	}
+	unlock_storage(store);
+
+	/* vanished directories are taken care of by their parent */
+	if (ret < 0)
+		return;
+
+	n = scan_directory(path, &entries);
+	if (n < 0)
+		return;
+
+	lock_storage(store);
+	/*
+	 * the handle of a cataloged directory is never reused, only that of a
+	 * discarded ObjectInfo, so the directory is still the same
+	 */
+	if (store->available && (!handle || (dir = find_object(handle)))) {
+		added = reconcile_directory(store, dir, entries, n);
+		free_space_stale(store);
+	}
+	unlock_storage(store);
+
+	dirfd = added ? open(path, O_PATH | O_DIRECTORY) : -1;
+	for (i = 0; i < added; i++)
+		if (dirfd < 0 || probe_entry(dirfd, entries[i].name, &entries[i]) < 0)
+			entries[i].st.st_mode = 0;
+	if (dirfd >= 0)
+		close(dirfd);
+
+	lock_storage(store);
+	if (added && store->available && (!handle || (dir = find_object(handle)))) {
+		for (i = 0; i < added; i++) {
+			/* the bulk thread may have added it meanwhile */
+			if (find_child(store, dir, entries[i].name) ||
+			    get_child_path(dir, entries[i].name, path, sizeof(path)) < 0 ||
+			    upload_pending(store, path))
+				continue;
+			/* directories are scanned on their own, once added */
+			add_object(store, dir, entries[i].name, &entries[i], 1);
+		}
+	}
+	unlock_storage(store);
+
+	free_scan(entries, n);
+}
+
+static int rescan_pending(struct storage *store)
+{
+	int ret;
+
+	lock_storage(store);
+	ret = !g_queue_is_empty(&store->rescan);
+	unlock_storage(store);
+
+	return ret;
+}
+
+static int events_pending(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Rename a file in place, so that it keeps its handle and thumbnail. The
+ * object is reallocated for the new filename string. Directories are removed
+ * and added again instead, the handle map gives them their handles back.
+ * Called with the storage locked.
+ */
+static int rename_object(struct storage *store, struct obj_list *obj,
+			 struct obj_list *parent, const char *name)
+{
+	size_t namelen, old_namelen = obj->info.strings[0];
+	size_t tail, info_size;
+	char name_ucs2[2 * PTP_STRING_MAX];
+	struct obj_list *new;
+	int ret;
+#ifdef THUMB_SUPPORT
+	char old_thumb[PATH_MAX], new_thumb[PATH_MAX];
+#endif
+
+	if (object_is_association(obj) || strlen(name) >= sizeof(new->name))
+		return -1;
+
+	ret = put_string(name_ucs2, PTP_STRING_MAX, name);
+	if (ret < 0)
+		return ret;
+	namelen = ret;
+
+	/* capture date, modification date and keywords follow the filename */
+	tail = obj->info_size - sizeof(obj->info) - 1 - old_namelen * 2;
+	info_size = sizeof(obj->info) + 1 + namelen * 2 + tail;
+
+	new = malloc(sizeof(*new) + info_size - sizeof(new->info));
+	if (!new)
+		return -1;
+
+	memcpy(new, obj, sizeof(*new));
+	new->parent = parent;
+	new->info_size = info_size;
+	new->info.parent_object = __cpu_to_le32(parent ? parent->handle : 0);
+	snprintf(new->name, sizeof(new->name), "%s", name);
+	new->info.strings[0] = namelen;
+	memcpy(new->info.strings + 1, name_ucs2, namelen * 2);
+	memcpy(new->info.strings + 1 + namelen * 2,
+	       obj->info.strings + 1 + old_namelen * 2, tail);
+
+#ifdef THUMB_SUPPORT
+	/* one still being made is looked after by its job */
+	if (__le16_to_cpu(obj->info.thumb_format) == PIMA15740_FMT_I_JFIF &&
+	    obj->info.thumb_compressed_size && !obj->thumb_offset &&
+	    get_thumb_filename(obj, old_thumb, sizeof(old_thumb)) >= 0) {
+		if (get_thumb_filename(new, new_thumb, sizeof(new_thumb)) < 0 ||
+		    thumb_pack_rename(old_thumb, new_thumb) < 0) {
+			thumb_pack_remove(old_thumb);
+			new->info.thumb_format = __cpu_to_le16(PIMA15740_FMT_A_UNDEFINED);
+		}
+	}
+#endif
+
+	/* swap the new object in, the handle stays the same */
+	g_queue_remove(child_list(store, parent_handle(obj)), obj);
+	catalog_add_child(new);
+	g_hash_table_insert(store->object_index, GUINT_TO_POINTER(new->handle), new);
+	new->link->data = new;
+	free(obj);
+
+	send_event(PIMA15740_EVENT_OBJECT_INFO_CHANGED, new->handle);
+
+	return 0;
+}
+
+/*
+ * Events are read in batches and applied under one lock acquisition. All
+ * events for the same name are merged into one, what is done is decided by
+ * the state on disk when the batch is applied, e.g. a file created and
+ * deleted again within a batch is never added. That state is looked up
+ * right before, without the lock.
+ */
+struct watch_event {
+	uint32_t	parent;		/* handle, 0 for the storage root */
+	uint32_t	mask;		/* inotify bits of all events for the name */
+	int		done;
+	char		*name;
+	char		*path;		/* NULL for uploads and names too long */
+	int		exists;
+	struct scan_entry	file;	/* see batch_probe() */
+};
+
+struct event_batch {
+	struct watch_event	*events;
+	int			num;
+	int			size;
+	GHashTable		*names;		/* "parent/name" -> index + 1 */
+};
+
+static void batch_init(struct event_batch *batch)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->names = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+}
+
+static void batch_clear(struct event_batch *batch)
+{
+	while (batch->num--) {
+		free(batch->events[batch->num].name);
+		free(batch->events[batch->num].path);
+	}
+	batch->num = 0;
+	g_hash_table_remove_all(batch->names);
+}
+
+/* Called with the storage locked */
+static void batch_add(struct storage *store, struct event_batch *batch,
+		      struct obj_list *parent, const char *name, uint32_t mask)
+{
+	uint32_t handle = parent ? parent->handle : 0;
+	struct watch_event *e;
+	char key[PATH_MAX], path[PATH_MAX];
+	gpointer index;
+	int size;
+
+	snprintf(key, sizeof(key), "%08x/%s", handle, name);
+	index = g_hash_table_lookup(batch->names, key);
+	if (index) {
+		batch->events[GPOINTER_TO_INT(index) - 1].mask |= mask;
+		return;
+	}
+
+	if (batch->num == batch->size) {
+		size = batch->size ? batch->size * 2 : 256;
+		e = realloc(batch->events, size * sizeof(*e));
+		if (!e) {
+			/* the change is lost, a rescan picks it up */
+			schedule_rescan(store);
+			return;
+		}
+		batch->events = e;
+		batch->size = size;
+	}
+
+	e = &batch->events[batch->num];
+	e->name = strdup(name);
+	if (!e->name) {
+		schedule_rescan(store);
+		return;
+	}
+	e->path = NULL;
+	/* uploads aren't looked at, see apply_event() */
+	if (get_child_path(parent, name, path, sizeof(path)) >= 0 &&
+	    !upload_pending(store, path))
+		e->path = strdup(path);
+	e->parent = handle;
+	e->mask = mask;
+	e->done = 0;
+	e->exists = 0;
+	g_hash_table_insert(batch->names, strdup(key), GINT_TO_POINTER(++batch->num));
+}
+
+/*
+ * Look up what is on disk for every name in the batch, without the storage
+ * lock. Only complete files are probed, see apply_event().
+ */
+static void batch_probe(struct storage *store, struct event_batch *batch)
+{
+	char abspath[PATH_MAX];
+	const char *at;
+	int i, dirfd;
+
+	for (i = 0; i < batch->num; i++) {
+		struct watch_event *e = &batch->events[i];
+
+		e->exists = 0;
+		if (!e->path)
+			continue;
+		dirfd = storage_at(store, e->path, abspath, sizeof(abspath), &at);
+		if (dirfd == -1)
+			continue;
+
+		memset(&e->file.ip, 0, sizeof(e->file.ip));
+		e->exists = !stat_file(dirfd, at, 0, &e->file.st, &e->file.key);
+		if (e->exists && S_ISREG(e->file.st.st_mode) && e->file.st.st_size &&
+		    (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+			probe_image(dirfd, at, &e->file.ip);
+	}
+}
+
+/* The association of a handle, the watched directory may be gone by now */
+static int batch_parent(uint32_t handle, struct obj_list **parent)
+{
+	*parent = handle ? find_object(handle) : NULL;
+
+	return handle && !*parent ? -1 : 0;
+}
+
+/*
+ * A file moved within the storage shows up as IN_MOVED_FROM and IN_MOVED_TO.
+ * Both are paired by file identity, which also works for fanotify, that has
+ * no cookies.
+ */
+static int batch_rename(struct storage *store, struct event_batch *batch,
+			struct watch_event *to, struct obj_list *parent,
+			const struct file_key *key)
+{
+	struct obj_list *from_parent, *obj, *old;
+	int i;
+
+	for (i = 0; i < batch->num; i++) {
+		struct watch_event *from = &batch->events[i];
+
+		if (!(from->mask & IN_MOVED_FROM) || from == to ||
+		    batch_parent(from->parent, &from_parent) < 0)
+			continue;
+
+		obj = find_child(store, from_parent, from->name);
+		if (!obj || !file_key_equal(&obj->key, key))
+			continue;
+
+		/* a rename over an existing file replaces it */
+		old = find_child(store, parent, to->name);
+		if (old && old != obj)
+			remove_object(old, 1);
+
+		if (verbose)
+			fprintf(stderr, "inotify: %s renamed to %s\n", from->name, to->name);
+
+		if (rename_object(store, obj, parent, to->name) < 0)
+			return -1;
+
+		from->done = 1;
+		to->done = 1;
+		return 0;
+	}
+
+	return -1;
+}
+
+static void apply_event(struct storage *store, struct event_batch *batch,
+			struct watch_event *e)
+{
+	const char *path = e->path;
+	const struct stat *st = &e->file.st;
+	struct obj_list *parent, *obj;
+
+	if (!path || batch_parent(e->parent, &parent) < 0)
+		return;
+
+	/* uploads in store->uploads are added by the bulk thread once complete */
+	if (upload_pending(store, path))
+		return;
+
+	obj = find_child(store, parent, e->name);
+
+	if (!e->exists) {
+		if (obj) {
+			if (verbose)
+				fprintf(stderr, "inotify: deleting %s\n", path);
+			remove_object(obj, 1);
+		}
+		return;
+	}
+
+	if ((e->mask & IN_MOVED_TO) && !S_ISDIR(st->st_mode) &&
+	    !batch_rename(store, batch, e, parent, &e->file.key))
+		return;
+
+	/* files still being written are added on IN_CLOSE_WRITE */
+	if (!(e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && !S_ISDIR(st->st_mode))
+		return;
+
+	if (obj) {
+		/*
+		 * Directories created by SendObjectInfo or found while
+		 * scanning the parent are already known
+		 */
+		if (!(e->mask & IN_CLOSE_WRITE) && !object_changed(obj, &e->file))
+			return;
+
+		if (verbose)
+			fprintf(stderr, "inotify: %s changed, delete it first\n", path);
+		remove_object(obj, 1);
+	}
+
+	if (add_object(store, parent, e->name, &e->file, 1) > 0 && verbose)
+		fprintf(stderr, "inotify: added %s\n", path);
+}
+
+/* Called with the storage locked */
+static void apply_batch(struct storage *store, struct event_batch *batch)
+{
+	int i;
+
+	if (!batch->num)
+		return;
+
+	/* renames first, before their source is taken for deleted */
+	for (i = 0; i < batch->num; i++) {
+		struct watch_event *e = &batch->events[i];
+		struct obj_list *parent;
+
+		if (!(e->mask & IN_MOVED_TO) || e->done || !e->exists ||
+		    batch_parent(e->parent, &parent) < 0 ||
+		    upload_pending(store, e->path) ||
+		    S_ISDIR(e->file.st.st_mode))
+			continue;
+
+		batch_rename(store, batch, e, parent, &e->file.key);
+	}
+
+	/*
+	 * then everything gone, so that a directory moved within the storage
+	 * has given up the keys of its tree, before it is added where it went
+	 * and gets its handles back from the map
+	 */
+	for (i = 0; i < batch->num; i++) {
+		struct watch_event *e = &batch->events[i];
+
+		if (e->done || e->exists)
+			continue;
+
+		apply_event(store, batch, e);
+		e->done = 1;
+	}
+
+	for (i = 0; i < batch->num; i++)
+		if (!batch->events[i].done)
+			apply_event(store, batch, &batch->events[i]);
+
+	free_space_stale(store);
+}
+
+/* Map a watch descriptor to the association it watches, NULL is the root */
+static int lookup_watch(struct storage *store, int wd, struct obj_list **parent)
+{
+	if (wd == store->root_wd) {
+		*parent = NULL;
+		return 0;
+	}
+
+	*parent = g_hash_table_lookup(store->watch_index, GINT_TO_POINTER(wd));
+
+	return *parent ? 0 : -1;
+}
+
+/* Same for a fanotify directory handle */
+static int lookup_dir_handle(struct storage *store, const struct file_handle *fh,
+			     struct obj_list **parent)
+{
+	struct dir_handle key;
+
+	key.len = sizeof(*fh) + fh->handle_bytes;
+	if (key.len > sizeof(key.data))
+		return -1;
+	memcpy(key.data, fh, key.len);
+
+	if (store->root_fh && dir_handle_equal(&key, store->root_fh)) {
+		*parent = NULL;
+		return 0;
+	}
+
+	*parent = g_hash_table_lookup(store->fh_index, &key);
+
+	return *parent ? 0 : -1;
+}
+
+static int init_fanotify(void)
+{
+	int fd;
+
+	fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE);
+	if (fd < 0) {
+		perror("fanotify init failed");
+		return fd;
+	}
+
+	return fd;
+}
+
+static uint32_t fanotify_to_inotify_mask(uint64_t mask)
+{
+	uint32_t in_mask = 0;
+
+	if (mask & FAN_CLOSE_WRITE)
+		in_mask |= IN_CLOSE_WRITE;
+	if (mask & FAN_CREATE)
+		in_mask |= IN_CREATE;
+	if (mask & FAN_DELETE)
+		in_mask |= IN_DELETE;
+	if (mask & FAN_MOVED_FROM)
+		in_mask |= IN_MOVED_FROM;
+	if (mask & FAN_MOVED_TO)
+		in_mask |= IN_MOVED_TO;
+	if (mask & FAN_ONDIR)
+		in_mask |= IN_ISDIR;
+
+	return in_mask;
+}
+
+#define FANOTIFY_BUF_SIZE	(64 * 1024)
+
+static void *fanotify_thread(void *param)
+{
+	char buffer[FANOTIFY_BUF_SIZE]
+		__attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+	struct fanotify_event_metadata *meta;
+	struct storage *store = param;
+	struct event_batch batch;
+	ssize_t length = 0;
+	int ret;
+
+	batch_init(&batch);
+
+	do {
+		/* Rescan, while no events are waiting */
+		if (rescan_pending(store) && !events_pending(store->notify_fd)) {
+			rescan_next(store);
+			continue;
+		}
+
+		/* free space is refreshed, once no events came for a while */
+		ret = notify_begin(store, free_space_timeout(store));
+		if (ret <= 0) {
+			if (!ret || errno == EINTR)
+				continue;
+			fprintf(stderr, "fanotify poll: %s\n", strerror(errno));
+			break;
+		}
+
+		length = read(store->notify_fd, buffer, sizeof(buffer));
+
+		if (length < 0) {
+			if (errno == EINTR) {
+				notify_end(store, 0);
+				length = 0;
+				continue;
+			}
+			/* the claim is given up on the way out */
+			fprintf(stderr, "fanotify read: %s\n", strerror(errno));
+			break;
+		}
+
+		lock_storage(store);
+		for (meta = (struct fanotify_event_metadata *)buffer;
+		     FAN_EVENT_OK(meta, length); meta = FAN_EVENT_NEXT(meta, length)) {
+			struct fanotify_event_info_fid *fid = (void *)(meta + 1);
+			struct file_handle *fh;
+			struct obj_list *parent;
+
+			if (meta->vers != FANOTIFY_METADATA_VERSION) {
+				fprintf(stderr, "fanotify: unsupported metadata version %u\n",
+					meta->vers);
+				break;
+			}
+
+			if (meta->mask & FAN_Q_OVERFLOW) {
+				schedule_rescan(store);
+				continue;
+			}
+
+			if (meta->event_len < sizeof(*meta) + sizeof(*fid) ||
+			    fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+				continue;
+
+			fh = (struct file_handle *)fid->handle;
+
+			if (store->available && lookup_dir_handle(store, fh, &parent) == 0)
+				batch_add(store, &batch, parent,
+					  (char *)fh->f_handle + fh->handle_bytes,
+					  fanotify_to_inotify_mask(meta->mask));
+		}
+		unlock_storage(store);
+
+		batch_probe(store, &batch);
+
+		lock_storage(store);
+		if (store->available)
+			apply_batch(store, &batch);
+		batch_clear(&batch);
+		unlock_storage(store);
+		notify_end(store, 0);
+
+		pthread_testcancel();
+	} while (length >= 0);
+
+	notify_end(store, 1);
+	pthread_exit(NULL);
+}
+
+static void *inotify_thread(void *param) {
+	char buffer[INOTIFY_BUF_SIZE]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct storage *store = param;
+	struct event_batch batch;
+	int i, ret, length = 0;
+
+	if (store->use_fanotify)
+		return fanotify_thread(param);
+
+	batch_init(&batch);
+
+	do {
+		/* Rescan, while no events are waiting */
+		if (rescan_pending(store) && !events_pending(store->notify_fd)) {
+			rescan_next(store);
+			continue;
+		}
+
+		/* free space is refreshed, once no events came for a while */
+		ret = notify_begin(store, free_space_timeout(store));
+		if (ret <= 0) {
+			if (!ret || errno == EINTR)
+				continue;
+			fprintf(stderr, "inotify poll: %s\n", strerror(errno));
+			break;
+		}
+
+		length = read(store->notify_fd, buffer, sizeof(buffer));
+
+		if (length < 0) {
+			if (errno == EINTR) {
+				notify_end(store, 0);
+				length = 0;
+				continue;
+			}
+			/* the claim is given up on the way out */
+			fprintf(stderr, "inotify read: %s\n", strerror(errno));
+			break;
+		}
+
+		i = 0;
+		/* collect everything read, then apply it under one lock */
+		lock_storage(store);
+		while (i < length) {
+			struct inotify_event *event = (struct inotify_event *) &buffer[i];
+			struct obj_list *parent;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				/* the kernel queue ran full and dropped events */
+				schedule_rescan(store);
+			} else if (event->mask & IN_IGNORED) {
+				/* watch is gone together with its directory */
+				if (event->wd == store->root_wd)
+					store->root_wd = -1;
+				else
+					g_hash_table_remove(store->watch_index,
+							    GINT_TO_POINTER(event->wd));
+			} else if (event->len) {
+				if (store->available && lookup_watch(store, event->wd, &parent) == 0)
+					batch_add(store, &batch, parent, event->name, event->mask);
+			}
+			i += INOTIFY_EVENT_SIZE + event->len;
+		}
+		unlock_storage(store);
+
+		/* the files are looked at without holding up the bulk thread */
+		batch_probe(store, &batch);
+
+		lock_storage(store);
+		if (store->available)
+			apply_batch(store, &batch);
+		batch_clear(&batch);
+		unlock_storage(store);
+		notify_end(store, 0);
+
+		pthread_testcancel();
+	} while (length >= 0);
+
+	notify_end(store, 1);
+	pthread_exit(NULL);
+}
+
+static int start_io(void)
+{
+	int ret;
+
+	if (verbose)
+		fprintf(stderr, "Start bulk EPs\n");
+
+	if (bulk_in >= 0 && bulk_out >= 0)
+		return 0;
+
+	bulk_in = open(FFS_PTP_IN, O_RDWR);
+	if (bulk_in < 0)
+		return bulk_in;
+
+	bulk_out = open(FFS_PTP_OUT, O_RDWR);
+	if (bulk_out < 0)
+		return bulk_out;
+
+	interrupt = open(FFS_PTP_INT, O_RDWR);
+	if (interrupt < 0)
+		return interrupt;
+
+	status = PTP_IDLE;
+
+	ret = pthread_create(&bulk_pthread, NULL, bulk_thread, NULL);
+	if (ret < 0) {
+		perror ("can't create bulk thread");
+		return ret;
+	}
+
+	return 0;
+}
+
+static void stop_io(void)
+{
+	fprintf(stderr, "Stop bulk EPs\n");
+
+	if (bulk_in < 0 || bulk_out < 0)
+		return;
+
+	pthread_cancel(bulk_pthread);
+	pthread_join(bulk_pthread, NULL);
+
+	status = PTP_WAITCONFIG;
+
+	close(bulk_out);
+	bulk_out = -EINVAL;
+	close(bulk_in);
+	bulk_in = -EINVAL;
+	close(interrupt);
+	interrupt = -EINVAL;
+}
+
+static void init_device(void)
+{
+	int		ret;
+
+	control = open(FFS_PTP_EP0, O_RDWR);
+	if (control < 0) {
+		perror(FFS_PTP_EP0);
+		control = -errno;
+		return;
+	}
+
+	ret = write(control, &descriptors, sizeof(descriptors));
+	if (ret < 0) {
+		perror("write dev descriptors");
+		close(control);
+		control = -errno;
+		return;
+	}
+	ret = write(control, &strings, sizeof(strings));
+	if (ret < 0) {
+		perror("write dev strings");
+		close(control);
+		control = -errno;
+		return;
+	}
+
+	return;
+}
+
+/*-------------------------------------------------------------------------*/
+
+static int reset_interface(void)
+{
+	/* just reset toggle/halt for the interface's endpoints */
+	int err;
+
+	if (status == PTP_WAITCONFIG)
+		return 0;
+
+	sem_init(&reset, 0, 0);
+
+	pthread_kill(bulk_pthread, SIGINT);
+
+	err = ioctl(bulk_in, FUNCTIONFS_CLEAR_HALT);
+	if (err < 0)
+		perror("reset source fd");
+
+	err = ioctl(bulk_out, FUNCTIONFS_CLEAR_HALT);
+	if (err < 0)
+		perror("reset sink fd");
+
+	sem_post(&reset);
+
+	/* FIXME eventually reset the status endpoint too */
+
+	/* Always return "success"... */
+	return 0;
+}
+
+static void handle_control(struct usb_ctrlrequest *setup)
+{
+	int		err;
+	uint8_t		buf[256];
+	uint16_t	value, index, length;
+
+	value = __le16_to_cpu(setup->wValue);
+	index = __le16_to_cpu(setup->wIndex);
+	length = __le16_to_cpu(setup->wLength);
+
+	if (verbose)
+		fprintf(stderr, "SETUP %02x.%02x "
+				"v%04x i%04x %d\n",
+			setup->bRequestType, setup->bRequest,
+			value, index, length);
+
+	/*
+	if ((setup->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
+		goto special;
+	*/
+
+	switch (setup->bRequest) {
+	/* Still Image class-specific requests */
+	case USB_REQ_PTP_CANCEL_REQUEST:
+		return;
+	case USB_REQ_PTP_GET_EXTENDED_EVENT_DATA:
+		/* Optional, may stall */
+		goto stall;
+	case USB_REQ_PTP_DEVICE_RESET_REQUEST:
+		if (setup->bRequestType != 0x21
+				|| index != 0
+				|| value != 0)
+			goto stall;
+
+		err = reset_interface();
+		if (err)
+			goto stall;
+
+		/* ... and ack (a write would stall) */
+		err = read(control, &err, 0);
+		if (err)
+			perror("ack DEVICE_RESET_REQUEST");
+		return;
+	case USB_REQ_PTP_GET_DEVICE_STATUS_REQUEST:
+		if (setup->bRequestType != 0xa1
+				|| index != 0
+				|| value != 0)
+			goto stall;
+		else {
+			uint16_t resp_ok[] = {
+				__constant_cpu_to_le16(4),
+				__constant_cpu_to_le16(PIMA15740_RESP_OK),
+			};
+			memcpy(buf, resp_ok, 4);
+			err = write(control, buf, 4);
+			if (err != 4)
+				fprintf(stderr, "DEVICE_STATUS_REQUEST %d\n", err);
+		}
+
+		return;
+	default:
+		goto stall;
+	}
+
+stall:
+	if (verbose)
+		fprintf(stderr, "... protocol stall %02x.%02x\n",
+			setup->bRequestType, setup->bRequest);
+
+	/* non-iso endpoints are stalled by issuing an i/o request
+	 * in the "wrong" direction.  ep0 is special only because
+	 * the direction isn't fixed.
+	 */
+	if (setup->bRequestType & USB_DIR_IN)
+		err = read(control, &err, 0);
+	else
+		err = write(control, &err, 0);
+	if (err != -1)
+		fprintf(stderr, "can't stall ep0 for %02x.%02x\n",
+			setup->bRequestType, setup->bRequest);
+	else if (errno != EL2HLT)
+		perror("ep0 stall");
+}
+
+static int read_control(void)
+{
+	struct usb_functionfs_event event[NEVENT];
+	int i, nevent, ret;
+
+	static const char * const names[] = {
+		[FUNCTIONFS_BIND] = "BIND",
+		[FUNCTIONFS_UNBIND] = "UNBIND",
+		[FUNCTIONFS_ENABLE] = "ENABLE",
+		[FUNCTIONFS_DISABLE] = "DISABLE",
+		[FUNCTIONFS_SETUP] = "SETUP",
+		[FUNCTIONFS_SUSPEND] = "SUSPEND",
+		[FUNCTIONFS_RESUME] = "RESUME",
+	};
+
+	ret = read(control, &event, sizeof(event));
+	if (ret < 0) {
+		if (errno == EAGAIN) {
+			sleep(1);
+			return ret;
+		}
+		perror("ep0 read after poll");
+		return ret;
+	}
+	nevent = ret / sizeof event[0];
+
+	for (i = 0; i < nevent; i++) {
+		if (verbose)
+			fprintf(stderr,
+				"Event %s,%d", names[event->type], event[i].type);
+
+		switch (event[i].type) {
+		case FUNCTIONFS_BIND:
+			break;
+		case FUNCTIONFS_UNBIND:
+			break;
+		case FUNCTIONFS_ENABLE:
+			start_io();
+			break;
+		case FUNCTIONFS_DISABLE:
+			stop_io();
+			break;
+		case FUNCTIONFS_SETUP:
+			handle_control(&event[i].u.setup);
+			break;
+		case FUNCTIONFS_SUSPEND:
+			break;
+		case FUNCTIONFS_RESUME:
+			break;
+			break;
+		default:
+			fprintf(stderr,
+				"* unhandled event %d\n",
+				event[i].type);
+		}
+	}
+
+	return ret;
+}
+
+static int main_loop(void)
+{
+	struct pollfd ep_poll[1];
+	int ret;
+
+	do {
+		/* Always listen on control */
+		ep_poll[0].fd = control;
+		ep_poll[0].events = POLLIN | POLLHUP;
+
+		ret = poll(ep_poll, 1, -1);
 		if (ret < 0) {
-			if (errno != EINTR)
-				return ret;
+			perror("poll");
+			break;
+		}
 
-			/* Need to wait for control thread to finish reset */
-			sem_wait(&reset);
-		} else {
-			count += ret;
-			if (count >= sizeof(*s_container)) {
-				length	= __le32_to_cpu(r_container->length);
-				type	= __le16_to_cpu(r_container->type);
-				code	= __le16_to_cpu(r_container->code);
-				id	= __le32_to_cpu(r_container->id);
+		/* TODO: What to do with HUP? */
+		if (ep_poll[0].revents & POLLIN) {
+			ret = read_control();
+			if (ret < 0) {
+				if (errno == EAGAIN)
+					continue;
+				goto done;
 			}
 		}
-	} while (count < length);
+	} while (1);
 
-	if (count > length) {
-		/* TODO: have to stall according to Figure 7.2-1? */
-		fprintf(stderr, "BULK-OUT ERROR: received %u byte, expected %lu\n",
-			(unsigned int)count, length);
-		errno = EPIPE;
-		return -1;
+	return 0;
+
+done:
+	switch (status) {
+	case PTP_IDLE:
+	case PTP_DATA_OUT:
+	case PTP_DATA_IN:
+	case PTP_DATA_READY:
+		stop_io();
+	case PTP_WAITCONFIG:
+		break;
 	}
 
-	memcpy(send_buf, recv_buf, sizeof(*s_container));
+	return ret;
+}
 
-	if (verbose)
-		fprintf(stderr, "BULK-OUT Received %lu byte, type %lu, code 0x%lx, id %lu\n",
-			length, type, code, id);
+/*-------------------------------------------------------------------------*/
 
-	ret = -1;
+/*
+ * PTP strings are UTF-16LE, names on disk are taken as UTF-8. Most names
+ * are plain ASCII, such runs are converted 16 characters at a time where
+ * SSE2 or NEON is available.
+ */
 
-	sem_wait(&dbaccess);
+/* Widen leading ASCII characters, returns how many were done */
+static size_t widen_ascii(uint8_t *out, const uint8_t *in, size_t len)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
 
-	switch (type) {
-	case PTP_CONTAINER_TYPE_COMMAND_BLOCK:
-		switch (code) {
-		case PIMA15740_OP_GET_DEVICE_INFO:
-			CHECK_COUNT(count, 12, 12, "GET_DEVICE_INFO");
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
 
-			if (verbose)
-				fprintf(stderr, "%lu bytes device info\n", sizeof(dev_info));
-			count = sizeof(dev_info) + sizeof(*s_container);
+		if (_mm_movemask_epi8(v))
+			break;
+		_mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i *)(out + 2 * i + 16), _mm_unpackhi_epi8(v, zero));
+	}
+#elif defined(__ARM_NEON)
+	uint8x16x2_t v;
+	uint8x8_t any;
+
+	v.val[1] = vdupq_n_u8(0);
+	for (; i + 16 <= len; i += 16) {
+		v.val[0] = vld1q_u8(in + i);
+		any = vorr_u8(vget_low_u8(v.val[0]), vget_high_u8(v.val[0]));
+		if (vget_lane_u64(vreinterpret_u64_u8(any), 0) & 0x8080808080808080ULL)
+			break;
+		vst2q_u8(out + 2 * i, v);
+	}
+#endif
 
-			/* First part: data block */
-			s_container->type = __cpu_to_le16(PTP_CONTAINER_TYPE_DATA_BLOCK);
-			s_container->length = __cpu_to_le32(count);
-			memcpy(send_buf + sizeof(*s_container), &dev_info, sizeof(dev_info));
-			ret = bulk_write(s_container, count);
-			if (ret < 0) {
-				sem_post(&dbaccess);
-				return ret;
-			}
+	for (; i < len && in[i] < 0x80; i++) {
+		out[2 * i] = in[i];
+		out[2 * i + 1] = 0;
+	}
 
-			/* Second part: response block */
-			s_container = send_buf + count;
-			make_response(s_container, r_container, PIMA15740_RESP_OK, sizeof(*s_container));
+	return i;
+}
 
-			break;
-		case PIMA15740_OP_OPEN_SESSION:
-			CHECK_COUNT(count, 16, 16, "OPEN_SESSION");
+/* Narrow leading ASCII characters, returns how many were done */
+static size_t narrow_ascii(uint8_t *out, const uint8_t *in, size_t len)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i high = _mm_set1_epi16((short)0xff80);
+	const __m128i zero = _mm_setzero_si128();
 
-			ret = sizeof(*s_container);
-			param = (uint32_t *)r_container->payload;
-			p1 = __le32_to_cpu(*param);
-			if (verbose)
-				fprintf(stderr, "OpenSession %d\n", p1);
-			/* No multiple sessions. */
-			if (session > 0) {
-				/* already open */
-				code = PIMA15740_RESP_SESSION_ALREADY_OPEN;
-				*param = __cpu_to_le32(session);
-				ret += sizeof(*param);
-			} else if (!p1) {
-				code = PIMA15740_RESP_INVALID_PARAMETER;
-			} else {
-				code = PIMA15740_RESP_OK;
-				session = p1;
-			}
-			make_response(s_container, r_container, code, ret);
-			count = 0;
-			break;
-		case PIMA15740_OP_CLOSE_SESSION:
-			CHECK_COUNT(count, 12, 12, "CLOSE_SESSION");
+	for (; i + 8 <= len; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 2 * i));
 
-			if (session > 0) {
-				code = PIMA15740_RESP_OK;
-				session = -EINVAL;
-			} else {
-				code = PIMA15740_RESP_SESSION_NOT_OPEN;
-			}
-			make_response(s_container, r_container, code, sizeof(*s_container));
-			ret = 0;
-			count = 0;
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, high), zero)) != 0xffff)
 			break;
-		case PIMA15740_OP_GET_OBJECT_HANDLES:
-			CHECK_COUNT(count, 16, 24, "GET_OBJECT_HANDLES");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
-
-			ret = send_object_handles(recv_buf, send_buf, *send_size);
-			count = ret; /* even if ret is negative, handled below */
+		_mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(v, v));
+	}
+#elif defined(__ARM_NEON)
+	uint8x16x2_t v;
+	uint8x16_t bad;
+	uint8x8_t any;
+
+	for (; i + 16 <= len; i += 16) {
+		v = vld2q_u8(in + 2 * i);
+		bad = vorrq_u8(v.val[1], vshrq_n_u8(v.val[0], 7));
+		any = vorr_u8(vget_low_u8(bad), vget_high_u8(bad));
+		if (vget_lane_u64(vreinterpret_u64_u8(any), 0))
 			break;
-		case PIMA15740_OP_GET_OBJECT_INFO:
-			CHECK_COUNT(count, 16, 16, "GET_OBJECT_INFO");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+		vst1q_u8(out + i, v.val[0]);
+	}
+#endif
 
-			ret = send_object_info(recv_buf, send_buf, *send_size);
-			count = ret; /* even if ret is negative, handled below */
-			break;
-		case PIMA15740_OP_GET_STORAGE_IDS:
-			CHECK_COUNT(count, 12, 12, "GET_STORAGE_IDS");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+	for (; i < len && !in[2 * i + 1] && in[2 * i] < 0x80; i++)
+		out[i] = in[2 * i];
 
-			ret = send_storage_ids(recv_buf, send_buf, *send_size);
-			count = ret; /* even if ret is negative, handled below */
-			break;
-		case PIMA15740_OP_GET_STORAGE_INFO:
-			CHECK_COUNT(count, 16, 16, "GET_STORAGE_INFO");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+	return i;
+}
 
-			ret = send_storage_info(recv_buf, send_buf, *send_size);
-			count = ret; /* even if ret is negative, handled below */
+/* Decode one UTF-8 sequence, returns its length or 0, when it is invalid */
+static size_t utf8_decode(const uint8_t *in, size_t len, uint32_t *c)
+{
+	static const uint32_t min_code[] = { 0, 0, 0x80, 0x800, 0x10000 };
+	size_t n, i;
+
+	if (in[0] < 0xc2)
+		return 0;
+	n = in[0] < 0xe0 ? 2 : in[0] < 0xf0 ? 3 : in[0] < 0xf5 ? 4 : 0;
+	if (!n || n > len)
+		return 0;
+
+	*c = in[0] & (0x7f >> n);
+	for (i = 1; i < n; i++) {
+		if ((in[i] & 0xc0) != 0x80)
+			return 0;
+		*c = *c << 6 | (in[i] & 0x3f);
+	}
+
+	/* no overlong forms, surrogates or code points beyond Unicode */
+	if (*c < min_code[n] || (*c >= 0xd800 && *c < 0xe000) || *c > 0x10ffff)
+		return 0;
+
+	return n;
+}
+
+static void put_unit(uint8_t *out, uint32_t u)
+{
+	out[0] = u & 0xff;
+	out[1] = u >> 8;
+}
+
+/*
+ * UTF-8 to a UTF-16LE PTP string of at most size characters, including the
+ * trailing '\0'. Names that are no valid UTF-8 are taken as Latin-1, like
+ * they always were. Returns the number of characters, -1 if it is too long.
+ */
+static int put_string(char *buf, size_t size, const char *s)
+{
+	const uint8_t *in = (const uint8_t *)s;
+	uint8_t *out = (uint8_t *)buf;
+	size_t len = strlen(s), max = min(size, (size_t)PTP_STRING_MAX) - 1;
+	size_t i = 0, n = 0, seq;
+	uint32_t c;
+
+	while (i < len) {
+		seq = widen_ascii(out + 2 * n, in + i, min(len - i, max - n));
+		i += seq;
+		n += seq;
+		if (i == len)
 			break;
-		case PIMA15740_OP_GET_OBJECT:
-			CHECK_COUNT(count, 16, 16, "GET_OBJECT");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
 
-			ret = send_object_or_thumb(recv_buf, send_buf, *send_size, 0);
-			count = ret; /* even if ret is negative, handled below */
+		seq = utf8_decode(in + i, len - i, &c);
+		if (!seq)
+			goto latin1;
+		if (n + (c >= 0x10000 ? 2 : 1) > max)
+			goto too_long;
+
+		if (c >= 0x10000) {
+			c -= 0x10000;
+			put_unit(out + 2 * n++, 0xd800 | c >> 10);
+			put_unit(out + 2 * n++, 0xdc00 | (c & 0x3ff));
+		} else {
+			put_unit(out + 2 * n++, c);
+		}
+		i += seq;
+	}
+
+	put_unit(out + 2 * n, 0);
+	return n + 1;
+
+latin1:
+	if (len > max)
+		goto too_long;
+	for (n = 0; n <= len; n++)
+		put_unit(out + 2 * n, in[n]);
+	return n;
+
+too_long:
+	fprintf(stderr, "%s does not fit into %zu characters\n", s, max);
+	return -1;
+}
+
+/*
+ * A UTF-16LE PTP string of len characters, including the trailing '\0', to
+ * UTF-8 in buf of size bytes. Host supplied strings are checked, a missing
+ * terminator and unpaired surrogates are refused.
+ */
+static int get_string(char *buf, size_t size, const char *s, size_t len)
+{
+	const uint8_t *in = (const uint8_t *)s;
+	uint8_t *out = (uint8_t *)buf;
+	size_t i = 0, n = 0, seq;
+	uint32_t c, lo;
+
+	if (!len) {
+		buf[0] = '\0';
+		return 0;
+	}
+
+	if (in[2 * len - 2] || in[2 * len - 1]) {
+		fprintf(stderr, "string of %zu characters not terminated\n", len);
+		return -1;
+	}
+
+	/* the terminator goes the scalar way, size must be left for it */
+	while (i < len) {
+		seq = narrow_ascii(out + n, in + 2 * i, min(len - 1 - i, size - 1 - n));
+		i += seq;
+		n += seq;
+
+		c = in[2 * i] | in[2 * i + 1] << 8;
+		if (!c)
 			break;
-		case PIMA15740_OP_GET_NUM_OBJECTS:
-			CHECK_COUNT(count, 16, 24, "GET_NUM_OBJECTS");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
 
-			ret = 12;
-			param = (uint32_t *)r_container->payload;
-			p1 = __le32_to_cpu(*param);
-			p2 = __le32_to_cpu(*(param + 1));
-			p3 = __le32_to_cpu(*(param + 2));
-			if (p1 != PTP_PARAM_ANY && p1 != STORE_ID)
-				code = PIMA15740_RESP_INVALID_STORAGE_ID;
-			else if (count > 16 && p2 != PTP_PARAM_UNUSED && p2 != PTP_PARAM_ANY)
-				code = PIMA15740_RESP_SPECIFICATION_BY_FORMAT_NOT_SUPPORTED;
-			else if (count > 20 && p3 != PTP_PARAM_UNUSED) {
-				if (!object_handle_valid(p3))
-					code = PIMA15740_RESP_INVALID_OBJECT_HANDLE;
-				else if (p3 == PTP_PARAM_ANY) {
-					/* Content of directory */
-					code = PIMA15740_RESP_OK;
-					ret += sizeof(*param);
-					*param = __cpu_to_le32(g_slist_length(images));
-				} else
-					code = PIMA15740_RESP_INVALID_PARENT_OBJECT;
-			} else {
-				/* No parent Association specified or 0 */
-				code = PIMA15740_RESP_OK;
-				ret += sizeof(*param);
-				*param = __cpu_to_le32(g_slist_length(images));
+		if (c >= 0xd800 && c < 0xdc00 && i + 1 < len) {
+			lo = in[2 * i + 2] | in[2 * i + 3] << 8;
+			if (lo >= 0xdc00 && lo < 0xe000) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+				i++;
 			}
-			make_response(s_container, r_container, code, ret);
-			count = 0;
-			break;
-		case PIMA15740_OP_GET_THUMB:
-			CHECK_COUNT(count, 16, 16, "GET_THUMB");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+		}
+		if (c >= 0xd800 && c < 0xe000) {
+			fprintf(stderr, "unpaired surrogate 0x%04x\n", c);
+			return -1;
+		}
+
+		seq = c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+		if (n + seq >= size) {
+			fprintf(stderr, "string does not fit into %zu bytes\n", size);
+			return -1;
+		}
+
+		if (seq == 1) {
+			out[n++] = c;
+		} else {
+			out[n++] = (0xf00 >> seq) | c >> (6 * (seq - 1));
+			while (--seq)
+				out[n++] = 0x80 | ((c >> (6 * (seq - 1))) & 0x3f);
+		}
+		i++;
+	}
+
+	out[n] = '\0';
+	return 0;
+}
+
+static int enum_objects(struct storage *store, struct obj_list *parent, int notify);
+
+/*
+ * Image headers are read once when an object is added, no more than
+ * PROBE_SIZE bytes from the start of the file, plus a few bytes for every
+ * JPEG marker segment beyond until the frame header is found. Only EXIF
+ * segments are read in full. Of a TIFF file the entries of IFD0 and the EXIF
+ * IFD are read where they are, up to TIFF_MAX_ENTRIES each.
+ */
+#define PROBE_SIZE	4096
+#define PROBE_MAX_SEGMENTS	64
+
+static uint32_t exif_get(const uint8_t *p, int size, int big)
+{
+	if (size == 2)
+		return big ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+
+	return big ? (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3] :
+		(uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+static int jpeg_is_sof(uint8_t marker)
+{
+	return marker >= 0xc0 && marker <= 0xcf &&
+		marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+}
+
+/* Dimensions from the first SOF marker of a JPEG image in memory */
+static int jpeg_size(const uint8_t *p, size_t len, uint32_t *width, uint32_t *height)
+{
+	size_t pos = 2;
+
+	while (pos + 9 <= len && p[pos] == 0xff) {
+		if (jpeg_is_sof(p[pos + 1])) {
+			*height = p[pos + 5] << 8 | p[pos + 6];
+			*width = p[pos + 7] << 8 | p[pos + 8];
+			return *width && *height ? 0 : -1;
+		}
+		pos += 2 + (p[pos + 2] << 8 | p[pos + 3]);
+	}
+
+	return -1;
+}
+
+/* One IFD entry, the first value of it for SHORT and LONG types */
+struct tiff_tag {
+	uint32_t	tag;
+	uint32_t	type;
+	uint32_t	count;
+	uint32_t	value;		/* or the offset of the values */
+};
+
+static void tiff_tag(const uint8_t *e, int big, struct tiff_tag *t)
+{
+	t->tag = exif_get(e, 2, big);
+	t->type = exif_get(e + 2, 2, big);
+	t->count = exif_get(e + 4, 4, big);
+	if (t->type == 3)
+		t->value = exif_get(e + 8, 2, big);
+	else
+		t->value = exif_get(e + 8, 4, big);
+}
+
+/*
+ * Where tiff_probe() finds a TIFF structure. EXIF data is read in full, a
+ * TIFF file has its IFDs anywhere, what is beyond the bytes read for the
+ * probe is read from the file as needed.
+ */
+struct tiff_src {
+	const uint8_t	*buf;		/* the first len bytes */
+	size_t		len;
+	uint32_t	size;		/* of the whole structure */
+	int		fd;		/* the rest, -1 if there is none */
+	uint32_t	base;		/* where it starts in the file */
+	int		big;
+};
+
+/* No more are read from an IFD, the tags looked for are among the first */
+#define TIFF_MAX_ENTRIES	256
+
+static int tiff_read(const struct tiff_src *src, uint32_t off, void *p, size_t n)
+{
+	if (off > src->size || n > src->size - off)
+		return -1;
+	if (off + n <= src->len) {
+		memcpy(p, src->buf + off, n);
+		return 0;
+	}
+	if (src->fd < 0)
+		return -1;
+
+	return pread(src->fd, p, n, (off_t)src->base + off) == (ssize_t)n ? 0 : -1;
+}
+
+/*
+ * Read the entries of the IFD at ifd into e, returns their number, 0 if the
+ * IFD can't be read. next is set to the offset of the following IFD.
+ */
+static uint32_t tiff_ifd(const struct tiff_src *src, uint32_t ifd, uint8_t *e,
+			 uint32_t *next)
+{
+	uint8_t b[4];
+	uint32_t n;
+
+	if (ifd < 8 || tiff_read(src, ifd, b, 2) < 0)
+		return 0;
+	n = exif_get(b, 2, src->big);
+
+	/* the offset of the next IFD follows all of the entries */
+	if (next)
+		*next = tiff_read(src, ifd + 2 + n * 12, b, 4) < 0 ? 0 :
+			exif_get(b, 4, src->big);
+
+	if (n > TIFF_MAX_ENTRIES)
+		n = TIFF_MAX_ENTRIES;
+
+	return tiff_read(src, ifd + 2, e, n * 12) < 0 ? 0 : n;
+}
+
+/* "YYYY:MM:DD HH:MM:SS" to the PTP form, local time like the camera's clock */
+static void tiff_date(const struct tiff_src *src, struct tiff_tag *t, char *date)
+{
+	char d[20];
+	int i;
+
+	if (t->type != 2 || t->count < 20 || tiff_read(src, t->value, d, sizeof(d)) < 0 ||
+	    d[4] != ':' || d[7] != ':' || d[10] != ' ' || !memcmp(d, "0000", 4))
+		return;
+	for (i = 0; i < 19; i++)
+		if (i != 4 && i != 7 && i != 10 && i != 13 && i != 16 &&
+		    (d[i] < '0' || d[i] > '9'))
+			return;
+
+	snprintf(date, 16, "%.4s%.2s%.2sT%.2s%.2s%.2s",
+		 d, d + 5, d + 8, d + 11, d + 14, d + 17);
+}
+
+/*
+ * Parse a TIFF structure, a TIFF file or the EXIF data of a JPEG image.
+ * Thumbnails are only looked for in EXIF data, dimensions only in TIFF
+ * files.
+ */
+static void tiff_probe(struct tiff_src *src, int exif, struct image_probe *ip)
+{
+	uint32_t ifd, next = 0, exif_ifd = 0, bits = 0, samples = 1, thumb = 0, length = 0;
+	uint32_t n, i;
+	uint8_t *e, b[4];
+	const uint8_t *tiff = src->buf;
+	char date[16] = "";
+	struct tiff_tag t;
+	int big;
+
+	if (src->len < 8)
+		return;
+	if (!memcmp(tiff, "MM\0*", 4))
+		big = 1;
+	else if (!memcmp(tiff, "II*\0", 4))
+		big = 0;
+	else
+		return;
+	src->big = big;
 
-			ret = send_object_or_thumb(recv_buf, send_buf, *send_size, 1);
-			count = ret; /* even if ret is negative, handled below */
-			break;
-		case PIMA15740_OP_DELETE_OBJECT:
-			CHECK_COUNT(count, 16, 20, "DELETE_OBJECT");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
+	e = malloc(TIFF_MAX_ENTRIES * 12);
+	if (!e)
+		return;
 
-			delete_object(recv_buf, send_buf);
-			count = 0;
-			ret = 0;
+	ifd = exif_get(tiff + 4, 4, big);
+	n = tiff_ifd(src, ifd, e, &next);
+	for (i = 0; i < n; i++) {
+		tiff_tag(e + i * 12, big, &t);
+		switch (t.tag) {
+		case 0x0100:
+			if (!exif)
+				ip->width = t.value;
 			break;
-		case PIMA15740_OP_SEND_OBJECT_INFO:
-			CHECK_COUNT(count, 12, 20, "SEND_OBJECT_INFO");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
-
-			process_send_object_info(recv_buf, send_buf);
-			count = 0;
-			ret = 0;
+		case 0x0101:
+			if (!exif)
+				ip->height = t.value;
 			break;
-		case PIMA15740_OP_SEND_OBJECT:
-			CHECK_COUNT(count, 12, 12, "SEND_OBJECT");
-			CHECK_SESSION(s_container, r_container, &count, &ret);
-
-			ret = process_send_object(recv_buf, send_buf);
-			count = 0;
+		case 0x0102:
+			/* one per sample, they are all the same */
+			if (t.count * 2 > 4)
+				bits = tiff_read(src, t.value, b, 2) < 0 ? 0 : exif_get(b, 2, big);
+			else
+				bits = t.value;
+			break;
+		case 0x0115:
+			samples = t.value;
+			break;
+		case 0x0132:
+			tiff_date(src, &t, date);
+			break;
+		case 0x8769:
+			exif_ifd = t.value;
+			break;
+		case 0x9216:
+			/* TIFF/EPStandardID */
+			if (!exif)
+				ip->format = PIMA15740_FMT_I_TIFF_EP;
 			break;
 		}
-		break;
+	}
+	if (!exif) {
+		ip->depth = bits * samples;
+		if (ip->format != PIMA15740_FMT_I_TIFF_EP)
+			ip->format = PIMA15740_FMT_I_TIFF;
 	}
 
-	sem_post(&dbaccess);
+	/* IFD1 follows IFD0 and holds the thumbnail, EXIF data is in memory */
+	if (n && exif) {
+		n = tiff_ifd(src, next, e, NULL);
+		for (i = 0; i < n; i++) {
+			tiff_tag(e + i * 12, big, &t);
+			if (t.tag == 0x0201)
+				thumb = t.value;
+			else if (t.tag == 0x0202)
+				length = t.value;
+		}
 
-	if (ret < 0) {
-		if (errno == EPIPE)
-			return -1;
+		if (thumb && length >= 4 && thumb <= src->len && length <= src->len - thumb &&
+		    tiff[thumb] == 0xff && tiff[thumb + 1] == 0xd8 &&
+		    !jpeg_size(tiff + thumb, length, &ip->thumb.width, &ip->thumb.height)) {
+			ip->thumb.offset = src->base + thumb;
+			ip->thumb.length = length;
+		}
+	}
 
-		if (verbose)
-			fprintf(stderr, "Unsupported type %lu code 0x%lx\n", type, code);
-		errno = EOPNOTSUPP;
-		make_response(s_container, r_container,
-			      PIMA15740_RESP_OPERATION_NOT_SUPPORTED, sizeof(*s_container));
-		count = 0;
+	/* the time the picture was taken, rather than that of the last edit */
+	n = tiff_ifd(src, exif_ifd, e, NULL);
+	for (i = 0; i < n; i++) {
+		tiff_tag(e + i * 12, big, &t);
+		if (t.tag == 0x9003)
+			tiff_date(src, &t, date);
 	}
 
-	/* send out response at send_buf + count */
-	s_container = send_buf + count;
-	length = __le32_to_cpu(s_container->length);
-	return bulk_write(s_container, length);
+	memcpy(ip->date, date, sizeof(date));
+	free(e);
 }
 
-static void cleanup_endpoint(int ep_fd, char *ep_name)
+static void png_probe(const uint8_t *p, size_t len, struct image_probe *ip)
 {
-	int ret;
+	static const uint8_t channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
 
-	if(ep_fd < 0)
+	/* IHDR always comes first */
+	if (len < 8 + 8 + 13 || memcmp(p + 12, "IHDR", 4) || p[25] > 6)
 		return;
 
-	ret = ioctl(ep_fd, FUNCTIONFS_FIFO_STATUS);
-	if(ret < 0)
-	{
-		//ENODEV reported after disconnect
-		if(errno != ENODEV)
-			fprintf(stderr, "%s, %s: get fifo status(%s): %s \n", __FILE__, __FUNCTION__, ep_name, strerror(errno));
+	ip->width = exif_get(p + 16, 4, 1);
+	ip->height = exif_get(p + 20, 4, 1);
+	ip->depth = p[24] * channels[p[25]];
+}
+
+static void jpeg_probe(int fd, const uint8_t *buf, size_t len, struct image_probe *ip)
+{
+	struct tiff_src src = { .fd = -1 };
+	uint8_t head[10], *seg;
+	size_t pos = 2, seglen;
+	int i;
+
+	/* JFIF unless there is EXIF data, which is also what a bare JPEG is */
+	ip->format = PIMA15740_FMT_I_EXIF_JPEG;
+
+	for (i = 0; i < PROBE_MAX_SEGMENTS; i++) {
+		if (pos + sizeof(head) <= len)
+			memcpy(head, buf + pos, sizeof(head));
+		else if (pread(fd, head, sizeof(head), pos) != sizeof(head))
+			return;
+
+		if (head[0] != 0xff)
+			return;
+		if (head[1] == 0xff) {
+			/* fill byte */
+			pos++;
+			continue;
+		}
+		if (head[1] == 0xd9 || head[1] == 0xda)
+			return;
+
+		if (jpeg_is_sof(head[1])) {
+			ip->height = head[5] << 8 | head[6];
+			ip->width = head[7] << 8 | head[8];
+			ip->depth = head[4] * head[9];
+			return;
+		}
+
+		seglen = head[2] << 8 | head[3];
+		if (seglen < 2)
+			return;
+
+		if (head[1] == 0xe0 && !memcmp(head + 4, "JFIF\0", 5) && i == 0)
+			ip->format = PIMA15740_FMT_I_JFIF;
+
+		/* EXIF data is read in full, up to 64 KiB */
+		if (head[1] == 0xe1 && seglen >= 2 + 6 + 8 && !memcmp(head + 4, "Exif\0\0", 6)) {
+			ip->format = PIMA15740_FMT_I_EXIF_JPEG;
+			src.len = src.size = seglen - 8;
+			src.base = pos + 10;
+			if (pos + 2 + seglen <= len) {
+				src.buf = buf + pos + 10;
+				tiff_probe(&src, 1, ip);
+			} else {
+				seg = malloc(seglen - 8);
+				src.buf = seg;
+				if (seg && pread(fd, seg, seglen - 8, pos + 10) == (ssize_t)(seglen - 8))
+					tiff_probe(&src, 1, ip);
+				free(seg);
+			}
+		}
+
+		pos += 2 + seglen;
 	}
-	else if(ret)
-	{
-		if (verbose)
-			fprintf(stderr, "%s, %s: %s: unclaimed = %d \n", __FILE__, __FUNCTION__, ep_name, ret);
-		if(ioctl(ep_fd, FUNCTIONFS_FIFO_FLUSH) < 0)
-			fprintf(stderr, "%s, %s: %s: fifo flush \n", __FILE__, __FUNCTION__, ep_name);
+}
+
+/* Text has no control characters other than white space, any encoding */
+static int is_text(const uint8_t *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if ((p[i] < 0x20 && (!p[i] || !strchr("\t\n\r\f", p[i]))) || p[i] == 0x7f)
+			return 0;
+
+	return 1;
+}
+
+/* The format is told by the first bytes of the file, as read for the probe */
+static void probe_fd(int fd, struct image_probe *ip)
+{
+	struct tiff_src src;
+	uint8_t *buf;
+	ssize_t len;
+
+	memset(ip, 0, sizeof(*ip));
+	ip->format = PIMA15740_FMT_A_UNDEFINED;
+
+	buf = malloc(PROBE_SIZE);
+	len = buf ? pread(fd, buf, PROBE_SIZE, 0) : -1;
+
+	if (len >= 8 && !memcmp(buf, "\x89PNG\r\n\x1a\n", 8)) {
+		ip->format = PIMA15740_FMT_I_PNG;
+		png_probe(buf, len, ip);
+	} else if (len >= 3 && buf[0] == 0xff && buf[1] == 0xd8 && buf[2] == 0xff) {
+		jpeg_probe(fd, buf, len, ip);
+	} else if (len >= 8 && (!memcmp(buf, "II*\0", 4) || !memcmp(buf, "MM\0*", 4))) {
+		/* the file ends where pread() says so */
+		src = (struct tiff_src){ .buf = buf, .len = len, .size = UINT32_MAX, .fd = fd };
+		tiff_probe(&src, 0, ip);
+	} else if (len > 0 && is_text(buf, len)) {
+		ip->format = PIMA15740_FMT_A_TEXT;
 	}
 
-	if(close(ep_fd) < 0)
-		fprintf(stderr, "%s, %s: %s: close \n", __FILE__, __FUNCTION__, ep_name);
+	free(buf);
 }
 
-/*
- * communication thread cleanup actions
- */
-static void cleanup_bulk_thread(void *arg)
+static void probe_image(int dirfd, const char *name, struct image_probe *ip)
 {
-	(void) arg;
+	int fd;
 
-	cleanup_endpoint(bulk_out, "out");
-	cleanup_endpoint(bulk_in, "in");
-	cleanup_endpoint(interrupt, "interrupt");
+	fd = openat(dirfd, name, O_RDONLY);
+	if (fd < 0) {
+		memset(ip, 0, sizeof(*ip));
+		ip->format = PIMA15740_FMT_A_UNDEFINED;
+		return;
+	}
+
+	probe_fd(fd, ip);
+	close(fd);
 }
 
-static void *bulk_thread(void *param)
+/* stat() and probe a file for add_object(), without the storage lock */
+static int probe_entry(int dirfd, const char *name, struct scan_entry *e)
 {
-	void *recv_buf, *send_buf;
-	int ret;
-	size_t s_size = BUF_SIZE, r_size = BUF_SIZE;
-	(void) param;
+	memset(&e->ip, 0, sizeof(e->ip));
+	if (stat_file(dirfd, name, 0, &e->st, &e->key) < 0)
+		return -1;
 
-	pthread_cleanup_push(cleanup_bulk_thread, NULL);
+	/* so that hosts need not download an image to lay it out */
+	if (S_ISREG(e->st.st_mode) && e->st.st_size)
+		probe_image(dirfd, name, &e->ip);
 
-	recv_buf = malloc(BUF_SIZE);
-	send_buf = malloc(BUF_SIZE);
-	if (!recv_buf || !send_buf) {
-		if (verbose)
-			fprintf(stderr, "No memory!\n");
-		goto done;
-	}
+	return 0;
+}
 
-	do {
-		ret = process_one_request(recv_buf, &r_size, send_buf, &s_size);
-		if (ret < 0 && errno == EPIPE) {
-			/* TODO: Have to stall and wait to be unstalled / exit
-			 * thread to be restarted */
-			fprintf(stderr, "Protocol error!\n");
+/*
+ * Add a file or directory to the catalog, as found by probe_entry().
+ * Directories become associations, get a watch of their own and are scanned
+ * recursively. Returns the new handle, 0 if the entry was skipped or a
+ * negative value on error. With notify set an ObjectAdded event is sent for
+ * every new object, the contents of a directory are left to a rescan then.
+ */
+static int add_object(struct storage *store, struct obj_list *parent,
+		      const char *filename, const struct scan_entry *e, int notify) {
+	const struct stat *st = &e->st;
+	size_t namelen, datelen, osize;
+	enum pima15740_data_format format, thumb_format;
+	const char *dot;
+	struct tm mod_tm;
+	int thumb_size = 0, thumb_width, thumb_height;
+	uint32_t thumb_offset = 0;
+	const struct image_probe *ip = &e->ip;
+	char mod[32], mod_ucs2[64], fname_ucs2[512];
+	char path[PATH_MAX];
+	int ret, is_dir;
+	struct obj_list *obj;
+
+	dot = strrchr(filename, '.');
+
+	if (dot == filename || !strncmp(filename, "..", 2))
+		return 0;
+
+	if (get_child_path(parent, filename, path, sizeof(path)) < 0)
+		return 0;
+
+	is_dir = S_ISDIR(st->st_mode);
+	if (!is_dir && !S_ISREG(st->st_mode))
+		return 0;
+
+	format = is_dir ? PIMA15740_FMT_A_ASSOCIATION : PIMA15740_FMT_A_UNDEFINED;
+
+#ifdef FORMAT_SUPPORT
+	if (!is_dir && st->st_size) {
+		format = ip->format;
+	} else if (!is_dir && dot && strlen(dot) >= 3) {
+		/* nothing written yet, the content is sniffed once it changes */
+		switch (dot[1]) {
+		case 't':
+		case 'T':
+			if (dot[2] == 'x' || dot[2] == 'X')
+				format = PIMA15740_FMT_A_TEXT;
+			else
+				format = PIMA15740_FMT_I_TIFF;
+			break;
+		case 'j':
+		case 'J':
+			format = PIMA15740_FMT_I_EXIF_JPEG;
 			break;
+		default:
+			format = PIMA15740_FMT_A_UNDEFINED;
 		}
+	}
+#endif
 
-		pthread_testcancel();
-	} while (ret >= 0);
+	/* names, that cannot be PTP strings, are left out */
+	ret = put_string(fname_ucs2, sizeof(fname_ucs2) / 2, filename);
+	if (ret < 0)
+		return 0;
+	namelen = ret;
 
-	pthread_cleanup_pop(1);
-done:
-	free(recv_buf);
-	free(send_buf);
-	pthread_exit(NULL);
-}
+	if (ip->date[0]) {
+		snprintf(mod, sizeof(mod), "%s", ip->date);
+	} else {
+		gmtime_r(&st->st_mtime, &mod_tm);
+		snprintf(mod, sizeof(mod), "%04u%02u%02uT%02u%02u%02u.0Z", mod_tm.tm_year
+				+ 1900, mod_tm.tm_mon + 1, mod_tm.tm_mday, mod_tm.tm_hour,
+				mod_tm.tm_min, mod_tm.tm_sec);
+	}
 
-static int add_object(char *filename);
+	/* String length including the trailing '\0' */
+	ret = put_string(mod_ucs2, sizeof(mod_ucs2) / 2, mod);
+	if (ret < 0) {
+		mod[0] = '\0';
+		ret = 0;
+	}
+	datelen = ret;
 
-/*
- * Since functionfs unfortunately neither support select/poll operations nor nonblocking i/o
- * we need to split end point handling and inotify processing into separate threads.
- * Nevertheless sometime it's important to ensure a specific processing order.
- * Calling this helper will ensure that all inotify events, existing at this moment, will be processed before continuing.
- */
-static void inotify_sync() {
-	int ret;
-	fd_set fds;
-	struct timeval timeout;
 
-	do {
-		FD_ZERO(&fds);
-		FD_SET(notify_fd, &fds);
+	/* namelen and datelen include terminating '\0', plus 4 string-size bytes */
+	osize = sizeof(*obj) + 2 * (datelen + namelen) + 4;
 
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 0;
-		ret = select(notify_fd + 1, &fds, NULL, NULL, &timeout);
-	} while (ret > 0 && FD_ISSET(notify_fd, &fds));
-}
+	if (verbose)
+		fprintf(stderr, "Listing image %s, modified %s, info-size %u\n",
+				path, mod, (unsigned int) osize);
 
-#define INOTIFY_EVENT_SIZE  ( sizeof(struct inotify_event) )
-#define INOTIFY_EVENT_BUF   ( INOTIFY_EVENT_SIZE + NAME_MAX + 1 )
+	obj = malloc(osize);
+	if (!obj) {
+		return -1;
+	}
 
-static void *inotify_thread(void *param) {
-	char buffer[16 * INOTIFY_EVENT_BUF];
-	int i, length;
-	(void) param;
+#ifdef THUMB_SUPPORT
+	if (format == PIMA15740_FMT_A_TEXT ||
+			format == PIMA15740_FMT_A_UNDEFINED ||
+			format == PIMA15740_FMT_A_ASSOCIATION) {
+		thumb_format = PIMA15740_FMT_A_UNDEFINED;
+		thumb_width = 0;
+		thumb_height = 0;
+		thumb_size = 0;
+	} else if (ip->thumb.offset) {
+		thumb_format = PIMA15740_FMT_I_JFIF;
+		thumb_width = ip->thumb.width;
+		thumb_height = ip->thumb.height;
+		thumb_size = ip->thumb.length;
+		thumb_offset = ip->thumb.offset;
+	} else {
+		/* a missing or outdated one is made in the background */
+		thumb_format = PIMA15740_FMT_I_JFIF;
+		thumb_width = THUMB_WIDTH;
+		thumb_height = THUMB_HEIGHT;
+		thumb_size = thumb_ready(store, path);
+		if (thumb_size < 0)
+			thumb_size = 0;
+	}
+#else
+	thumb_format = PIMA15740_FMT_A_UNDEFINED;
+	thumb_width = 0;
+	thumb_height = 0;
+	thumb_size = 0;
+#endif
 
-	do {
-		length = read(notify_fd, buffer, sizeof(buffer));
+	obj->store = store;
+	obj->key = e->key;
+	obj->mtime = st->st_mtime;
+	obj->handle = assign_handle(store, &e->key);
+	obj->parent = parent;
+	obj->wd = -1;
+	obj->fh = NULL;
+	obj->thumb_offset = thumb_offset;
 
-		if (length < 0)
-			fprintf(stderr, "inotify read: %s\n", strerror(errno));
+	/* Fixed size object info, filename, capture date, and two empty strings */
+	obj->info_size = sizeof(obj->info) + 2 * (datelen + namelen) + 4;
 
-		i = 0;
-		/* actually read return the list of change events happens. Here, read the change event one by one and process it accordingly. */
-		while (i < length) {
-			struct inotify_event *event = (struct inotify_event *) &buffer[i];
-			if (event->len) {
-				char lock_file[1024];
-				struct stat lockstat;
-
-				/* ignore events for files when a related lock file exists */
-				get_lock_filename (lock_file, sizeof(lock_file), event->name);
-				if(stat(lock_file, &lockstat) == 0) {
-					i += INOTIFY_EVENT_SIZE + event->len;
-					continue;
-				}
+	if(verbose)
+		fprintf(stderr, "adding %s with size %d\n", path, (int) st->st_size);
+
+	obj->info.storage_id = __cpu_to_le32(store->id);
+	obj->info.object_format = __cpu_to_le16(format);
+	obj->info.protection_status
+			= __cpu_to_le16(st->st_mode & S_IWUSR ? 0 : 1);
+	obj->info.object_compressed_size = __cpu_to_le32(is_dir ? 0 : st->st_size);
+	obj->info.thumb_format = __cpu_to_le16(thumb_format);
+	obj->info.thumb_compressed_size = __cpu_to_le32(thumb_size);
+	obj->info.thumb_pix_width = __cpu_to_le32(thumb_width);
+	obj->info.thumb_pix_height = __cpu_to_le32(thumb_height);
+	obj->info.image_pix_width = __cpu_to_le32(ip->width);
+	obj->info.image_pix_height = __cpu_to_le32(ip->height);
+	obj->info.image_bit_depth = __cpu_to_le32(ip->depth);
+	obj->info.parent_object = __cpu_to_le32(parent_handle(obj));
+	obj->info.association_type = __cpu_to_le16(is_dir ? PIMA15740_AT_GENERIC_FOLDER :
+						  PIMA15740_AT_UNDEFINED);
+	obj->info.association_desc = __cpu_to_le32(0);
+	obj->info.sequence_number = __cpu_to_le32(0);
+	strncpy(obj->name, filename, sizeof(obj->name));
+
+	obj->info.strings[0] = namelen;
+	memcpy(obj->info.strings + 1, fname_ucs2, namelen * 2);
+	/* DateTimeOriginal or the file modification date as Capture Date */
+	obj->info.strings[1 + namelen * 2] = datelen;
+	memcpy(obj->info.strings + 2 + namelen * 2, mod_ucs2, datelen * 2);
+	/* Empty Modification Date */
+	obj->info.strings[2 + (namelen + datelen) * 2] = 0;
+	/* Empty Keywords */
+	obj->info.strings[3 + (namelen + datelen) * 2] = 0;
+
+	catalog_insert(obj);
+	handle_map_check(store);
+
+	if (notify)
+		send_event(PIMA15740_EVENT_OBJECT_ADDED, obj->handle);
+
+	if (is_dir) {
+		/*
+		 * Watch before scanning, so that nothing created in between
+		 * gets lost. Duplicates are filtered by the event handler.
+		 */
+		watch_directory(store, obj, path);
+		if (notify)
+			g_queue_push_tail(&store->rescan, GUINT_TO_POINTER(obj->handle));
+		else
+			enum_objects(store, obj, notify);
+	}
+
+	return obj->handle;
+}
+
+static int enum_objects(struct storage *store, struct obj_list *parent, int notify) {
+	char path[PATH_MAX];
+	DIR *d;
+	struct dirent *dentry;
+	struct scan_entry entry;
+	int ret = 0;
+
+	if (parent) {
+		snprintf(path, sizeof(path), "%s/", store->root);
+		ret = get_object_path(parent, path + strlen(path),
+				      sizeof(path) - strlen(path));
+		if (ret < 0)
+			return ret;
+	} else {
+		snprintf(path, sizeof(path), "%s", store->root);
+	}
 
-				sem_wait(&dbaccess);
-				if (event->mask & IN_CLOSE_WRITE) {
-					struct obj_list *obj = NULL;
-					GSList *iterator;
-
-					if (verbose)
-						fprintf(stderr, "inotify: file %s closed\n", event->name);
-
-					/* test if file is already in database */
-					GFOREACH(obj, images) {
-						if (strcmp(obj->name, event->name) == 0)
-							break;
-					}
-
-					if (obj) {
-						if (verbose)
-							fprintf(stderr, "inotify: closed file %s already in database, delete it first\n", event->name);
-						delete_thumb(obj);
-						images = g_slist_remove(images, obj);
-						update_free_space();
-						send_event(PIMA15740_EVENT_OBJECT_REMOVED, obj->handle);
-						free(obj);
-					}
-
-					update_free_space();
-
-					if (add_object(event->name) >= 0) {
-						if (verbose)
-							fprintf(stderr, "inotify: added file %s\n", event->name);
-						send_event(PIMA15740_EVENT_OBJECT_ADDED, last_object_number);
-					}
-
-				} else if (event->mask & IN_DELETE) {
-					struct obj_list *obj = NULL;
-					GSList *iterator;
-
-					if (verbose)
-						fprintf(stderr, "inotify: file %s deleted\n", event->name);
-
-					GFOREACH(obj, images) {
-						if (strcmp(obj->name, event->name) == 0)
-							break;
-					}
-
-					if (obj) {
-						if (verbose)
-							fprintf(stderr, "inotify: deleting file %s\n", obj->name);
-						delete_thumb(obj);
-						images = g_slist_remove(images, obj);
-						update_free_space();
-						send_event(PIMA15740_EVENT_OBJECT_REMOVED, obj->handle);
-						free(obj);
-					} else
-						update_free_space();
+	d = opendir(path);
+	if (!d)
+		return -1;
 
-				}
-				sem_post(&dbaccess);
-			}
-			i += INOTIFY_EVENT_SIZE + event->len;
-		}
+	while ((dentry = readdir(d))) {
+		/* skipped by add_object() anyway, not worth a probe */
+		if (dentry->d_name[0] == '.' ||
+		    probe_entry(dirfd(d), dentry->d_name, &entry) < 0)
+			continue;
 
-		pthread_testcancel();
-	} while (length >= 0);
+		ret = add_object(store, parent, dentry->d_name, &entry, notify);
+		if (ret < 0)
+			break;
+	}
 
-	pthread_exit(NULL);
+	closedir(d);
+	return ret < 0 ? ret : 0;
 }
 
-static int start_io(void)
+static void init_strings(void)
 {
-	int ret;
+	put_string((char *)dev_info.manuf, sizeof(manuf), manuf);
+	put_string((char *)dev_info.model, sizeof(model), model);
+}
 
-	if (verbose)
-		fprintf(stderr, "Start bulk EPs\n");
+/* Removable storages are only there, while something is mounted on them */
+static int storage_mounted(const struct storage *store)
+{
+	char parent[PATH_MAX];
+	struct stat st, pst;
 
-	if (bulk_in >= 0 && bulk_out >= 0)
+	if (!store->removable)
+		return 1;
+
+	snprintf(parent, sizeof(parent), "%s/..", store->root);
+	if (stat(store->root, &st) < 0 || stat(parent, &pst) < 0)
 		return 0;
 
-	bulk_in = open(FFS_PTP_IN, O_RDWR);
-	if (bulk_in < 0)
-		return bulk_in;
+	return st.st_dev != pst.st_dev || st.st_ino == pst.st_ino;
+}
 
-	bulk_out = open(FFS_PTP_OUT, O_RDWR);
-	if (bulk_out < 0)
-		return bulk_out;
+static void storage_attach(struct storage *store, int notify)
+{
+	lock_storage(store);
 
-	interrupt = open(FFS_PTP_INT, O_RDWR);
-	if (interrupt < 0)
-		return interrupt;
+	if (store->available || !storage_mounted(store)) {
+		unlock_storage(store);
+		return;
+	}
 
-	status = PTP_IDLE;
+	/* Uploads the last run cut off must not make it into the catalog */
+	journal_resolve(store);
 
-	ret = pthread_create(&bulk_pthread, NULL, bulk_thread, NULL);
-	if (ret < 0) {
-		perror ("can't create bulk thread");
-		return ret;
-	}
+	/* Subdirectories get watched while being enumerated */
+	watch_directory(store, NULL, NULL);
+	if (store->root_wd < 0 && !store->root_fh)
+		fprintf(stderr, "Cannot watch %s\n", store->root);
 
-	return 0;
-}
+	enum_objects(store, NULL, 0);
 
-static void stop_io(void)
-{
-	fprintf(stderr, "Stop bulk EPs\n");
+	/* Start the map afresh with what is there, this also drops torn records */
+	handle_map_compact(store);
 
-	if (bulk_in < 0 || bulk_out < 0)
-		return;
+	/*
+	 * if a client doesn't ask for storage info (as seen with some
+	 * older SW versions, e.g. on Ubuntu 8.04), then the free space
+	 * of the storage will not be updated. This might result in non
+	 * working upload because before upload the free space will be
+	 * checked. Prevent this by running update_free_space() early.
+	 */
+	update_free_space(store);
+	store->available = 1;
 
-	pthread_cancel(bulk_pthread);
-	pthread_join(bulk_pthread, NULL);
+	unlock_storage(store);
 
-	status = PTP_WAITCONFIG;
+	if (verbose)
+		fprintf(stderr, "storage 0x%08x at %s attached\n", store->id, store->root);
 
-	close(bulk_out);
-	bulk_out = -EINVAL;
-	close(bulk_in);
-	bulk_in = -EINVAL;
-	close(interrupt);
-	interrupt = -EINVAL;
+	if (notify)
+		send_event(PIMA15740_EVENT_STORE_ADDED, store->id);
 }
 
-static void init_device(void)
+static void storage_detach(struct storage *store, int notify)
 {
-	int		ret;
+	GQueue *children;
 
-	control = open(FFS_PTP_EP0, O_RDWR);
-	if (control < 0) {
-		perror(FFS_PTP_EP0);
-		control = -errno;
-		return;
-	}
+	lock_storage(store);
 
-	ret = write(control, &descriptors, sizeof(descriptors));
-	if (ret < 0) {
-		perror("write dev descriptors");
-		close(control);
-		control = -errno;
-		return;
-	}
-	ret = write(control, &strings, sizeof(strings));
-	if (ret < 0) {
-		perror("write dev strings");
-		close(control);
-		control = -errno;
+	if (!store->available) {
+		unlock_storage(store);
 		return;
 	}
 
-	return;
-}
+	/* The host forgets about all objects of a removed storage by itself */
+	while ((children = child_list(store, 0)) && children->head)
+		remove_object(children->head->data, 0);
 
-/*-------------------------------------------------------------------------*/
+	unwatch_directory(store, NULL);
+	g_queue_clear(&store->rescan);
+	store->available = 0;
 
-static int reset_interface(void)
-{
-	/* just reset toggle/halt for the interface's endpoints */
-	int err;
+	unlock_storage(store);
 
-	if (status == PTP_WAITCONFIG)
-		return 0;
+	if (verbose)
+		fprintf(stderr, "storage 0x%08x at %s detached\n", store->id, store->root);
 
-	sem_init(&reset, 0, 0);
+	if (notify)
+		send_event(PIMA15740_EVENT_STORE_REMOVED, store->id);
+}
 
-	pthread_kill(bulk_pthread, SIGINT);
+/*
+ * /proc/self/mountinfo signals POLLPRI whenever the mount table changes,
+ * then every removable storage is checked again.
+ */
+static void *mount_thread(void *param)
+{
+	struct pollfd pfd;
+	char buf[4096];
+	int i;
+	(void) param;
 
-	err = ioctl(bulk_in, FUNCTIONFS_CLEAR_HALT);
-	if (err < 0)
-		perror("reset source fd");
+	pfd.fd = open("/proc/self/mountinfo", O_RDONLY);
+	if (pfd.fd < 0) {
+		perror("can't open /proc/self/mountinfo");
+		pthread_exit(NULL);
+	}
+	pfd.events = POLLPRI;
 
-	err = ioctl(bulk_out, FUNCTIONFS_CLEAR_HALT);
-	if (err < 0)
-		perror("reset sink fd");
+	for (;;) {
+		/* The change is only acknowledged by reading the table */
+		lseek(pfd.fd, 0, SEEK_SET);
+		while (read(pfd.fd, buf, sizeof(buf)) > 0)
+			;
 
-	sem_post(&reset);
+		for (i = 0; i < num_storages; i++) {
+			if (!storages[i].removable)
+				continue;
 
-	/* FIXME eventually reset the status endpoint too */
+			if (storage_mounted(&storages[i]))
+				storage_attach(&storages[i], 1);
+			else
+				storage_detach(&storages[i], 1);
+		}
 
-	/* Always return "success"... */
-	return 0;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			perror("mountinfo poll");
+			break;
+		}
+	}
+
+	close(pfd.fd);
+	pthread_exit(NULL);
 }
 
-static void handle_control(struct usb_ctrlrequest *setup)
+static struct storage *init_storage(const char *path, int removable)
 {
-	int		err;
-	uint8_t		buf[256];
-	uint16_t	value, index, length;
+	struct storage *store;
+	struct stat st;
+	const char *base;
+	int ret;
 
-	value = __le16_to_cpu(setup->wValue);
-	index = __le16_to_cpu(setup->wIndex);
-	length = __le16_to_cpu(setup->wLength);
+	if (num_storages == MAX_STORAGES) {
+		fprintf(stderr, "Too many storages, %s ignored\n", path);
+		return NULL;
+	}
+	store = &storages[num_storages];
+
+	/* everything below resolves object paths against root */
+	store->root = realpath(path, NULL);
+	ret = store->root ? stat(store->root, &st) : -1;
+	if (ret < 0 || !S_ISDIR(st.st_mode) ||
+	    (!removable && access(store->root, R_OK | W_OK) < 0)) {
+		fprintf(stderr, "Invalid base directory %s\n", path);
+		free(store->root);
+		return NULL;
+	}
 
-	if (verbose)
-		fprintf(stderr, "SETUP %02x.%02x "
-				"v%04x i%04x %d\n",
-			setup->bRequestType, setup->bRequest,
-			value, index, length);
+	store->id = STORE_ID(num_storages);
+	store->removable = removable;
+	store->root_fd = removable ? -1 : open(store->root, O_PATH | O_DIRECTORY);
+	store->root_wd = -1;
+	g_queue_init(&store->objects);
+	g_queue_init(&store->rescan);
+	store->object_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	store->child_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	store->watch_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	store->fh_index = g_hash_table_new(dir_handle_hash, dir_handle_equal);
+	store->handle_map = g_hash_table_new_full(file_key_hash, file_key_equal, free, NULL);
+	store->uploads = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	store->map_fd = -1;
+	handle_map_load(store);
+	sem_init(&store->dbaccess, 0, 1);
+
+	store->info.filesystem_type = __cpu_to_le16(PIMA15740_FILESYSTEM_DCF);
+	store->info.access_capability = __cpu_to_le16(PIMA15740_ACCESS_CAP_RW);
+	if (removable) {
+		store->info.storage_type = __cpu_to_le16(PIMA15740_STORAGE_REMOVABLE_RAM);
+		store->info.desc_len = sizeof(storage_desc);
+		put_string((char *)store->info.desc, sizeof(storage_desc), storage_desc);
+	} else {
+		store->info.storage_type = __cpu_to_le16(PIMA15740_STORAGE_FIXED_RAM);
+		store->info.desc_len = sizeof(fixed_storage_desc);
+		put_string((char *)store->info.desc,
+			   sizeof(fixed_storage_desc), fixed_storage_desc);
+	}
 
-	/*
-	if ((setup->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
-		goto special;
-	*/
+	/* The directory name serves as volume label */
+	base = strrchr(store->root, '/');
+	base = base && base[1] ? base + 1 : store->root;
+	ret = put_string((char *)store->label, sizeof(store->label) / 2, base);
+	store->label_len = ret < 0 ? 0 : ret;
+
+	/* A storage, for which fanotify fails, doesn't take the others down with it */
+	store->use_fanotify = use_fanotify;
+	if (store->use_fanotify && (store->notify_fd = init_fanotify()) < 0) {
+		fprintf(stderr, "%s: falling back to inotify\n", store->root);
+		store->use_fanotify = 0;
+	}
 
-	switch (setup->bRequest) {
-	/* Still Image class-specific requests */
-	case USB_REQ_PTP_CANCEL_REQUEST:
-		return;
-	case USB_REQ_PTP_GET_EXTENDED_EVENT_DATA:
-		/* Optional, may stall */
-		goto stall;
-	case USB_REQ_PTP_DEVICE_RESET_REQUEST:
-		if (setup->bRequestType != 0x21
-				|| index != 0
-				|| value != 0)
-			goto stall;
+	if (!store->use_fanotify && (store->notify_fd = inotify_init()) < 0)
+		perror("inotify init failed");
 
-		err = reset_interface();
-		if (err)
-			goto stall;
+	pthread_mutex_init(&store->notify_lock, NULL);
+	pthread_cond_init(&store->notify_cond, NULL);
+	store->watching = store->notify_fd >= 0;
 
-		/* ... and ack (a write would stall) */
-		err = read(control, &err, 0);
-		if (err)
-			perror("ack DEVICE_RESET_REQUEST");
-		return;
-	case USB_REQ_PTP_GET_DEVICE_STATUS_REQUEST:
-		if (setup->bRequestType != 0xa1
-				|| index != 0
-				|| value != 0)
-			goto stall;
-		else {
-			uint16_t resp_ok[] = {
-				__constant_cpu_to_le16(4),
-				__constant_cpu_to_le16(PIMA15740_RESP_OK),
-			};
-			memcpy(buf, resp_ok, 4);
-			err = write(control, buf, 4);
-			if (err != 4)
-				fprintf(stderr, "DEVICE_STATUS_REQUEST %d\n", err);
-		}
+	num_storages++;
 
-		return;
-	default:
-		goto stall;
-	}
+	return store;
+}
 
-stall:
-	if (verbose)
-		fprintf(stderr, "... protocol stall %02x.%02x\n",
-			setup->bRequestType, setup->bRequest);
+static void signothing(int sig, siginfo_t *info, void *ptr)
+{
+	(void) ptr;
+	(void) info;
 
-	/* non-iso endpoints are stalled by issuing an i/o request
-	 * in the "wrong" direction.  ep0 is special only because
-	 * the direction isn't fixed.
-	 */
-	if (setup->bRequestType & USB_DIR_IN)
-		err = read(control, &err, 0);
-	else
-		err = write(control, &err, 0);
-	if (err != -1)
-		fprintf(stderr, "can't stall ep0 for %02x.%02x\n",
-			setup->bRequestType, setup->bRequest);
-	else if (errno != EL2HLT)
-		perror("ep0 stall");
+	/* NOP */
+	if (verbose > 2)
+		fprintf(stderr, "%s %d\n", __func__, sig);
 }
 
-static int read_control(void)
+static int init_signal(void)
 {
-	struct usb_functionfs_event event[NEVENT];
-	int i, nevent, ret;
-
-	static const char * const names[] = {
-		[FUNCTIONFS_BIND] = "BIND",
-		[FUNCTIONFS_UNBIND] = "UNBIND",
-		[FUNCTIONFS_ENABLE] = "ENABLE",
-		[FUNCTIONFS_DISABLE] = "DISABLE",
-		[FUNCTIONFS_SETUP] = "SETUP",
-		[FUNCTIONFS_SUSPEND] = "SUSPEND",
-		[FUNCTIONFS_RESUME] = "RESUME",
+	struct sigaction sa = {
+		.sa_sigaction = signothing,
+		.sa_flags = SA_SIGINFO,
 	};
 
-	ret = read(control, &event, sizeof(event));
-	if (ret < 0) {
-		if (errno == EAGAIN) {
-			sleep(1);
-			return ret;
-		}
-		perror("ep0 read after poll");
-		return ret;
+	sigfillset(&sa.sa_mask);
+	/* We will use SIGINT to wake up the bulk thread from read() */
+	if (sigaction(SIGINT, &sa, NULL) < 0) {
+		perror("SIGINT");
+		return -1;
 	}
-	nevent = ret / sizeof event[0];
+	return 0;
+}
 
-	for (i = 0; i < nevent; i++) {
-		if (verbose)
-			fprintf(stderr,
-				"Event %s,%d", names[event->type], event[i].type);
+int main(int argc, char *argv[])
+{
+	int c, i, ret;
+	unsigned long size;
+	char *removable[MAX_STORAGES], *end;
+	int num_removable = 0;
+
+	puts("Linux PTP Gadget v" VERSION_STRING);
+
+	init_strings();
+
+	if (init_signal() < 0)
+		exit(EXIT_FAILURE);
+
+	if (sem_init(&reset, 0, 0) < 0)
+		exit(EXIT_FAILURE);
 
-		switch (event[i].type) {
-		case FUNCTIONFS_BIND:
-			break;
-		case FUNCTIONFS_UNBIND:
+	while ((c = getopt(argc, argv, "vfd:l:m:r:s:")) != EOF) {
+		switch (c) {
+		case 'v':
+			verbose++;
 			break;
-		case FUNCTIONFS_ENABLE:
-			start_io();
+		case 'f':
+			use_fanotify = 1;
 			break;
-		case FUNCTIONFS_DISABLE:
-			stop_io();
+		case 'd':
+			if (!strcmp(optarg, "none")) {
+				durability = DURABLE_NONE;
+			} else if (!strcmp(optarg, "sync")) {
+				durability = DURABLE_SYNC;
+			} else if (!strcmp(optarg, "group")) {
+				durability = DURABLE_GROUP;
+			} else {
+				fprintf(stderr, "Unknown durability %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
 			break;
-		case FUNCTIONFS_SETUP:
-			handle_control(&event[i].u.setup);
+		case 'l':
+			/* there are no lock files any more, see journal_open() */
 			break;
-		case FUNCTIONFS_SUSPEND:
+		case 'm':
+			mapdir = optarg;
 			break;
-		case FUNCTIONFS_RESUME:
+		case 'r':
+			if (num_removable < MAX_STORAGES)
+				removable[num_removable++] = optarg;
 			break;
+		case 's':
+			errno = 0;
+			size = strtoul(optarg, &end, 0);
+			if (errno || end == optarg || *end || strchr(optarg, '-')) {
+				fprintf(stderr, "Invalid size %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			if (size > SMALL_OBJECT_MAX) {
+				fprintf(stderr, "Small objects are limited to %u bytes\n",
+					SMALL_OBJECT_MAX);
+				size = SMALL_OBJECT_MAX;
+			}
+			small_object_size = size;
 			break;
 		default:
-			fprintf(stderr,
-				"* unhandled event %d\n",
-				event[i].type);
+			fprintf(stderr, "Unsupported option %c\n", c);
+			exit(EXIT_FAILURE);
 		}
 	}
 
-	return ret;
-}
+	/* Fixed storages first, they get the lower StorageIDs */
+	for (i = optind; i < argc; i++)
+		if (!init_storage(argv[i], 0))
+			exit(EXIT_FAILURE);
+	for (i = 0; i < num_removable; i++)
+		if (!init_storage(removable[i], 1))
+			exit(EXIT_FAILURE);
 
-static int main_loop(void)
-{
-	struct pollfd ep_poll[1];
-	int ret;
+	if (!num_storages) {
+		fprintf(stderr, "No base directory given\n");
+		exit(EXIT_FAILURE);
+	}
 
-	do {
-		/* Always listen on control */
-		ep_poll[0].fd = control;
-		ep_poll[0].events = POLLIN | POLLHUP;
+	journal_open();
 
-		ret = poll(ep_poll, 1, -1);
+	for (i = 0; i < num_storages; i++)
+		storage_attach(&storages[i], 0);
+
+	if (chdir("/dev/ptp") < 0) {
+		perror("can't chdir /dev/ptp");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < num_storages; i++) {
+		ret = pthread_create(&storages[i].watcher, NULL, inotify_thread,
+				     &storages[i]);
 		if (ret < 0) {
-			perror("poll");
-			break;
+			perror("can't create inotify thread");
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		/* TODO: What to do with HUP? */
-		if (ep_poll[0].revents & POLLIN) {
-			ret = read_control();
-			if (ret < 0) {
-				if (errno == EAGAIN)
-					continue;
-				goto done;
-			}
+#ifdef THUMB_SUPPORT
+	start_thumb_workers();
+#endif
+
+	if (num_removable) {
+		ret = pthread_create(&mount_pthread, NULL, mount_thread, NULL);
+		if (ret < 0) {
+			perror("can't create mount thread");
+			exit(EXIT_FAILURE);
 		}
-	} while (1);
+	}
 
-	return 0;
+	init_device();
+	if (control < 0)
+		exit(EXIT_FAILURE);
 
-done:
-	switch (status) {
-	case PTP_IDLE:
-	case PTP_DATA_OUT:
-	case PTP_DATA_IN:
-	case PTP_DATA_READY:
-		stop_io();
-	case PTP_WAITCONFIG:
-		break;
+	fflush(stderr);
+
+	ret = main_loop();
+
+	for (i = 0; i < num_storages; i++) {
+		if (storages[i].root_wd >= 0)
+			inotify_rm_watch(storages[i].notify_fd, storages[i].root_wd);
+		close(storages[i].notify_fd);
 	}
 
-	return ret;
+	exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
-/*-------------------------------------------------------------------------*/
+#ifdef THUMB_SUPPORT
+/*
+ * Thumbnails are made by a pool of worker threads, so that neither the
+ * catalog nor uploads wait for them, and only when a host asks for them.
+ * Objects announce a JFIF thumbnail of size 0 until theirs is there, then
+ * ObjectInfoChanged is sent. GetThumb for such an object queues its job
+ * in front and waits for it, the thumbnails of the next few handles are
+ * queued behind, so they are there when the host gets to them.
+ */
+struct thumb_job {
+	struct storage	*store;
+	uint32_t	handle;
+	char		path[PATH_MAX];	/* relative to the storage root */
+	int		running;
+	int		again;		/* renamed while running */
+};
+
+static pthread_mutex_t thumb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t thumb_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t thumb_done = PTHREAD_COND_INITIALIZER;
+static GQueue thumb_queue = G_QUEUE_INIT;
+/* handle -> struct thumb_job, queued or running */
+static GHashTable *thumb_jobs;
+
+/*
+ * Recently sent thumbnails are kept in memory up to THUMB_CACHE_SIZE, the
+ * least recently used go first. An entry is only good for the mtime and
+ * size of its object it was read for, thumb_cache_drop() is called when
+ * the thumbnail goes away or is made anew.
+ */
+static pthread_mutex_t thumb_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static GQueue thumb_cache_lru = G_QUEUE_INIT;	/* most recent at the head */
+/* handle -> struct thumb_cached */
+static GHashTable *thumb_cache;
+static size_t thumb_cache_used;
+static unsigned long thumb_cache_hits, thumb_cache_misses, thumb_cache_evictions;
+
+static void thumb_cache_unref(struct thumb_cached *tc)
+{
+	if (!--tc->refs)
+		free(tc);
+}
 
-static size_t put_string(iconv_t ic, char *buf, const char *s, size_t len)
+/* Called with thumb_cache_lock held */
+static void thumb_cache_evict(struct thumb_cached *tc)
 {
-	char *in = (char *)s;
-	size_t ret, inl = len, outl = len * 2;
+	g_hash_table_remove(thumb_cache, GUINT_TO_POINTER(tc->handle));
+	g_queue_delete_link(&thumb_cache_lru, tc->link);
+	tc->link = NULL;
+	thumb_cache_used -= tc->size;
+	thumb_cache_unref(tc);
+}
+
+static struct thumb_cached *thumb_cache_get(uint32_t handle, time_t mtime, size_t size)
+{
+	struct thumb_cached *tc;
 
-	ret = iconv(ic, &in, &inl, &buf, &outl);
-	if (inl || outl)
-		fprintf(stdout, "iconv() error %d: %u input / %u output bytes left!\n",
-			errno, (unsigned int)inl, (unsigned int)outl);
+	pthread_mutex_lock(&thumb_cache_lock);
 
-	return ret;
+	tc = thumb_cache ? g_hash_table_lookup(thumb_cache, GUINT_TO_POINTER(handle)) : NULL;
+	if (tc && (tc->mtime != mtime || tc->size != size)) {
+		thumb_cache_evict(tc);
+		tc = NULL;
+	}
+
+	if (tc) {
+		thumb_cache_hits++;
+		g_queue_unlink(&thumb_cache_lru, tc->link);
+		g_queue_push_head_link(&thumb_cache_lru, tc->link);
+		tc->refs++;
+	} else {
+		thumb_cache_misses++;
+	}
+
+	if (verbose)
+		fprintf(stderr, "thumbnail cache: %lu hits, %lu misses, %lu evictions, %lu bytes\n",
+			thumb_cache_hits, thumb_cache_misses, thumb_cache_evictions,
+			(unsigned long)thumb_cache_used);
+
+	pthread_mutex_unlock(&thumb_cache_lock);
+
+	return tc;
 }
 
-static size_t get_string(iconv_t ic, char *buf, const char *s, size_t len)
+/* Read a thumbnail from fd into the cache, NULL if it doesn't go there */
+static struct thumb_cached *thumb_cache_fill(uint32_t handle, time_t mtime, int fd,
+					     off_t offset, size_t size)
 {
-	char *in = (char *)s;
-	size_t ret, inl = len * 2, outl = len;
+	struct thumb_cached *tc;
+	size_t done = 0;
+	ssize_t ret;
+
+	if (!size || size > THUMB_CACHE_MAX_ENTRY)
+		return NULL;
+
+	tc = malloc(sizeof(*tc) + size);
+	if (!tc)
+		return NULL;
+
+	while (done < size) {
+		ret = pread(fd, tc->data + done, size - done, offset + done);
+		if (ret <= 0) {
+			free(tc);
+			return NULL;
+		}
+		done += ret;
+	}
 
-	ret = iconv(ic, &in, &inl, &buf, &outl);
-	if (inl || outl)
-		fprintf(stdout, "iconv() error %d: %u input / %u output bytes left!\n",
-			errno, (unsigned int)inl, (unsigned int)outl);
+	tc->handle = handle;
+	tc->mtime = mtime;
+	tc->size = size;
+	/* one for the cache, one for the caller */
+	tc->refs = 2;
 
-	return ret;
+	pthread_mutex_lock(&thumb_cache_lock);
+
+	if (!thumb_cache)
+		thumb_cache = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	if (g_hash_table_lookup(thumb_cache, GUINT_TO_POINTER(handle)))
+		thumb_cache_evict(g_hash_table_lookup(thumb_cache, GUINT_TO_POINTER(handle)));
+
+	while (thumb_cache_used + size > THUMB_CACHE_SIZE && thumb_cache_lru.tail) {
+		thumb_cache_evict(thumb_cache_lru.tail->data);
+		thumb_cache_evictions++;
+	}
+
+	g_queue_push_head(&thumb_cache_lru, tc);
+	tc->link = thumb_cache_lru.head;
+	g_hash_table_insert(thumb_cache, GUINT_TO_POINTER(handle), tc);
+	thumb_cache_used += size;
+
+	pthread_mutex_unlock(&thumb_cache_lock);
+
+	return tc;
 }
 
-static void clean_up(const char *path)
+static void thumb_cache_release(struct thumb_cached *tc)
 {
-	struct dirent *dentry;
-	DIR *d;
-	char file_name[256];
-	int fd, ret;
-	char *endptr;
-	char fs_buf[32];
+	pthread_mutex_lock(&thumb_cache_lock);
+	thumb_cache_unref(tc);
+	pthread_mutex_unlock(&thumb_cache_lock);
+}
 
-	ret = chdir(path);
-	if (ret < 0)
+static void thumb_cache_drop(uint32_t handle)
+{
+	struct thumb_cached *tc;
+
+	pthread_mutex_lock(&thumb_cache_lock);
+	tc = thumb_cache ? g_hash_table_lookup(thumb_cache, GUINT_TO_POINTER(handle)) : NULL;
+	if (tc)
+		thumb_cache_evict(tc);
+	pthread_mutex_unlock(&thumb_cache_lock);
+}
+
+/*
+ * Thumbnails are appended to a single pack file instead of having a file
+ * each, which saves an inode, an open and a stat per thumbnail and the
+ * metadata writes that go with them. The index is an open addressing hash
+ * table of their names in a file of its own, mapped into memory. Every
+ * entry remembers inode, size and mtime of the image it was made from,
+ * so an outdated thumbnail is never sent. Replaced and deleted thumbnails
+ * leave holes in the pack, which are compacted away by an idle worker.
+ *
+ * Both files start with the same generation, a pack and an index from
+ * different compactions are thrown away on start. Entries pointing past
+ * the end of the pack, e.g. after a power cut, are dropped then as well.
+ */
+#define PACK_MAGIC	"PTPTHMB1"
+
+enum {
+	PACK_FREE,
+	PACK_USED,
+	PACK_DELETED,
+};
+
+struct pack_header {
+	char		magic[8];
+	uint64_t	generation;
+};
+
+struct pack_index {
+	struct pack_header	head;
+	uint32_t		slots;
+	uint32_t		used;		/* entries not free */
+	uint64_t		live_bytes;
+	uint64_t		dead_bytes;
+	struct pack_entry {
+		uint64_t	key;
+		uint64_t	ino;
+		int64_t		size;
+		int64_t		mtime;
+		uint64_t	offset;
+		uint32_t	length;
+		uint32_t	state;
+	} entry[];
+};
+
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pack_index *pack_index;
+static size_t pack_index_size;
+static int pack_fd = -1;
+static off_t pack_end;
+
+/* FNV-1a */
+static uint64_t pack_key(const char *name)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Called with pack_lock held, as are all pack_ functions */
+static struct pack_entry *pack_find(struct pack_index *index, uint64_t key, int insert)
+{
+	uint32_t mask = index->slots - 1, i;
+	struct pack_entry *reuse = NULL, *e;
+
+	for (i = key & mask; ; i = (i + 1) & mask) {
+		e = &index->entry[i];
+		if (e->state == PACK_FREE)
+			break;
+		if (e->state == PACK_USED && e->key == key)
+			return e;
+		if (e->state == PACK_DELETED && !reuse)
+			reuse = e;
+	}
+
+	if (!insert)
+		return NULL;
+	if (!reuse)
+		index->used++;
+
+	return reuse ? reuse : e;
+}
+
+static void pack_drop(struct pack_entry *e)
+{
+	e->state = PACK_DELETED;
+	pack_index->live_bytes -= e->length;
+	pack_index->dead_bytes += e->length;
+}
+
+static void pack_close(void)
+{
+	if (pack_index)
+		munmap(pack_index, pack_index_size);
+	if (pack_fd >= 0)
+		close(pack_fd);
+	pack_index = NULL;
+	pack_fd = -1;
+}
+
+/* Thumbnails of versions before the pack had a file each */
+static void pack_remove_thumb_files(void)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	size_t len;
+	DIR *dir;
+
+	dir = opendir(THUMB_LOCATION);
+	if (!dir)
 		return;
 
-	d = opendir(".");
+	while ((d = readdir(dir))) {
+		len = strlen(d->d_name);
+		if (len > sizeof(".thumb.jpeg") - 1 &&
+		    !strcmp(d->d_name + len - sizeof(".thumb.jpeg") + 1, ".thumb.jpeg") &&
+		    snprintf(path, sizeof(path), THUMB_LOCATION "%s", d->d_name) < (int)sizeof(path))
+			unlink(path);
+	}
 
-	while ((dentry = readdir(d))) {
-		struct stat fstat;
-		char *dot;
-		unsigned long lsize, fsize;
+	closedir(dir);
+}
 
-		dot = strrchr(dentry->d_name, '.');
+/* An empty index with room for slots entries, mapped, as THUMB_INDEX ".new" */
+static int pack_index_create(uint32_t slots, const struct pack_header *head,
+			     struct pack_index **index, size_t *size)
+{
+	int ifd;
 
-		if (!dot || dot == dentry->d_name)
-			continue;
+	*size = sizeof(**index) + slots * sizeof(struct pack_entry);
+	ifd = open(THUMB_INDEX ".new", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (ifd < 0)
+		return -1;
+	if (ftruncate(ifd, *size) < 0)
+		goto fail;
+	*index = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, ifd, 0);
+	if (*index == MAP_FAILED)
+		goto fail;
+
+	(*index)->head = *head;
+	(*index)->slots = slots;
+	return ifd;
+
+fail:
+	close(ifd);
+	unlink(THUMB_INDEX ".new");
+	return -1;
+}
 
-		if (strcasecmp(dot, ".lock"))
+/*
+ * Move the entries into a larger index, which replaces the current one.
+ * The thumbnails stay where they are in the pack, of the same generation.
+ */
+static int pack_rehash(uint32_t slots)
+{
+	struct pack_index *index;
+	struct pack_entry *e;
+	size_t size;
+	uint32_t i;
+	int ifd;
+
+	ifd = pack_index_create(slots, &pack_index->head, &index, &size);
+	if (ifd < 0)
+		return -1;
+
+	for (i = 0; i < pack_index->slots; i++) {
+		e = &pack_index->entry[i];
+		if (e->state != PACK_USED)
 			continue;
+		*pack_find(index, e->key, 1) = *e;
+	}
+	index->live_bytes = pack_index->live_bytes;
+	index->dead_bytes = pack_index->dead_bytes;
 
-		*dot = '\0';
-		snprintf(file_name, sizeof(file_name), "%s", dentry->d_name);
-		*dot = '.';
+	if (msync(index, size, MS_SYNC) < 0 || rename(THUMB_INDEX ".new", THUMB_INDEX) < 0) {
+		munmap(index, size);
+		close(ifd);
+		unlink(THUMB_INDEX ".new");
+		return -1;
+	}
 
-		fd = open(dentry->d_name, O_RDONLY);
-		if (fd < 0) {
-			fprintf(stderr, "%s: open %s: %s\n",
-				__func__, dentry->d_name, strerror(errno));
-			continue;
-		}
+	munmap(pack_index, pack_index_size);
+	pack_index = index;
+	pack_index_size = size;
+	close(ifd);
 
-		memset(fs_buf, 0, sizeof(fs_buf));
-		ret = read(fd, fs_buf, sizeof(fs_buf));
-		if (ret < 0) {
-			fprintf(stderr, "%s: read %s: %s\n",
-				__func__, dentry->d_name, strerror(errno));
-			close(fd);
-			continue;
-		}
-		close(fd);
+	if (verbose)
+		fprintf(stderr, "Thumbnail index: %u slots\n", slots);
 
-		if (ret) {
-			lsize = strtoul(fs_buf, &endptr, 10);
-			fprintf(stdout, "%s: *endptr %x\n", __func__, *endptr);
-			/*
-			 * if not entire string is valid, then this file was not
-			 * created by ptp, so skip it.
-			 */
-			if (fs_buf == endptr) {
-				fprintf(stderr, "%s: can't get size of locked "
-					"file %s\n", __func__, dentry->d_name);
-				continue;
-			}
-			if (*endptr != 0)
-				continue;
-		} else {
-			/* delete empty lock */
-			ret = unlink(dentry->d_name);
-			if (ret < 0)
-				fprintf(stderr, "%s: %s: %s\n",
-					__func__, dentry->d_name,
-					strerror(errno));
-			continue;
-		}
+	return 0;
+}
 
-		ret = stat(file_name, &fstat);
-		if (ret < 0) {
-			/* no corresponding object file, so delete lock file */
-			fprintf(stderr, "%s: stat %s: %s\n",
-				__func__, file_name, strerror(errno));
-			ret = unlink(dentry->d_name);
-			if (ret < 0)
-				fprintf(stderr, "%s: %s: %s\n",
-					__func__, dentry->d_name,
-					strerror(errno));
+/*
+ * Write a new pack and index with room for slots entries, taking over the
+ * thumbnails of the current ones if there are any, and replace them.
+ */
+static int pack_rebuild(uint32_t slots)
+{
+	struct pack_index *index;
+	struct pack_header head;
+	struct pack_entry *e, *n;
+	size_t size;
+	unsigned char *buf = NULL;
+	off_t end = sizeof(head);
+	int fd, ifd, ret = -1;
+	uint32_t i;
+
+	fd = open(THUMB_PACK ".new", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	memcpy(head.magic, PACK_MAGIC, sizeof(head.magic));
+	head.generation = pack_index ? pack_index->head.generation + 1 : (uint64_t)time(NULL);
+	ifd = pack_index_create(slots, &head, &index, &size);
+	if (ifd < 0)
+		goto close_pack;
+	if (pwrite(fd, &head, sizeof(head), 0) != sizeof(head))
+		goto unmap;
+
+	for (i = 0; pack_index && i < pack_index->slots; i++) {
+		e = &pack_index->entry[i];
+		if (e->state != PACK_USED)
 			continue;
-		}
 
-		fsize = fstat.st_size;
-		if (lsize == fsize) {
-			/* locked file size is the same as the reserved size,
-			 * but lock file was not deleted. This means transaction
-			 * was not completed, so delete both, lock file and
-			 * appropriate object file.
-			 */
-			if (verbose)
-				printf("remove %s, %s\n",
-					dentry->d_name, file_name);
-			ret = unlink(dentry->d_name);
-			if (ret < 0)
-				fprintf(stderr, "%s: %s: %s\n",
-					__func__, dentry->d_name, strerror(errno));
-			ret = unlink(file_name);
-			if (ret < 0)
-				fprintf(stderr, "%s: %s: %s\n",
-					__func__, file_name, strerror(errno));
-		} else {
-			/* no corresponding object file, so delete lock file */
-			if (verbose)
-				printf("remove %s\n", dentry->d_name);
-			ret = unlink(dentry->d_name);
-			if (ret < 0)
-				fprintf(stderr, "%s: %s: %s\n",
-					__func__, dentry->d_name, strerror(errno));
-		}
+		free(buf);
+		buf = malloc(e->length);
+		if (!buf || pread(pack_fd, buf, e->length, e->offset) != e->length ||
+		    pwrite(fd, buf, e->length, end) != e->length)
+			goto unmap;
+
+		n = pack_find(index, e->key, 1);
+		*n = *e;
+		n->offset = end;
+		index->live_bytes += e->length;
+		end += e->length;
 	}
-	closedir(d);
-}
 
-static int add_object(char *filename) {
-	struct stat fstat;
-	size_t namelen, datelen, osize;
-	enum pima15740_data_format format, thumb_format;
-	char *dot;
-	struct tm mod_tm;
-	int thumb_size = 0, thumb_width, thumb_height;
-	char mod[32], mod_ucs2[64], fname_ucs2[512];
-	int ret;
-	struct obj_list *obj;
+	/* the index must never point at data that isn't there */
+	if (fdatasync(fd) < 0 || msync(index, size, MS_SYNC) < 0 ||
+	    rename(THUMB_PACK ".new", THUMB_PACK) < 0 ||
+	    rename(THUMB_INDEX ".new", THUMB_INDEX) < 0)
+		goto unmap;
 
-	ret = chdir(root);
-	if (ret < 0)
-		return ret;
+	pack_close();
+	pack_index = index;
+	pack_index_size = size;
+	pack_fd = fd;
+	pack_end = end;
+	close(ifd);
+	free(buf);
 
-	dot = strrchr(filename, '.');
+	if (verbose)
+		fprintf(stderr, "Thumbnail pack: %u slots, %lu bytes\n",
+			slots, (unsigned long)end);
 
-	if (dot == filename || !strncmp(filename, "..", 2))
-		return 0;
+	return 0;
 
-	format = PIMA15740_FMT_A_UNDEFINED;
+unmap:
+	munmap(index, size);
+	close(ifd);
+	unlink(THUMB_INDEX ".new");
+close_pack:
+	close(fd);
+	unlink(THUMB_PACK ".new");
+	free(buf);
+	return ret;
+}
 
-#ifdef FORMAT_SUPPORT
-	if (dot && strlen(dot) >= 3) {
-		/* TODO: use identify from ImageMagick and parse its output */
-		switch (dot[1]) {
-		case 't':
-		case 'T':
-			if (dot[2] == 'x' || dot[2] == 'X')
-				format = PIMA15740_FMT_A_TEXT;
-			else
-				format = PIMA15740_FMT_I_TIFF;
-			break;
-		case 'j':
-		case 'J':
-			format = PIMA15740_FMT_I_EXIF_JPEG;
-			break;
-		default:
-			format = PIMA15740_FMT_A_UNDEFINED;
-		}
+/* Open the pack and its index, or start new ones if they don't fit */
+static void pack_init(void)
+{
+	struct pack_header head;
+	struct stat st;
+	uint32_t i;
+	int ifd;
+
+	pthread_mutex_lock(&pack_lock);
+
+	pack_fd = open(THUMB_PACK, O_RDWR);
+	ifd = open(THUMB_INDEX, O_RDWR);
+	if (pack_fd < 0 || ifd < 0 || fstat(ifd, &st) < 0 ||
+	    (size_t)st.st_size < sizeof(*pack_index))
+		goto fresh;
+
+	pack_index_size = st.st_size;
+	pack_index = mmap(NULL, pack_index_size, PROT_READ | PROT_WRITE, MAP_SHARED, ifd, 0);
+	if (pack_index == MAP_FAILED) {
+		pack_index = NULL;
+		goto fresh;
 	}
-#endif
 
-	ret = stat(filename, &fstat);
-	if (ret < 0)
-		return ret;
+	if (pread(pack_fd, &head, sizeof(head), 0) != sizeof(head) ||
+	    memcmp(head.magic, PACK_MAGIC, sizeof(head.magic)) ||
+	    memcmp(&head, &pack_index->head, sizeof(head)) ||
+	    !pack_index->slots || pack_index->slots & (pack_index->slots - 1) ||
+	    pack_index_size != sizeof(*pack_index) +
+	    (size_t)pack_index->slots * sizeof(struct pack_entry) ||
+	    fstat(pack_fd, &st) < 0)
+		goto fresh;
+
+	pack_end = st.st_size;
+	for (i = 0; i < pack_index->slots; i++) {
+		struct pack_entry *e = &pack_index->entry[i];
+
+		if (e->state == PACK_USED && (e->offset < sizeof(head) ||
+					      (off_t)(e->offset + e->length) > pack_end))
+			pack_drop(e);
+	}
+	close(ifd);
+	goto out;
+
+fresh:
+	if (ifd >= 0)
+		close(ifd);
+	pack_close();
+	if (pack_rebuild(THUMB_PACK_SLOTS) < 0)
+		fprintf(stderr, "Cannot create thumbnail pack under %s: %s\n",
+			THUMB_LOCATION, strerror(errno));
+	else
+		pack_remove_thumb_files();
+out:
+	pthread_mutex_unlock(&pack_lock);
+}
+
+/* Make sure there is room for one more entry, the pack itself is left alone */
+static int pack_reserve(void)
+{
+	uint32_t slots;
+
+	if (!pack_index)
+		return -1;
 
-	if (fstat.st_mode & S_IFDIR)
+	/* keep the table no more than 3/4 full, also counting deleted slots */
+	if ((pack_index->used + 1) * 4 <= pack_index->slots * 3)
 		return 0;
 
-	namelen = strlen(filename) + 1;
+	for (slots = THUMB_PACK_SLOTS; slots * 3 <= (pack_index->used + 1) * 4 ||
+	     slots < pack_index->slots; slots *= 2)
+		;
 
-	ret = put_string(ic, fname_ucs2, filename, namelen);
-	if (ret)
-		return ret;
+	return pack_rehash(slots);
+}
 
-	gmtime_r(&fstat.st_mtime, &mod_tm);
-	snprintf(mod, sizeof(mod), "%04u%02u%02uT%02u%02u%02u.0Z", mod_tm.tm_year
-			+ 1900, mod_tm.tm_mon + 1, mod_tm.tm_mday, mod_tm.tm_hour,
-			mod_tm.tm_min, mod_tm.tm_sec);
+/* Size of the thumbnail filed under name, if it was made from st */
+static int thumb_pack_get(const char *name, const struct stat *st)
+{
+	struct pack_entry *e;
+	int ret = -1;
 
-	/* String length including the trailing '\0' */
-	datelen = strlen(mod) + 1;
-	ret = put_string(ic, mod_ucs2, mod, datelen);
-	if (ret) {
-		mod[0] = '\0';
-		datelen = 0;
-	}
+	pthread_mutex_lock(&pack_lock);
+	e = pack_index ? pack_find(pack_index, pack_key(name), 0) : NULL;
+	if (e && e->ino == (uint64_t)st->st_ino && e->size == (int64_t)st->st_size &&
+	    e->mtime == (int64_t)st->st_mtime)
+		ret = e->length;
+	pthread_mutex_unlock(&pack_lock);
 
-#ifdef THUMB_SUPPORT
-	if (format != PIMA15740_FMT_A_TEXT) {
-		thumb_size = generate_thumb(filename);
-		if (thumb_size < 0) {
-			thumb_size = 0;
-			return 0;
-		}
-	}
-#endif
+	return ret;
+}
 
-	/* namelen and datelen include terminating '\0', plus 4 string-size bytes */
-	osize = sizeof(*obj) + 2 * (datelen + namelen) + 4;
+static int thumb_pack_put(const char *name, const struct stat *st,
+			  const void *buf, size_t length)
+{
+	struct pack_entry *e;
+	uint64_t key = pack_key(name);
+	int ret = -1;
 
-	if (verbose)
-		fprintf(stderr, "Listing image %s, modified %s, info-size %u\n",
-				filename, mod, (unsigned int) osize);
+	pthread_mutex_lock(&pack_lock);
 
-	obj = malloc(osize);
-	if (!obj) {
-		return -1;
-	}
+	if (pack_reserve() < 0)
+		goto out;
 
-#ifdef THUMB_SUPPORT
-	if (format == PIMA15740_FMT_A_TEXT ||
-			format == PIMA15740_FMT_A_UNDEFINED) {
-		thumb_format = PIMA15740_FMT_A_UNDEFINED;
-		thumb_width = 0;
-		thumb_height = 0;
-		thumb_size = 0;
-	} else {
-		thumb_format = PIMA15740_FMT_I_JFIF;
-		thumb_width = THUMB_WIDTH;
-		thumb_height = THUMB_HEIGHT;
+	if (pwrite(pack_fd, buf, length, pack_end) != (ssize_t)length)
+		goto out;
+
+	e = pack_find(pack_index, key, 0);
+	if (e)
+		pack_drop(e);
+	e = pack_find(pack_index, key, 1);
+	e->key = key;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtime;
+	e->offset = pack_end;
+	e->length = length;
+	e->state = PACK_USED;
+	pack_index->live_bytes += length;
+	pack_end += length;
+	ret = 0;
+
+out:
+	pthread_mutex_unlock(&pack_lock);
+	return ret;
+}
+
+/* A descriptor of the pack and where the thumbnail is, if it has length bytes */
+static int thumb_pack_open(const char *name, off_t *offset, size_t length)
+{
+	struct pack_entry *e;
+	int fd = -1;
+
+	pthread_mutex_lock(&pack_lock);
+	e = pack_index ? pack_find(pack_index, pack_key(name), 0) : NULL;
+	if (e && e->length == length) {
+		/* one of its own, compaction may replace the pack meanwhile */
+		fd = open(THUMB_PACK, O_RDONLY);
+		*offset = e->offset;
 	}
-#else
-	thumb_format = PIMA15740_FMT_A_UNDEFINED;
-	thumb_width = 0;
-	thumb_height = 0;
-	thumb_size = 0;
-#endif
+	pthread_mutex_unlock(&pack_lock);
 
-	++last_object_number;
-	obj->handle = last_object_number;
+	return fd;
+}
 
-	/* Fixed size object info, filename, capture date, and two empty strings */
-	obj->info_size = sizeof(obj->info) + 2 * (datelen + namelen) + 4;
+static void thumb_pack_remove(const char *name)
+{
+	struct pack_entry *e;
 
-	if(verbose)
-		fprintf(stderr, "adding %s with size %d\n", filename, (int) fstat.st_size);
+	pthread_mutex_lock(&pack_lock);
+	e = pack_index ? pack_find(pack_index, pack_key(name), 0) : NULL;
+	if (e)
+		pack_drop(e);
+	pthread_mutex_unlock(&pack_lock);
+}
 
-	obj->info.storage_id = __cpu_to_le32(STORE_ID);
-	obj->info.object_format = __cpu_to_le16(format);
-	obj->info.protection_status
-			= __cpu_to_le16(fstat.st_mode & S_IWUSR ? 0 : 1);
-	obj->info.object_compressed_size = __cpu_to_le32(fstat.st_size);
-	obj->info.thumb_format = __cpu_to_le16(thumb_format);
-	obj->info.thumb_compressed_size = __cpu_to_le32(thumb_size);
-	obj->info.thumb_pix_width = __cpu_to_le32(thumb_width);
-	obj->info.thumb_pix_height = __cpu_to_le32(thumb_height);
-	obj->info.image_pix_width = __cpu_to_le32(0); /* 0 == */
-	obj->info.image_pix_height = __cpu_to_le32(0); /* not */
-	obj->info.image_bit_depth = __cpu_to_le32(0); /* supported */
-	obj->info.parent_object = __cpu_to_le32(0); /* Fixed / */
-	obj->info.association_type = __cpu_to_le16(0);
-	obj->info.association_desc = __cpu_to_le32(0);
-	obj->info.sequence_number = __cpu_to_le32(0);
-	strncpy(obj->name, filename, sizeof(obj->name));
+/* The image keeps inode, size and mtime when renamed, so does its thumbnail */
+static int thumb_pack_rename(const char *old, const char *new)
+{
+	struct pack_entry *e, *n, entry;
+	uint64_t key = pack_key(new);
+	int ret = -1;
+
+	pthread_mutex_lock(&pack_lock);
+	e = pack_reserve() < 0 ? NULL : pack_find(pack_index, pack_key(old), 0);
+	if (e) {
+		entry = *e;
+		pack_drop(e);
+		n = pack_find(pack_index, key, 0);
+		if (n)
+			pack_drop(n);
+		n = pack_find(pack_index, key, 1);
+		*n = entry;
+		n->key = key;
+		pack_index->live_bytes += n->length;
+		pack_index->dead_bytes -= n->length;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&pack_lock);
 
-	obj->info.strings[0] = namelen;
-	memcpy(obj->info.strings + 1, fname_ucs2, namelen * 2);
-	/* We use file modification date as Capture Date */
-	obj->info.strings[1 + namelen * 2] = datelen;
-	memcpy(obj->info.strings + 2 + namelen * 2, mod_ucs2, datelen * 2);
-	/* Empty Modification Date */
-	obj->info.strings[2 + (namelen + datelen) * 2] = 0;
-	/* Empty Keywords */
-	obj->info.strings[3 + (namelen + datelen) * 2] = 0;
+	return ret;
+}
 
-	images = g_slist_append(images, obj);
+/* Squeeze the holes out once they take more room than the thumbnails */
+static void thumb_pack_compact(void)
+{
+	pthread_mutex_lock(&pack_lock);
+	if (pack_index && pack_index->dead_bytes > THUMB_PACK_SLACK &&
+	    pack_index->dead_bytes > pack_index->live_bytes)
+		pack_rebuild(pack_index->slots);
+	pthread_mutex_unlock(&pack_lock);
+}
+
+static int thumb_path(struct storage *store, const char *path,
+		      char *file_name, size_t fsize, char *name, size_t nsize)
+{
+	if (get_storage_path(store, path, file_name, fsize) < 0 ||
+	    thumb_filename(store, path, name, nsize) < 0)
+		return -1;
 
 	return 0;
 }
 
-static int enum_objects(const char *path) {
-	DIR *d;
-	struct dirent *dentry;
-	int ret;
+/* Size of an up to date thumbnail, -1 if there is none */
+static int thumb_ready(struct storage *store, const char *path)
+{
+	char file_name[PATH_MAX], name[PATH_MAX];
+	struct stat st;
 
-	ret = chdir(path);
-	if (ret < 0)
-		return ret;
+	if (thumb_path(store, path, file_name, sizeof(file_name), name, sizeof(name)) < 0 ||
+	    stat(file_name, &st) < 0)
+		return -1;
 
-	d = opendir(".");
+	return thumb_pack_get(name, &st);
+}
 
-	while ((dentry = readdir(d))) {
-		ret = add_object(dentry->d_name);
-		if (ret < 0)
+#ifdef HAVE_LIBJPEG
+struct thumb_error {
+	struct jpeg_error_mgr	mgr;
+	jmp_buf			env;
+};
+
+static void thumb_error_exit(j_common_ptr cinfo)
+{
+	struct thumb_error *err = (struct thumb_error *)cinfo->err;
+
+	if (verbose)
+		(*cinfo->err->output_message)(cinfo);
+	longjmp(err->env, 1);
+}
+
+/*
+ * Decode at the smallest DCT scale, 1/8 at best, that still covers the
+ * thumbnail, then average the remaining pixels down by area. No more than
+ * a row of the image and a row of the thumbnail are held in memory.
+ */
+static int jpeg_thumb(const char *src, FILE *out)
+{
+	struct jpeg_decompress_struct din;
+	struct jpeg_compress_struct cout;
+	struct thumb_error jerr;
+	FILE *volatile in = NULL;
+	JSAMPLE *volatile row = NULL, *volatile trow = NULL;
+	uint32_t *volatile acc = NULL, *volatile xstart = NULL;
+	unsigned int sw, sh, tw, th, comps, x, y, c, sy, rows, denom;
+	JSAMPROW rowp;
+	volatile int ret = -1;
+
+	in = fopen(src, "rb");
+	if (!in)
+		return -1;
+
+	din.err = jpeg_std_error(&jerr.mgr);
+	cout.err = din.err;
+	jerr.mgr.error_exit = thumb_error_exit;
+	jpeg_create_decompress(&din);
+	jpeg_create_compress(&cout);
+	if (setjmp(jerr.env))
+		goto out;
+
+	jpeg_stdio_src(&din, in);
+	jpeg_read_header(&din, TRUE);
+
+	if (din.jpeg_color_space != JCS_GRAYSCALE)
+		din.out_color_space = JCS_RGB;
+	for (denom = 8; denom > 1; denom /= 2)
+		if (din.image_width / denom >= THUMB_WIDTH &&
+		    din.image_height / denom >= THUMB_HEIGHT)
 			break;
+	din.scale_num = 1;
+	din.scale_denom = denom;
+	din.dct_method = JDCT_IFAST;
+	din.do_fancy_upsampling = FALSE;
+	jpeg_start_decompress(&din);
+
+	/* fit into the thumbnail size keeping the aspect ratio, no upscaling */
+	sw = din.output_width;
+	sh = din.output_height;
+	comps = din.output_components;
+	if ((uint64_t)sw * THUMB_HEIGHT > (uint64_t)sh * THUMB_WIDTH) {
+		tw = min(sw, (unsigned int)THUMB_WIDTH);
+		th = ((uint64_t)sh * tw + sw / 2) / sw;
+	} else {
+		th = min(sh, (unsigned int)THUMB_HEIGHT);
+		tw = ((uint64_t)sw * th + sh / 2) / sh;
 	}
+	tw = tw ? tw : 1;
+	th = th ? th : 1;
+
+	row = malloc(sw * comps);
+	trow = malloc(tw * comps);
+	acc = calloc(tw * comps, sizeof(*acc));
+	xstart = malloc((tw + 1) * sizeof(*xstart));
+	if (!row || !trow || !acc || !xstart)
+		goto out;
+	for (x = 0; x <= tw; x++)
+		xstart[x] = (uint64_t)x * sw / tw;
+
+	jpeg_stdio_dest(&cout, out);
+	cout.image_width = tw;
+	cout.image_height = th;
+	cout.input_components = comps;
+	cout.in_color_space = comps == 1 ? JCS_GRAYSCALE : JCS_RGB;
+	jpeg_set_defaults(&cout);
+	jpeg_set_quality(&cout, THUMB_QUALITY, TRUE);
+	jpeg_start_compress(&cout, TRUE);
+
+	for (y = 0, sy = 0, rows = 0; y < th; ) {
+		rowp = row;
+		jpeg_read_scanlines(&din, &rowp, 1);
+		sy++;
+		rows++;
+
+		for (x = 0; x < tw; x++)
+			for (c = 0; c < comps; c++) {
+				unsigned int i;
+
+				for (i = xstart[x]; i < xstart[x + 1]; i++)
+					acc[x * comps + c] += row[i * comps + c];
+			}
 
-	closedir(d);
+		/* the last image row of this thumbnail row */
+		if (sy < (uint64_t)(y + 1) * sh / th)
+			continue;
+
+		for (x = 0; x < tw; x++) {
+			unsigned int area = rows * (xstart[x + 1] - xstart[x]);
+
+			for (c = 0; c < comps; c++) {
+				trow[x * comps + c] = (acc[x * comps + c] + area / 2) / area;
+				acc[x * comps + c] = 0;
+			}
+		}
+		rowp = trow;
+		jpeg_write_scanlines(&cout, &rowp, 1);
+		rows = 0;
+		y++;
+	}
+
+	jpeg_finish_compress(&cout);
+	jpeg_abort_decompress(&din);
+	ret = 0;
+
+out:
+	jpeg_destroy_compress(&cout);
+	jpeg_destroy_decompress(&din);
+	fclose(in);
+	free(row);
+	free(trow);
+	free(acc);
+	free(xstart);
 	return ret;
 }
 
-static void init_strings(iconv_t ic)
+static int is_jpeg(const char *file_name)
 {
-	put_string(ic, (char *)dev_info.manuf, manuf, sizeof(manuf));
-	put_string(ic, (char *)dev_info.model, model, sizeof(model));
-	put_string(ic, (char *)storage_info.desc,
-		   storage_desc, sizeof(storage_desc));
-}
+	unsigned char magic[3];
+	int fd, ret;
 
-static void signothing(int sig, siginfo_t *info, void *ptr)
-{
-	(void) ptr;
-	(void) info;
+	fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	ret = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+		magic[0] == 0xff && magic[1] == 0xd8 && magic[2] == 0xff;
+	close(fd);
 
-	/* NOP */
-	if (verbose > 2)
-		fprintf(stderr, "%s %d\n", __func__, sig);
+	return ret;
 }
+#endif
 
-static int init_signal(void)
+/* Other formats are still converted by ImageMagick, which writes to a pipe */
+static int convert_thumb(const char *src, FILE *out)
 {
-	struct sigaction sa = {
-		.sa_sigaction = signothing,
-		.sa_flags = SA_SIGINFO,
-	};
+	char buf[4096];
+	pid_t converter;
+	int status, pipefd[2];
+	ssize_t ret;
 
-	sigfillset(&sa.sa_mask);
-	/* We will use SIGINT to wake up the bulk thread from read() */
-	if (sigaction(SIGINT, &sa, NULL) < 0) {
-		perror("SIGINT");
+	if (pipe(pipefd) < 0)
+		return -1;
+
+	converter = fork();
+	if (converter < 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
 		return -1;
 	}
-	return 0;
+
+	if (!converter) {
+		dup2(pipefd[1], STDOUT_FILENO);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		execlp("convert", "convert", "-thumbnail", THUMB_SIZE,
+		       src, "jpeg:-", NULL);
+		_exit(127);
+	}
+
+	close(pipefd[1]);
+	while ((ret = read(pipefd[0], buf, sizeof(buf))) > 0 ||
+	       (ret < 0 && errno == EINTR))
+		if (ret > 0 && fwrite(buf, 1, ret, out) != (size_t)ret)
+			break;
+	close(pipefd[0]);
+
+	waitpid(converter, &status, 0);
+	return WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Make a thumbnail in memory and file it in the pack, together with what
+ * the image looked like before it was read. Returns its size.
+ */
+static int generate_thumb(struct storage *store, const char *path)
 {
-	int c, ret;
-	struct stat root_stat;
-	images = NULL;
-	int notify_wd;
+	char file_name[PATH_MAX], name[PATH_MAX];
+	char *buf = NULL;
+	size_t len = 0;
+	struct stat st;
+	FILE *out;
+	int ret;
 
-	puts("Linux PTP Gadget v" VERSION_STRING);
+	if (thumb_path(store, path, file_name, sizeof(file_name), name, sizeof(name)) < 0 ||
+	    stat(file_name, &st) < 0)
+		return -1;
+
+	ret = thumb_pack_get(name, &st);
+	if (ret > 0)
+		return ret;
 
-	ic = iconv_open("UCS-2LE", "ISO8859-1");
-	if (ic == (iconv_t)-1) {
-		perror("iconv_open");
+	if (verbose)
+		fprintf(stderr, "No or old thumbnail for %s\n", file_name);
+
+	out = open_memstream(&buf, &len);
+	if (!out)
 		return -1;
-	}
 
-	uc = iconv_open("ISO8859-1", "UCS-2LE");
-	if (uc == (iconv_t)-1) {
-		perror("iconv_open 2");
+#ifdef HAVE_LIBJPEG
+	if (is_jpeg(file_name))
+		ret = jpeg_thumb(file_name, out);
+	else
+#endif
+		ret = convert_thumb(file_name, out);
+
+	if (fclose(out) || !len || len > INT_MAX)
+		ret = -1;
+	if (!ret)
+		ret = thumb_pack_put(name, &st, buf, len);
+	free(buf);
+
+	if (ret < 0) {
+		if (verbose)
+			fprintf(stderr, "Generate thumbnail for %s failed\n", file_name);
 		return -1;
 	}
 
-	init_strings(ic);
+	return len;
+}
 
-	if (init_signal() < 0)
-		exit(EXIT_FAILURE);
+/*
+ * Queue a thumbnail for an object, called with its storage locked. An
+ * urgent one goes in front, others are dropped if the queue is long. One
+ * already being made is just waited for, thumb_finish() makes it again,
+ * if the object was renamed meanwhile.
+ */
+static void thumb_request(struct storage *store, uint32_t handle, const char *path,
+			  int urgent)
+{
+	struct thumb_job *job;
 
-	if (sem_init(&reset, 0, 0) < 0)
-		exit(EXIT_FAILURE);
+	pthread_mutex_lock(&thumb_lock);
 
-	while ((c = getopt(argc, argv, "vl:")) != EOF) {
-		switch (c) {
-		case 'v':
-			verbose++;
-			break;
-		case 'l':
-			lockdir = optarg;
-			break;
-		default:
-			fprintf(stderr, "Unsupported option %c\n", c);
-			exit(EXIT_FAILURE);
-		}
-	}
+	if (!thumb_jobs)
+		thumb_jobs = g_hash_table_new(g_direct_hash, g_direct_equal);
 
-	root = argv[argc - 1];
+	job = g_hash_table_lookup(thumb_jobs, GUINT_TO_POINTER(handle));
+	if (!job) {
+		if (!urgent && thumb_queue.length >= THUMB_QUEUE_MAX)
+			goto out;
+		job = calloc(1, sizeof(*job));
+		if (!job)
+			goto out;
+		job->store = store;
+		job->handle = handle;
+		g_hash_table_insert(thumb_jobs, GUINT_TO_POINTER(handle), job);
+		if (urgent)
+			g_queue_push_head(&thumb_queue, job);
+		else
+			g_queue_push_tail(&thumb_queue, job);
+		pthread_cond_signal(&thumb_work);
+	} else if (job->running) {
+		goto out;
+	} else if (urgent && g_queue_remove(&thumb_queue, job)) {
+		g_queue_push_head(&thumb_queue, job);
+	}
+	snprintf(job->path, sizeof(job->path), "%s", path);
 
-	clean_up(lockdir);
+out:
+	pthread_mutex_unlock(&thumb_lock);
+}
 
-	/*
-	 * if a client doesn't ask for storage info (as seen with some
-	 * older SW versions, e.g. on Ubuntu 8.04), then the free space
-	 * in storage_info will not be updated. This might result in non
-	 * working upload because before upload the free space will be
-	 * checked. Prevent this by running update_free_space() early.
-	 */
-	update_free_space();
+/* Queue thumbnails still missing for the handles after handle, store locked */
+static void thumb_prefetch(struct storage *store, uint32_t handle)
+{
+	char path[PATH_MAX];
+	struct obj_list *obj;
+	int i, n;
 
-	sem_init(&dbaccess, 0, 0);
-	enum_objects(root);
-	sem_post(&dbaccess);
+	/* handles of removed objects leave gaps, don't look too far */
+	for (i = 1, n = 0; i <= 4 * THUMB_PREFETCH && n < THUMB_PREFETCH; i++) {
+		obj = find_object(handle + i);
+		if (!obj || object_is_association(obj))
+			continue;
+		n++;
 
-	if (chdir("/dev/ptp") < 0) {
-		perror("can't chdir /dev/ptp");
-		exit(EXIT_FAILURE);
+		if (!obj->info.thumb_compressed_size &&
+		    __le16_to_cpu(obj->info.thumb_format) == PIMA15740_FMT_I_JFIF &&
+		    get_object_path(obj, path, sizeof(path)) >= 0)
+			thumb_request(store, obj->handle, path, 0);
 	}
+}
 
-	ret = stat(root, &root_stat);
-	if (ret < 0 || !S_ISDIR(root_stat.st_mode) || access(root, R_OK | W_OK) < 0) {
-		fprintf(stderr, "Invalid base directory %s\n", root);
-		exit(EXIT_FAILURE);
-	}
+/* Wait for the thumbnail of an object to be made */
+static void thumb_wait(uint32_t handle)
+{
+	pthread_mutex_lock(&thumb_lock);
 
-	if ((notify_fd = inotify_init()) < 0)
-		perror("inotify init failed");
+	while (thumb_jobs && g_hash_table_lookup(thumb_jobs, GUINT_TO_POINTER(handle)))
+		pthread_cond_wait(&thumb_done, &thumb_lock);
 
-	if ((notify_wd = inotify_add_watch(notify_fd, root, IN_CLOSE_WRITE | IN_DELETE)) < 0)
-		perror("inotify add watch failed");
+	pthread_mutex_unlock(&thumb_lock);
+}
 
-	ret = pthread_create(&inotify_pthread, NULL, inotify_thread, NULL);
-	if (ret < 0) {
-		perror("can't create inotify thread");
-		exit(EXIT_FAILURE);
-	}
+/* Hand the thumbnail over to its object, if that is still where it was */
+static void thumb_finish(struct thumb_job *job, const char *path, int size)
+{
+	char name[PATH_MAX], old[PATH_MAX];
+	struct storage *store = job->store;
+	struct obj_list *obj;
 
-	init_device();
-	if (control < 0)
-		exit(EXIT_FAILURE);
+	lock_storage(store);
 
-	fflush(stderr);
+	obj = find_object(job->handle);
+	if (!obj || get_object_path(obj, name, sizeof(name)) < 0)
+		goto out;
 
-	ret = main_loop();
+	if (strcmp(name, path)) {
+		/* renamed meanwhile, make it again under the new name */
+		pthread_mutex_lock(&thumb_lock);
+		snprintf(job->path, sizeof(job->path), "%s", name);
+		job->again = 1;
+		pthread_mutex_unlock(&thumb_lock);
 
-	inotify_rm_watch(notify_fd, notify_wd);
-	close(notify_fd);
+		if (size > 0 && !thumb_filename(store, path, old, sizeof(old)))
+			thumb_pack_remove(old);
+		goto out;
+	}
 
-	iconv_close(uc);
-	iconv_close(ic);
+	thumb_cache_drop(job->handle);
+	if (size > 0) {
+		obj->info.thumb_compressed_size = __cpu_to_le32(size);
+		obj->thumb_offset = 0;
+	} else {
+		obj->info.thumb_format = __cpu_to_le16(PIMA15740_FMT_A_UNDEFINED);
+		obj->info.thumb_pix_width = __cpu_to_le32(0);
+		obj->info.thumb_pix_height = __cpu_to_le32(0);
+	}
+	send_event(PIMA15740_EVENT_OBJECT_INFO_CHANGED, job->handle);
 
-	exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+out:
+	unlock_storage(store);
 }
 
-#ifdef THUMB_SUPPORT
-static int generate_thumb(const char *file_name)
+static void *thumb_worker(void *param)
 {
-	struct stat fstat, tstat;
-	char thumb[256];
-	char *dot;
+	char path[PATH_MAX];
+	struct thumb_job *job;
+	int size;
+	(void) param;
 
-	if (!file_name)
-		return -1;
+	pthread_mutex_lock(&thumb_lock);
+	for (;;) {
+		while (!(job = g_queue_pop_head(&thumb_queue))) {
+			/* nothing else to do, tidy the pack up */
+			pthread_mutex_unlock(&thumb_lock);
+			thumb_pack_compact();
+			pthread_mutex_lock(&thumb_lock);
+			if (thumb_queue.head)
+				continue;
+			pthread_cond_wait(&thumb_work, &thumb_lock);
+		}
+		job->running = 1;
+		job->again = 0;
+		snprintf(path, sizeof(path), "%s", job->path);
+		pthread_mutex_unlock(&thumb_lock);
+
+		size = generate_thumb(job->store, path);
+		thumb_finish(job, path, size);
+
+		pthread_mutex_lock(&thumb_lock);
+		job->running = 0;
+		if (job->again) {
+			/* it may be waited for */
+			g_queue_push_head(&thumb_queue, job);
+		} else {
+			g_hash_table_remove(thumb_jobs, GUINT_TO_POINTER(job->handle));
+			free(job);
+			pthread_cond_broadcast(&thumb_done);
+		}
+	}
 
-	dot = strrchr(file_name, '.');
-	if (!dot || dot == file_name)
-		return -1;
+	return NULL;
+}
 
-	/* Put thumbnails under /var/cache/ptp/thumb/
-	 * and call them <filename>.thumb.<extension> */
-	*dot = '\0';
-	snprintf(thumb, sizeof(thumb), THUMB_LOCATION "%s.thumb.jpeg",
-		 file_name);
-	*dot = '.';
+/* One worker per CPU, a few at most, the bulk thread must not starve */
+static void start_thumb_workers(void)
+{
+	pthread_t thread;
+	long i, n;
 
-	if (stat(thumb, &tstat) < 0 || tstat.st_mtime < fstat.st_mtime) {
-		pid_t converter;
-		if (verbose)
-			fprintf(stderr, "No or old thumbnail for %s\n", file_name);
-		converter = fork();
-		if (converter < 0) {
-			if (verbose)
-				fprintf(stderr, "Cannot generate thumbnail for %s\n",
-					file_name);
-			return -1;
-		} else if (converter) {
-			int status;
-			waitpid(converter, &status, 0);
-			if (!WIFEXITED(status) || WEXITSTATUS(status) ||
-			    stat(thumb, &tstat) < 0) {
-				if (verbose)
-					fprintf(stderr,
-						"Generate thumbnail for %s failed\n",
-						file_name);
-				return -1;
-			}
-		} else
-			execlp("convert", "convert", "-thumbnail", THUMB_SIZE,
-				       file_name, thumb, NULL);
-	}
-	return tstat.st_size;
+	pack_init();
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	n = n < 1 ? 1 : min(n, (long)THUMB_MAX_WORKERS);
+
+	for (i = 0; i < n; i++)
+		if (pthread_create(&thread, NULL, thumb_worker, NULL))
+			perror("can't create thumbnail worker");
 }
 #endif